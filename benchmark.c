@@ -0,0 +1,525 @@
+/*
+ * Benchmarks of the transfer path against the boot ROM emulator, run by
+ * "meson benchmark". Every suite drives the same code as imx-sdp does for
+ * real boards and writes its results as JSON.
+ */
+#define _GNU_SOURCE
+#include "emulator.h"
+#include "log.h"
+#include "sdp.h"
+#include "stages.h"
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Keep every board small, the scaling suite boots 64 of them */
+#define EMULATOR_MEMORY "mem=80000000:4000000"
+#define LOAD_ADDRESS 0x80000000
+/* Repeat a measurement at least this often and for at least this long */
+#define MIN_ITERATIONS 5
+#define MIN_DURATION_NS 500000000
+#define MAX_SAMPLES 100000
+#define REENUMERATION_BOOT_MS 20
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+/* Durations in nanoseconds, some commands take less than a microsecond */
+struct samples
+{
+    int64_t *ns;
+    int count;
+    int64_t total;
+    /* When the first sample was started */
+    int64_t since;
+};
+
+struct suite
+{
+    const char *name;
+    /* Emulator options the suite is measured with */
+    const char *config;
+    int (*run)(FILE *out);
+};
+
+static char image_dir[] = "/tmp/imx-sdp-benchmark-XXXXXX";
+
+static void discard(void *arg, const char *line)
+{
+    (void)arg;
+    (void)line;
+}
+
+static void print_error(void *arg, const char *line)
+{
+    (void)arg;
+    fprintf(stderr, "%s\n", line);
+}
+
+/* Only errors are printed, the progress of the boots would drown them */
+static void quiet(void)
+{
+    sdp_log_set_handler(discard, print_error, NULL);
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int add_sample(struct samples *samples, int64_t ns)
+{
+    if (!samples->ns && !(samples->ns = malloc(MAX_SAMPLES * sizeof(*samples->ns))))
+    {
+        fprintf(stderr, "ERROR: Allocation failed\n");
+        return 1;
+    }
+    samples->ns[samples->count++] = ns;
+    samples->total += ns;
+    return 0;
+}
+
+/* Whether to stop measuring, going by the wall time since the first sample */
+static bool enough(struct samples *samples, int min_iterations)
+{
+    if (!samples->count)
+    {
+        samples->since = now_ns();
+        return false;
+    }
+    return samples->count == MAX_SAMPLES ||
+           (samples->count >= min_iterations && now_ns() - samples->since >= MIN_DURATION_NS);
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* The sample below which the given fraction of them lies */
+static int64_t percentile(struct samples *samples, double fraction)
+{
+    qsort(samples->ns, samples->count, sizeof(*samples->ns), compare_ns);
+    return samples->ns[(int)(fraction * (samples->count - 1))];
+}
+
+static void free_samples(struct samples *samples)
+{
+    free(samples->ns);
+    *samples = (struct samples){0};
+}
+
+/* Print the duration statistics of samples as members of a JSON object */
+static void print_samples(FILE *out, struct samples *samples)
+{
+    fprintf(out, "\"iterations\": %d, \"mean_us\": %.3f, \"min_us\": %.3f, \"median_us\": %.3f, \"p99_us\": %.3f",
+            samples->count, samples->total / 1e3 / samples->count, percentile(samples, 0) / 1e3,
+            percentile(samples, 0.5) / 1e3, percentile(samples, 0.99) / 1e3);
+}
+
+static double mib_per_s(uint64_t bytes, int64_t ns)
+{
+    return ns > 0 ? bytes / (1024.0 * 1024.0) / (ns / 1e9) : 0;
+}
+
+/* Create an incompressible image of the given size, returns its path */
+static char *make_image(size_t size)
+{
+    char *path;
+    if (asprintf(&path, "%s/%zu.bin", image_dir, size) < 0)
+    {
+        fprintf(stderr, "ERROR: Allocation failed\n");
+        return NULL;
+    }
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "ERROR: Failed to create \"%s\": %s\n", path, strerror(errno));
+        free(path);
+        return NULL;
+    }
+    uint64_t x = 0x9e3779b97f4a7c15ull ^ size;
+    for (size_t i = 0; i < size; i += sizeof(x))
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        fwrite(&x, 1, size - i < sizeof(x) ? size - i : sizeof(x), file);
+    }
+    if (fclose(file))
+    {
+        fprintf(stderr, "ERROR: Failed to write \"%s\"\n", path);
+        unlink(path);
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+/* The steps point into args, which have to outlive the stages */
+static sdp_stages *compile_stages(int count, char *args[])
+{
+    sdp_stages *stages = sdp_parse_stages(count, args);
+    if (!stages)
+        return NULL;
+    if (sdp_compile_stages(stages, false))
+    {
+        sdp_free_stages(stages);
+        return NULL;
+    }
+    return stages;
+}
+
+/* WRITE_FILE throughput of a prepared image, as a stage sends it, for several sizes */
+static int run_throughput(FILE *out)
+{
+    static const size_t sizes[] = {64 << 10, 1 << 20, 16 << 20};
+    int res = 1;
+
+    sdp_transport *handle = sdp_emu_open(0x15a2, 0x0080, "throughput", false, 0);
+    if (!handle)
+        return 1;
+    fprintf(out, "[");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i)
+    {
+        char *path = make_image(sizes[i]);
+        if (!path)
+            goto close_handle;
+        sdp_image *image = sdp_image_open(path);
+        sdp_payload *payload = image ? sdp_payload_new(image) : NULL;
+        struct samples samples = {0};
+        while (payload && !enough(&samples, MIN_ITERATIONS))
+        {
+            int64_t start = now_ns();
+            if (sdp_write_payload(handle, payload, LOAD_ADDRESS) || add_sample(&samples, now_ns() - start))
+                break;
+        }
+        if (payload)
+            sdp_payload_free(payload);
+        if (image)
+            sdp_image_close(image);
+        unlink(path);
+        free(path);
+        if (!enough(&samples, MIN_ITERATIONS))
+        {
+            free_samples(&samples);
+            goto close_handle;
+        }
+
+        fprintf(out, "%s\n    {\"name\": \"write_file\", \"bytes\": %zu, ", i ? "," : "", sizes[i]);
+        print_samples(out, &samples);
+        fprintf(out, ", \"mib_per_s\": %.2f}", mib_per_s(sizes[i], percentile(&samples, 0.5)));
+        free_samples(&samples);
+    }
+    res = 0;
+
+close_handle:
+    fprintf(out, "\n  ]");
+    sdp_transport_close(handle);
+    return res;
+}
+
+/* Round trip of a command answered by the ROM right away */
+static int run_latency(FILE *out)
+{
+    int res = 1;
+    sdp_transport *handle = sdp_emu_open(0x15a2, 0x0080, "latency", false, 0);
+    if (!handle)
+        return 1;
+
+    struct samples samples = {0};
+    while (!enough(&samples, 1000))
+    {
+        uint32_t hab_status, status;
+        int64_t start = now_ns();
+        if (sdp_error_status(handle, &hab_status, &status) || add_sample(&samples, now_ns() - start))
+            goto free_samples;
+    }
+    fprintf(out, "[\n    {\"name\": \"error_status\", ");
+    print_samples(out, &samples);
+    fprintf(out, "}\n  ]");
+    res = 0;
+
+free_samples:
+    free_samples(&samples);
+    sdp_transport_close(handle);
+    return res;
+}
+
+#define REENUMERATION_STAGES 4
+/*
+ * Time from the jump of one stage to the jump of the next, less the time the
+ * emulated board takes to boot: finding and opening the next device and
+ * starting its stage
+ */
+static int run_reenumeration(FILE *out)
+{
+    char stage[REENUMERATION_STAGES][32];
+    char *args[REENUMERATION_STAGES];
+    for (int i = 0; i < REENUMERATION_STAGES; ++i)
+    {
+        snprintf(stage[i], sizeof(stage[i]), "15a2:0080,jump_address:%08x", LOAD_ADDRESS);
+        args[i] = stage[i];
+    }
+    sdp_stages *stages = compile_stages(REENUMERATION_STAGES, args);
+    if (!stages)
+        return 1;
+
+    int res = 1;
+    struct samples samples = {0};
+    while (!enough(&samples, MIN_ITERATIONS))
+    {
+        /* A fresh board for every boot, the last one is still booting */
+        char usb_path[32];
+        snprintf(usb_path, sizeof(usb_path), "reenumeration-%d", samples.count);
+        int64_t start = now_ns();
+        if (sdp_execute_stages(stages, false, usb_path, NULL))
+            goto free_samples;
+        int64_t overhead = now_ns() - start - (REENUMERATION_STAGES - 1) * REENUMERATION_BOOT_MS * 1000000ll;
+        if (add_sample(&samples, overhead / (REENUMERATION_STAGES - 1)))
+            goto free_samples;
+        sdp_emu_cleanup();
+    }
+    fprintf(out, "[\n    {\"name\": \"stage_transition\", \"boot_ms\": %d, ", REENUMERATION_BOOT_MS);
+    print_samples(out, &samples);
+    fprintf(out, "}\n  ]");
+    res = 0;
+
+free_samples:
+    free_samples(&samples);
+    sdp_free_stages(stages);
+    return res;
+}
+
+#define SCALING_IMAGE_SIZE (1 << 20)
+#define SCALING_MAX_BOARDS 64
+
+struct board
+{
+    pthread_t thread;
+    const sdp_stages *stages;
+    char usb_path[32];
+    int result;
+};
+
+static void *boot_board(void *arg)
+{
+    struct board *board = arg;
+    quiet();
+    board->result = sdp_execute_stages(board->stages, false, board->usb_path, NULL);
+    return NULL;
+}
+
+/* Boot 1 to 64 boards at once, each on a thread of its own like a gang */
+static int run_scaling(FILE *out)
+{
+    int res = 1;
+    char *path = make_image(SCALING_IMAGE_SIZE);
+    if (!path)
+        return 1;
+    char *stage;
+    if (asprintf(&stage, "15a2:0080,write_file:%s:%08x,jump_address:%08x", path, LOAD_ADDRESS, LOAD_ADDRESS) < 0)
+    {
+        fprintf(stderr, "ERROR: Allocation failed\n");
+        goto free_path;
+    }
+    sdp_stages *stages = compile_stages(1, &stage);
+    if (!stages)
+        goto free_stage;
+
+    struct board *boards = calloc(SCALING_MAX_BOARDS, sizeof(*boards));
+    if (!boards)
+    {
+        fprintf(stderr, "ERROR: Allocation failed\n");
+        goto free_stages;
+    }
+    fprintf(out, "[");
+    for (int count = 1; count <= SCALING_MAX_BOARDS; count *= 2)
+    {
+        struct samples samples = {0};
+        while (!enough(&samples, MIN_ITERATIONS))
+        {
+            int started = 0;
+            int64_t start = now_ns();
+            for (; started < count; ++started)
+            {
+                struct board *board = boards + started;
+                board->stages = stages;
+                snprintf(board->usb_path, sizeof(board->usb_path), "scaling-%d", started);
+                if (pthread_create(&board->thread, NULL, boot_board, board))
+                {
+                    fprintf(stderr, "ERROR: Failed to start a board thread\n");
+                    break;
+                }
+            }
+            bool failed = started < count;
+            for (int i = 0; i < started; ++i)
+            {
+                pthread_join(boards[i].thread, NULL);
+                failed = failed || boards[i].result;
+            }
+            int64_t elapsed = now_ns() - start;
+            sdp_emu_cleanup();
+            if (failed || add_sample(&samples, elapsed))
+            {
+                free_samples(&samples);
+                goto free_boards;
+            }
+        }
+
+        int64_t median = percentile(&samples, 0.5);
+        fprintf(out, "%s\n    {\"name\": \"boards\", \"boards\": %d, \"bytes\": %d, ", count > 1 ? "," : "", count,
+                SCALING_IMAGE_SIZE);
+        print_samples(out, &samples);
+        fprintf(out, ", \"mib_per_s\": %.2f, \"mib_per_s_per_board\": %.2f}",
+                mib_per_s((uint64_t)count * SCALING_IMAGE_SIZE, median), mib_per_s(SCALING_IMAGE_SIZE, median));
+        free_samples(&samples);
+    }
+    res = 0;
+
+free_boards:
+    fprintf(out, "\n  ]");
+    free(boards);
+free_stages:
+    sdp_free_stages(stages);
+free_stage:
+    free(stage);
+free_path:
+    unlink(path);
+    free(path);
+    return res;
+}
+
+static const struct suite suites[] = {
+    {"throughput", EMULATOR_MEMORY, run_throughput},
+    {"latency", EMULATOR_MEMORY, run_latency},
+    {"reenumeration", EMULATOR_MEMORY ",boot=" STRINGIFY(REENUMERATION_BOOT_MS), run_reenumeration},
+    {"scaling", EMULATOR_MEMORY, run_scaling},
+};
+
+static void usage(const char *progname)
+{
+    printf(
+        "Usage: %s [OPTION]... <SUITE>\n"
+        "\n"
+        "Run a benchmark SUITE against the boot ROM emulator and print the results\n"
+        "as JSON. The following OPTIONs are available:\n"
+        "\n"
+        "  -e, --emulate  further emulator options, e.g. latency=125,queue=8\n"
+        "  -h, --help  print this usage message\n"
+        "  -o, --output  write the results to the given file instead\n"
+        "\n"
+        "SUITE is one of:\n"
+        "\n"
+        "  throughput     WRITE_FILE of 64 KiB, 1 MiB and 16 MiB images\n"
+        "  latency        round trip of an ERROR_STATUS command\n"
+        "  reenumeration  overhead of moving from one stage to the next\n"
+        "  scaling        booting 1 to 64 boards concurrently\n",
+        progname);
+}
+
+static const struct option longopts[] = {
+    {"emulate", required_argument, NULL, 'e'},
+    {"help", no_argument, NULL, 'h'},
+    {"output", required_argument, NULL, 'o'},
+    {0},
+};
+
+int main(int argc, char *argv[])
+{
+    const char *emulate = NULL;
+    const char *output = NULL;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "e:ho:", longopts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            emulate = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const struct suite *suite = NULL;
+    for (size_t i = 0; i < sizeof(suites) / sizeof(*suites); ++i)
+    {
+        if (!strcmp(suites[i].name, argv[optind]))
+            suite = suites + i;
+    }
+    if (!suite)
+    {
+        fprintf(stderr, "ERROR: Unknown suite \"%s\"\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (sdp_emu_configure(suite->config) || (emulate && sdp_emu_configure(emulate)))
+        return EXIT_FAILURE;
+    if (!mkdtemp(image_dir))
+    {
+        fprintf(stderr, "ERROR: Failed to create a directory for images: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    quiet();
+
+    /* Collect the results first, a failed suite leaves no partial file behind */
+    char *json;
+    size_t json_size;
+    FILE *out = open_memstream(&json, &json_size);
+    if (!out)
+    {
+        fprintf(stderr, "ERROR: Allocation failed\n");
+        rmdir(image_dir);
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "{\n  \"suite\": \"%s\",\n  \"emulator\": \"%s%s%s\",\n  \"results\": ", suite->name, suite->config,
+            emulate ? "," : "", emulate ? emulate : "");
+    int res = suite->run(out);
+    fprintf(out, "\n}\n");
+    fclose(out);
+    rmdir(image_dir);
+    sdp_emu_cleanup();
+
+    if (!res)
+    {
+        FILE *file = output ? fopen(output, "w") : stdout;
+        if (!file)
+        {
+            fprintf(stderr, "ERROR: Failed to create \"%s\": %s\n", output, strerror(errno));
+            res = 1;
+        }
+        else
+        {
+            fwrite(json, 1, json_size, file);
+            if (output && fclose(file))
+            {
+                fprintf(stderr, "ERROR: Failed to write \"%s\"\n", output);
+                res = 1;
+            }
+            else if (output)
+                printf("%s", json);
+        }
+    }
+    free(json);
+    return res ? EXIT_FAILURE : EXIT_SUCCESS;
+}
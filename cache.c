@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include "cache.h"
+#include "log.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_PREFIX "imx-sdp-"
+#define CACHE_MAX_BYTES (256 * 1024 * 1024)
+
+/* "imx-sdp-" + path hash + "-" + stat hash */
+#define CACHE_NAME_LEN (sizeof(CACHE_PREFIX) - 1 + 16 + 1 + 16)
+
+static int cache_dir_fd = -1;
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int entry_name(const char *path, const struct stat *st, char *name, size_t size)
+{
+    char real[PATH_MAX];
+    if (!realpath(path, real))
+        return 1;
+
+    uint64_t path_hash = fnv1a(0xcbf29ce484222325ULL, real, strlen(real));
+
+    uint64_t stat_hash = 0xcbf29ce484222325ULL;
+    stat_hash = fnv1a(stat_hash, &st->st_dev, sizeof(st->st_dev));
+    stat_hash = fnv1a(stat_hash, &st->st_ino, sizeof(st->st_ino));
+    stat_hash = fnv1a(stat_hash, &st->st_size, sizeof(st->st_size));
+    stat_hash = fnv1a(stat_hash, &st->st_mtim.tv_sec, sizeof(st->st_mtim.tv_sec));
+    stat_hash = fnv1a(stat_hash, &st->st_mtim.tv_nsec, sizeof(st->st_mtim.tv_nsec));
+
+    snprintf(name, size, CACHE_PREFIX "%016" PRIx64 "-%016" PRIx64, path_hash, stat_hash);
+    return 0;
+}
+
+int sdp_cache_init(const char *dir)
+{
+    sdp_cache_cleanup();
+    cache_dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cache_dir_fd < 0)
+    {
+        sdp_error("ERROR: Failed to open cache directory \"%s\": %s\n", dir, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+void sdp_cache_cleanup(void)
+{
+    if (cache_dir_fd >= 0)
+        close(cache_dir_fd);
+    cache_dir_fd = -1;
+}
+
+int sdp_cache_enabled(void)
+{
+    return cache_dir_fd >= 0;
+}
+
+static int open_entry(const char *name, off_t size)
+{
+    int fd = openat(cache_dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0)
+        return -1;
+
+    /* Only trust entries we published ourselves */
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+        (st.st_mode & 0222) || st.st_size != size)
+    {
+        close(fd);
+        return -1;
+    }
+
+    /* Mark the entry as recently used for eviction */
+    futimens(fd, NULL);
+    return fd;
+}
+
+int sdp_cache_lookup(const char *path, const struct stat *st)
+{
+    char name[CACHE_NAME_LEN + 1];
+    if (!sdp_cache_enabled() || entry_name(path, st, name, sizeof(name)))
+        return -1;
+    return open_entry(name, st->st_size);
+}
+
+struct entry
+{
+    char name[CACHE_NAME_LEN + 1];
+    off_t size;
+    struct timespec used;
+};
+
+static int compare_used(const void *a, const void *b)
+{
+    const struct entry *ea = a, *eb = b;
+    if (ea->used.tv_sec != eb->used.tv_sec)
+        return ea->used.tv_sec < eb->used.tv_sec ? -1 : 1;
+    if (ea->used.tv_nsec != eb->used.tv_nsec)
+        return ea->used.tv_nsec < eb->used.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Remove other versions of the entry called name and evict the least
+ * recently used entries until incoming more bytes fit. Entries that are
+ * still mapped by other processes stay valid until they are unmapped.
+ */
+static void evict(const char *name, size_t incoming)
+{
+    int fd = dup(cache_dir_fd);
+    if (fd < 0)
+        return;
+    DIR *dir = fdopendir(fd);
+    if (!dir)
+    {
+        close(fd);
+        return;
+    }
+
+    /* Entries with the same path hash are older versions of this file */
+    size_t path_len = sizeof(CACHE_PREFIX) - 1 + 16;
+    struct entry *entries = NULL;
+    size_t count = 0, capacity = 0;
+    uint64_t total = incoming;
+    struct dirent *d;
+    while ((d = readdir(dir)))
+    {
+        if (strncmp(d->d_name, CACHE_PREFIX, sizeof(CACHE_PREFIX) - 1) ||
+            strlen(d->d_name) != CACHE_NAME_LEN)
+            continue;
+
+        struct stat st;
+        if (fstatat(cache_dir_fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) ||
+            !S_ISREG(st.st_mode) || st.st_uid != geteuid())
+            continue;
+
+        if (!strncmp(d->d_name, name, path_len))
+        {
+            unlinkat(cache_dir_fd, d->d_name, 0);
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 16;
+            struct entry *tmp = realloc(entries, capacity * sizeof(*entries));
+            if (!tmp)
+                break;
+            entries = tmp;
+        }
+        strcpy(entries[count].name, d->d_name);
+        entries[count].size = st.st_size;
+        entries[count].used = st.st_mtim;
+        total += st.st_size;
+        ++count;
+    }
+    closedir(dir);
+
+    qsort(entries, count, sizeof(*entries), compare_used);
+    for (size_t i = 0; i < count && total > CACHE_MAX_BYTES; ++i)
+    {
+        if (!unlinkat(cache_dir_fd, entries[i].name, 0))
+            total -= entries[i].size;
+    }
+    free(entries);
+}
+
+static int write_all(int fd, const unsigned char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = write(fd, data, size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int sdp_cache_store(const char *path, const struct stat *st, const void *data, size_t size)
+{
+    char name[CACHE_NAME_LEN + 1];
+    if (!sdp_cache_enabled() || size > CACHE_MAX_BYTES ||
+        entry_name(path, st, name, sizeof(name)))
+        return -1;
+
+    evict(name, size);
+
+    /*
+     * Fill an anonymous file and link it into place once complete, so other
+     * processes never see a partial entry. If someone else was faster, use
+     * their entry.
+     */
+    int fd = openat(cache_dir_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0444);
+    if (fd < 0)
+    {
+        sdp_error("ERROR: Failed to create cache entry: %s\n", strerror(errno));
+        return -1;
+    }
+    if (write_all(fd, data, size))
+    {
+        sdp_error("ERROR: Failed to write cache entry: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    if (linkat(AT_FDCWD, proc_path, cache_dir_fd, name, AT_SYMLINK_FOLLOW) && errno != EEXIST)
+    {
+        sdp_error("ERROR: Failed to publish cache entry: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    return open_entry(name, size);
+}
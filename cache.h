@@ -0,0 +1,32 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+ * Host-wide image cache shared between imx-sdp processes. Entries are
+ * read-only files in a (preferably tmpfs) directory, named after the source
+ * file's path and its device, inode, size and modification time. The first
+ * process to load an image publishes it atomically, later ones map the entry
+ * instead of reading the source file again.
+ */
+int sdp_cache_init(const char *dir);
+void sdp_cache_cleanup(void);
+int sdp_cache_enabled(void);
+
+/*
+ * Return a read-only file descriptor of the entry for the file at path with
+ * status st, or -1 if there is none.
+ */
+int sdp_cache_lookup(const char *path, const struct stat *st);
+
+/*
+ * Publish data as the entry for path. Stale entries of the same path are
+ * removed, and least recently used entries are evicted to keep the cache
+ * below its size limit. Returns a read-only file descriptor of the entry, or
+ * -1 on error.
+ */
+int sdp_cache_store(const char *path, const struct stat *st, const void *data, size_t size);
+
+#endif
@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+#include "daemon.h"
+#include "gang.h"
+#include "log.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * The daemon keeps a gang engine running and boots every board whose first
+ * stage device appears on an allowed USB path. Jobs can be controlled through
+ * a line based protocol on a Unix socket:
+ *
+ *   submit <USB-PATH>   boot the board on USB-PATH, replies "OK <ID>"
+ *   cancel <ID>         cancel a job
+ *   status [<ID>]       list jobs as "<ID> <PATH> <STATE> <STAGE>/<COUNT> <SECONDS>[ <FAILURE>]"
+ *
+ * Every command is answered with zero or more data lines followed by "OK" or
+ * "ERROR <MESSAGE>".
+ */
+
+struct client
+{
+    struct daemon *daemon;
+    int fd;
+    char buf[256];
+    size_t len;
+    struct client *next;
+};
+
+struct daemon
+{
+    sdp_gang *gang;
+    int listen_fd;
+    int signal_fd;
+    struct client *clients;
+};
+
+struct status_args
+{
+    int fd;
+    int id;
+};
+
+static void print_job(const struct sdp_gang_job *job, void *arg)
+{
+    struct status_args *args = arg;
+    if (args->id && job->id != args->id)
+        return;
+    dprintf(args->fd, "%d %s %s %d/%d %.2f%s%s\n", job->id, job->usb_path, job->state, job->stage,
+            job->stage_count, job->seconds, job->failure ? " " : "", job->failure ? job->failure : "");
+}
+
+static void handle_command(struct client *client, char *line)
+{
+    char *saveptr = NULL;
+    const char *cmd = strtok_r(line, " \t", &saveptr);
+    const char *arg = strtok_r(NULL, " \t", &saveptr);
+    sdp_gang *gang = client->daemon->gang;
+
+    if (!cmd)
+        return;
+
+    if (!strcmp(cmd, "submit"))
+    {
+        if (!arg)
+        {
+            dprintf(client->fd, "ERROR Missing USB path\n");
+            return;
+        }
+        int id = sdp_gang_add_board(gang, arg);
+        if (id < 0)
+            dprintf(client->fd, "ERROR Failed to submit job\n");
+        else
+            dprintf(client->fd, "OK %d\n", id);
+    }
+    else if (!strcmp(cmd, "cancel"))
+    {
+        if (!arg || sdp_gang_cancel(gang, atoi(arg)))
+            dprintf(client->fd, "ERROR No such active job\n");
+        else
+            dprintf(client->fd, "OK\n");
+    }
+    else if (!strcmp(cmd, "status"))
+    {
+        struct status_args args = {
+            .fd = client->fd,
+            .id = arg ? atoi(arg) : 0,
+        };
+        sdp_gang_foreach_job(gang, print_job, &args);
+        dprintf(client->fd, "OK\n");
+    }
+    else
+        dprintf(client->fd, "ERROR Unknown command \"%s\"\n", cmd);
+}
+
+static void free_client(struct client *client)
+{
+    struct daemon *daemon = client->daemon;
+    for (struct client **c = &daemon->clients; *c; c = &(*c)->next)
+    {
+        if (*c == client)
+        {
+            *c = client->next;
+            break;
+        }
+    }
+    sdp_gang_unwatch_fd(daemon->gang, client->fd);
+    close(client->fd);
+    free(client);
+}
+
+static void handle_client(void *arg)
+{
+    struct client *client = arg;
+    ssize_t n = read(client->fd, client->buf + client->len, sizeof(client->buf) - client->len - 1);
+    if (n <= 0)
+    {
+        free_client(client);
+        return;
+    }
+    client->len += n;
+    client->buf[client->len] = '\0';
+
+    char *start = client->buf;
+    char *nl;
+    while ((nl = strchr(start, '\n')))
+    {
+        *nl = '\0';
+        if (nl > start && nl[-1] == '\r')
+            nl[-1] = '\0';
+        handle_command(client, start);
+        start = nl + 1;
+    }
+
+    client->len = client->buf + client->len - start;
+    if (client->len == sizeof(client->buf) - 1)
+    {
+        dprintf(client->fd, "ERROR Line too long\n");
+        free_client(client);
+        return;
+    }
+    memmove(client->buf, start, client->len);
+}
+
+static void handle_accept(void *arg)
+{
+    struct daemon *daemon = arg;
+    int fd = accept4(daemon->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+        sdp_error("ERROR: Failed to accept control connection: %s\n", strerror(errno));
+        return;
+    }
+
+    struct client *client = calloc(1, sizeof(struct client));
+    if (!client)
+    {
+        sdp_error("ERROR: Failed to allocate client: %s\n", strerror(errno));
+        close(fd);
+        return;
+    }
+    client->daemon = daemon;
+    client->fd = fd;
+    if (sdp_gang_watch_fd(daemon->gang, fd, handle_client, client))
+    {
+        close(fd);
+        free(client);
+        return;
+    }
+    client->next = daemon->clients;
+    daemon->clients = client;
+}
+
+static void handle_signal(void *arg)
+{
+    struct daemon *daemon = arg;
+    struct signalfd_siginfo info;
+    if (read(daemon->signal_fd, &info, sizeof(info)) != sizeof(info))
+        return;
+    sdp_info("Received signal %d, shutting down\n", info.ssi_signo);
+    sdp_gang_stop(daemon->gang);
+}
+
+static int open_socket(const char *socket_path)
+{
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX,
+    };
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        sdp_error("ERROR: Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        sdp_error("ERROR: Failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Remove a stale socket left behind by a previous instance */
+    struct stat st;
+    if (!lstat(socket_path, &st) && S_ISSOCK(st.st_mode))
+        unlink(socket_path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 8))
+    {
+        sdp_error("ERROR: Failed to listen on %s: %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int sdp_daemon_run(const sdp_stages *stages, const char *socket_path,
+                   const char *usb_paths[], int usb_path_count)
+{
+    int res = 1;
+    struct daemon daemon = {
+        .listen_fd = -1,
+        .signal_fd = -1,
+    };
+
+    daemon.gang = sdp_gang_new(stages, true);
+    if (!daemon.gang)
+        return 1;
+    for (int i = 0; i < usb_path_count; ++i)
+    {
+        if (sdp_gang_allow_path(daemon.gang, usb_paths[i]))
+            goto free_gang;
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    daemon.signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (daemon.signal_fd < 0)
+    {
+        sdp_error("ERROR: Failed to create signalfd: %s\n", strerror(errno));
+        goto free_gang;
+    }
+    if (sdp_gang_watch_fd(daemon.gang, daemon.signal_fd, handle_signal, &daemon))
+        goto close_signal_fd;
+
+    daemon.listen_fd = open_socket(socket_path);
+    if (daemon.listen_fd < 0)
+        goto close_signal_fd;
+    if (sdp_gang_watch_fd(daemon.gang, daemon.listen_fd, handle_accept, &daemon))
+        goto close_socket;
+
+    sdp_info("Listening on %s\n", socket_path);
+    res = sdp_gang_serve(daemon.gang);
+
+    while (daemon.clients)
+        free_client(daemon.clients);
+
+close_socket:
+    close(daemon.listen_fd);
+    unlink(socket_path);
+close_signal_fd:
+    close(daemon.signal_fd);
+free_gang:
+    sdp_gang_free(daemon.gang);
+    return res;
+}
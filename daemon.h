@@ -0,0 +1,9 @@
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#include "stages.h"
+
+int sdp_daemon_run(const sdp_stages *stages, const char *socket_path,
+                   const char *usb_paths[], int usb_path_count);
+
+#endif
@@ -0,0 +1,100 @@
+#include "deadline.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static struct sdp_timeouts timeouts = {
+    .device_ms = SDP_DEFAULT_DEVICE_TIMEOUT_MS,
+};
+
+static int parse_timeout(const char *key, const char *value)
+{
+    if (!value)
+        return 1;
+    char *end;
+    unsigned long ms = strtoul(value, &end, 10);
+    if (end == value || *end || ms > INT32_MAX)
+        return 1;
+
+    if (!strcmp(key, "io"))
+        timeouts.io_ms = ms;
+    else if (!strcmp(key, "device"))
+        timeouts.device_ms = ms;
+    else if (!strcmp(key, "stage"))
+        timeouts.stage_ms = ms;
+    else if (!strcmp(key, "run"))
+        timeouts.run_ms = ms;
+    else
+        return 1;
+    return 0;
+}
+
+int sdp_timeouts_configure(const char *s)
+{
+    char *copy = strdup(s);
+    if (!copy)
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        return 1;
+    }
+
+    int res = 0;
+    char *saveptr = NULL;
+    for (char *tok = strtok_r(copy, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr))
+    {
+        char *value = strchr(tok, '=');
+        if (value)
+            *value++ = '\0';
+        if (parse_timeout(tok, value))
+        {
+            sdp_error("ERROR: Invalid timeout \"%s\"\n", tok);
+            res = 1;
+            break;
+        }
+    }
+
+    free(copy);
+    return res;
+}
+
+const struct sdp_timeouts *sdp_timeouts(void)
+{
+    return &timeouts;
+}
+
+int64_t sdp_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t sdp_deadline_after(int timeout_ms)
+{
+    return timeout_ms ? sdp_now_ms() + timeout_ms : 0;
+}
+
+int64_t sdp_deadline_min(int64_t a, int64_t b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    return a < b ? a : b;
+}
+
+bool sdp_deadline_expired(int64_t deadline)
+{
+    return deadline && sdp_now_ms() >= deadline;
+}
+
+int sdp_deadline_timeout(int64_t deadline, int timeout)
+{
+    if (!deadline)
+        return timeout;
+    int64_t remaining = deadline - sdp_now_ms();
+    if (remaining < 0)
+        remaining = 0;
+    return timeout >= 0 && timeout < remaining ? timeout : (int)remaining;
+}
@@ -0,0 +1,41 @@
+#ifndef DEADLINE_H_
+#define DEADLINE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Deadlines are absolute times in milliseconds on the monotonic clock, 0
+ * stands for none. Timeouts are relative, with 0 standing for none as well.
+ */
+#define SDP_DEFAULT_DEVICE_TIMEOUT_MS 20000
+
+struct sdp_timeouts
+{
+    /* Each report read from the device */
+    int io_ms;
+    /* Waiting for the device of a stage to show up */
+    int device_ms;
+    /* A whole stage, including the wait for its device */
+    int stage_ms;
+    /* All stages of a board */
+    int run_ms;
+};
+
+/* Parse a comma separated list of io=, device=, stage= and run= timeouts */
+int sdp_timeouts_configure(const char *s);
+const struct sdp_timeouts *sdp_timeouts(void);
+
+int64_t sdp_now_ms(void);
+/* The deadline timeout_ms from now, or 0 if timeout_ms is 0 */
+int64_t sdp_deadline_after(int timeout_ms);
+/* The earlier of two deadlines */
+int64_t sdp_deadline_min(int64_t a, int64_t b);
+bool sdp_deadline_expired(int64_t deadline);
+/*
+ * Milliseconds left until deadline for a poll() style timeout, at most
+ * timeout if that is not negative
+ */
+int sdp_deadline_timeout(int64_t deadline, int timeout);
+
+#endif
@@ -0,0 +1,460 @@
+#include "decoder.h"
+#include "config.h"
+#include "log.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+#define SCAN_BUFFER_SIZE (64 * 1024)
+#define SIZE_UNKNOWN UINT64_MAX
+
+struct format
+{
+    const char *name;
+    unsigned char magic[4];
+    /* Content size from the frame header, or SIZE_UNKNOWN */
+    uint64_t (*content_size)(const unsigned char *data, size_t size);
+    void *(*open)(const unsigned char *data, size_t size, char *error, size_t error_size);
+    /*
+     * Fill out completely unless the stream ends first. Returns the number of
+     * bytes produced, 0 at the end of the stream and -1 on error.
+     */
+    ssize_t (*read)(void *ctx, unsigned char *out, size_t length, char *error, size_t error_size);
+    void (*close)(void *ctx);
+};
+
+struct sdp_decoder_
+{
+    const struct format *format;
+    const sdp_image *image;
+    void *ctx;
+    uint32_t size;
+    /* Bytes returned so far */
+    uint64_t total;
+    bool failed;
+    char error[128];
+};
+
+#ifdef WITH_ZLIB
+struct gzip
+{
+    z_stream z;
+    bool member_end;
+};
+
+static uint64_t gzip_content_size(const unsigned char *data, size_t size)
+{
+    (void)data;
+    (void)size;
+    /* ISIZE is modulo 2^32 and covers the last member only */
+    return SIZE_UNKNOWN;
+}
+
+static void *gzip_open(const unsigned char *data, size_t size, char *error, size_t error_size)
+{
+    if (size > UINT_MAX)
+    {
+        snprintf(error, error_size, "File too large");
+        return NULL;
+    }
+    struct gzip *gzip = calloc(1, sizeof(*gzip));
+    if (!gzip)
+    {
+        snprintf(error, error_size, "Out of memory");
+        return NULL;
+    }
+    if (inflateInit2(&gzip->z, 16 + MAX_WBITS) != Z_OK)
+    {
+        snprintf(error, error_size, "Failed to initialize zlib");
+        free(gzip);
+        return NULL;
+    }
+    gzip->z.next_in = (Bytef *)data;
+    gzip->z.avail_in = size;
+    return gzip;
+}
+
+static ssize_t gzip_read(void *ctx, unsigned char *out, size_t length, char *error, size_t error_size)
+{
+    struct gzip *gzip = ctx;
+    gzip->z.next_out = out;
+    gzip->z.avail_out = length;
+    while (gzip->z.avail_out > 0)
+    {
+        if (gzip->member_end)
+        {
+            if (gzip->z.avail_in == 0)
+                break;
+            /* Concatenated members decompress to the concatenated data */
+            inflateReset(&gzip->z);
+            gzip->member_end = false;
+        }
+        int ret = inflate(&gzip->z, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)
+            gzip->member_end = true;
+        else if (ret == Z_BUF_ERROR && gzip->z.avail_in == 0)
+        {
+            snprintf(error, error_size, "Truncated gzip stream");
+            return -1;
+        }
+        else if (ret != Z_OK)
+        {
+            snprintf(error, error_size, "Corrupt gzip stream: %s",
+                     gzip->z.msg ? gzip->z.msg : "unknown error");
+            return -1;
+        }
+    }
+    return length - gzip->z.avail_out;
+}
+
+static void gzip_close(void *ctx)
+{
+    struct gzip *gzip = ctx;
+    inflateEnd(&gzip->z);
+    free(gzip);
+}
+#endif
+
+#ifdef WITH_ZSTD
+struct zstd
+{
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer in;
+    size_t hint;
+};
+
+static uint64_t zstd_content_size(const unsigned char *data, size_t size)
+{
+    /* Only trust the header if there are no further frames */
+    size_t frame_size = ZSTD_findFrameCompressedSize(data, size);
+    if (ZSTD_isError(frame_size) || frame_size != size)
+        return SIZE_UNKNOWN;
+    unsigned long long content_size = ZSTD_getFrameContentSize(data, size);
+    if (content_size == ZSTD_CONTENTSIZE_UNKNOWN || content_size == ZSTD_CONTENTSIZE_ERROR)
+        return SIZE_UNKNOWN;
+    return content_size;
+}
+
+static void *zstd_open(const unsigned char *data, size_t size, char *error, size_t error_size)
+{
+    struct zstd *zstd = calloc(1, sizeof(*zstd));
+    if (!zstd)
+    {
+        snprintf(error, error_size, "Out of memory");
+        return NULL;
+    }
+    zstd->dctx = ZSTD_createDCtx();
+    if (!zstd->dctx)
+    {
+        snprintf(error, error_size, "Failed to initialize zstd");
+        free(zstd);
+        return NULL;
+    }
+    zstd->in.src = data;
+    zstd->in.size = size;
+    return zstd;
+}
+
+static ssize_t zstd_read(void *ctx, unsigned char *out, size_t length, char *error, size_t error_size)
+{
+    struct zstd *zstd = ctx;
+    ZSTD_outBuffer buf = {out, length, 0};
+    while (buf.pos < buf.size)
+    {
+        /* A hint of 0 means the last frame is complete and flushed */
+        if (zstd->in.pos == zstd->in.size && zstd->hint == 0)
+            break;
+        size_t in_pos = zstd->in.pos, out_pos = buf.pos;
+        size_t ret = ZSTD_decompressStream(zstd->dctx, &buf, &zstd->in);
+        if (ZSTD_isError(ret))
+        {
+            snprintf(error, error_size, "Corrupt zstd stream: %s", ZSTD_getErrorName(ret));
+            return -1;
+        }
+        zstd->hint = ret;
+        if (zstd->in.pos == in_pos && buf.pos == out_pos)
+        {
+            snprintf(error, error_size, "Truncated zstd stream");
+            return -1;
+        }
+    }
+    return buf.pos;
+}
+
+static void zstd_close(void *ctx)
+{
+    struct zstd *zstd = ctx;
+    ZSTD_freeDCtx(zstd->dctx);
+    free(zstd);
+}
+#endif
+
+#ifdef WITH_LZ4
+struct lz4
+{
+    LZ4F_dctx *dctx;
+    const unsigned char *src;
+    size_t remaining;
+    size_t hint;
+};
+
+static uint64_t lz4_content_size(const unsigned char *data, size_t size)
+{
+    /* Magic, FLG, BD and the optional 64 bit little-endian content size */
+    if (size < 14 || !(data[4] & 0x08))
+        return SIZE_UNKNOWN;
+    uint64_t content_size = 0;
+    for (int i = 7; i >= 0; --i)
+        content_size = content_size << 8 | data[6 + i];
+    return content_size;
+}
+
+static void *lz4_open(const unsigned char *data, size_t size, char *error, size_t error_size)
+{
+    struct lz4 *lz4 = calloc(1, sizeof(*lz4));
+    if (!lz4)
+    {
+        snprintf(error, error_size, "Out of memory");
+        return NULL;
+    }
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&lz4->dctx, LZ4F_VERSION)))
+    {
+        snprintf(error, error_size, "Failed to initialize lz4");
+        free(lz4);
+        return NULL;
+    }
+    lz4->src = data;
+    lz4->remaining = size;
+    lz4->hint = 1;
+    return lz4;
+}
+
+static ssize_t lz4_read(void *ctx, unsigned char *out, size_t length, char *error, size_t error_size)
+{
+    struct lz4 *lz4 = ctx;
+    size_t produced = 0;
+    while (produced < length)
+    {
+        size_t dst_size = length - produced, src_size = lz4->remaining;
+        size_t ret = LZ4F_decompress(lz4->dctx, out + produced, &dst_size,
+                                     lz4->src, &src_size, NULL);
+        if (LZ4F_isError(ret))
+        {
+            snprintf(error, error_size, "Corrupt lz4 stream: %s", LZ4F_getErrorName(ret));
+            return -1;
+        }
+        if (dst_size == 0 && src_size == 0)
+        {
+            /* No progress, fine if the previous call completed a frame */
+            if (lz4->hint != 0)
+            {
+                snprintf(error, error_size, "Truncated lz4 stream");
+                return -1;
+            }
+            break;
+        }
+        lz4->src += src_size;
+        lz4->remaining -= src_size;
+        produced += dst_size;
+        lz4->hint = ret;
+    }
+    return produced;
+}
+
+static void lz4_close(void *ctx)
+{
+    struct lz4 *lz4 = ctx;
+    LZ4F_freeDecompressionContext(lz4->dctx);
+    free(lz4);
+}
+#endif
+
+static const struct format formats[] = {
+    {
+        .name = "gzip",
+        .magic = {0x1f, 0x8b, 0x08},
+#ifdef WITH_ZLIB
+        .content_size = gzip_content_size,
+        .open = gzip_open,
+        .read = gzip_read,
+        .close = gzip_close,
+#endif
+    },
+    {
+        .name = "zstd",
+        .magic = {0x28, 0xb5, 0x2f, 0xfd},
+#ifdef WITH_ZSTD
+        .content_size = zstd_content_size,
+        .open = zstd_open,
+        .read = zstd_read,
+        .close = zstd_close,
+#endif
+    },
+    {
+        .name = "lz4",
+        .magic = {0x04, 0x22, 0x4d, 0x18},
+#ifdef WITH_LZ4
+        .content_size = lz4_content_size,
+        .open = lz4_open,
+        .read = lz4_read,
+        .close = lz4_close,
+#endif
+    },
+};
+
+static const struct format *detect_format(const sdp_image *image)
+{
+    const unsigned char *data = sdp_image_data(image);
+    size_t size = sdp_image_size(image);
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i)
+    {
+        /* gzip has a three byte magic, the unused byte is zero */
+        size_t magic_len = formats[i].magic[3] ? 4 : 3;
+        if (size >= magic_len && !memcmp(data, formats[i].magic, magic_len))
+            return &formats[i];
+    }
+    return NULL;
+}
+
+bool sdp_decoder_detect(const sdp_image *image)
+{
+    return detect_format(image) != NULL;
+}
+
+static int scan_size(sdp_decoder *decoder, uint64_t *size)
+{
+    const unsigned char *data = sdp_image_data(decoder->image);
+    size_t data_size = sdp_image_size(decoder->image);
+    void *ctx = decoder->format->open(data, data_size, decoder->error, sizeof(decoder->error));
+    if (!ctx)
+        return 1;
+
+    unsigned char *buf = malloc(SCAN_BUFFER_SIZE);
+    if (!buf)
+    {
+        snprintf(decoder->error, sizeof(decoder->error), "Out of memory");
+        decoder->format->close(ctx);
+        return 1;
+    }
+
+    int res = 0;
+    ssize_t n;
+    *size = 0;
+    while ((n = decoder->format->read(ctx, buf, SCAN_BUFFER_SIZE, decoder->error,
+                                      sizeof(decoder->error))) > 0)
+        *size += n;
+    if (n < 0)
+        res = 1;
+
+    free(buf);
+    decoder->format->close(ctx);
+    return res;
+}
+
+sdp_decoder *sdp_decoder_open(const sdp_image *image)
+{
+    const struct format *format = detect_format(image);
+    if (!format)
+    {
+        sdp_error("ERROR: \"%s\" is not compressed\n", sdp_image_path(image));
+        return NULL;
+    }
+    if (!format->open)
+    {
+        sdp_error("ERROR: \"%s\" is %s compressed, which is not supported by this build\n",
+                  sdp_image_path(image), format->name);
+        return NULL;
+    }
+
+    sdp_decoder *decoder = calloc(1, sizeof(*decoder));
+    if (!decoder)
+        return NULL;
+    decoder->format = format;
+    decoder->image = image;
+
+    const unsigned char *data = sdp_image_data(image);
+    size_t data_size = sdp_image_size(image);
+    uint64_t size = format->content_size(data, data_size);
+    if (size == SIZE_UNKNOWN && scan_size(decoder, &size))
+        goto error;
+    if (size > UINT32_MAX)
+    {
+        snprintf(decoder->error, sizeof(decoder->error), "Decompressed size too large");
+        goto error;
+    }
+    decoder->size = size;
+
+    decoder->ctx = format->open(data, data_size, decoder->error, sizeof(decoder->error));
+    if (!decoder->ctx)
+        goto error;
+    return decoder;
+
+error:
+    sdp_error("ERROR: Failed to decompress \"%s\": %s\n", sdp_image_path(image), decoder->error);
+    sdp_decoder_close(decoder);
+    return NULL;
+}
+
+uint32_t sdp_decoder_size(const sdp_decoder *decoder)
+{
+    return decoder->size;
+}
+
+ssize_t sdp_decoder_read(sdp_decoder *decoder, unsigned char *out, size_t length)
+{
+    if (decoder->failed)
+        return -1;
+
+    ssize_t n = decoder->format->read(decoder->ctx, out, length, decoder->error, sizeof(decoder->error));
+    if (n < 0)
+    {
+        decoder->failed = true;
+        return -1;
+    }
+    decoder->total += n;
+    if (decoder->total > decoder->size)
+    {
+        snprintf(decoder->error, sizeof(decoder->error), "More data than the announced %u bytes",
+                 decoder->size);
+        decoder->failed = true;
+        return -1;
+    }
+    if (n == 0 && decoder->total != decoder->size)
+    {
+        snprintf(decoder->error, sizeof(decoder->error), "Got %llu of the announced %u bytes",
+                 (unsigned long long)decoder->total, decoder->size);
+        decoder->failed = true;
+        return -1;
+    }
+    return n;
+}
+
+int sdp_decoder_close(sdp_decoder *decoder)
+{
+    if (!decoder)
+        return 0;
+
+    int res = 0;
+    if (decoder->failed)
+    {
+        sdp_error("ERROR: Failed to decompress \"%s\": %s\n",
+                  sdp_image_path(decoder->image), decoder->error);
+        res = 1;
+    }
+
+    if (decoder->ctx)
+        decoder->format->close(decoder->ctx);
+    free(decoder);
+    return res;
+}
@@ -0,0 +1,34 @@
+#ifndef DECODER_H_
+#define DECODER_H_
+
+#include "image.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct sdp_decoder_;
+typedef struct sdp_decoder_ sdp_decoder;
+
+/* Return whether image starts with the magic of a compressed format */
+bool sdp_decoder_detect(const sdp_image *image);
+
+/*
+ * Prepare to decompress image. The decompressed size is taken from the frame
+ * header if it is stored there, otherwise the image is decompressed once to
+ * count the bytes. Returns NULL on error.
+ */
+sdp_decoder *sdp_decoder_open(const sdp_image *image);
+uint32_t sdp_decoder_size(const sdp_decoder *decoder);
+
+/*
+ * Decompress the next length bytes into out, fewer only at the end of the
+ * data. Returns the number of bytes, 0 once all data has been returned and
+ * -1 on error, including data that doesn't match the announced size.
+ */
+ssize_t sdp_decoder_read(sdp_decoder *decoder, unsigned char *out, size_t length);
+
+/* Returns non-zero if decompression failed, after reporting why */
+int sdp_decoder_close(sdp_decoder *decoder);
+
+#endif
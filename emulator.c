@@ -0,0 +1,703 @@
+#include "emulator.h"
+#include "deadline.h"
+#include "ivt.h"
+#include "log.h"
+#include "protocol.h"
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define MAX_REGIONS 8
+/* Replies queue up like in the report buffer of hidraw */
+#define MAX_RESPONSES SDP_HIDRAW_BUFFER_SIZE
+#define DEFAULT_STATUS 0xf0f0f0f0
+#define BAD_ADDRESS_STATUS 0x33333333
+#define BAD_COMMAND_STATUS 0x55555555
+
+struct region
+{
+    uint32_t start;
+    uint32_t size;
+    unsigned char *mem;
+};
+
+struct emu_config
+{
+    bool enabled;
+    unsigned latency_us;
+    unsigned queue;
+    unsigned boot_ms;
+    struct region regions[MAX_REGIONS];
+    int region_count;
+    uint32_t status;
+    bool hab_closed;
+    unsigned long fail_write;
+    unsigned long fail_read;
+    bool jump_fail;
+};
+
+struct response
+{
+    unsigned char data[65];
+    size_t length;
+    /* Reports written to the board before this one was queued */
+    unsigned long writes;
+};
+
+struct emu_board
+{
+    char *usb_path;
+    struct region regions[MAX_REGIONS];
+    bool opened;
+    unsigned generation;
+    int64_t available_at;
+    uint32_t status;
+    unsigned long writes;
+    unsigned long reads;
+    /* Data reports whose latency hasn't been paid yet */
+    unsigned queued;
+
+    /* Data phase of WRITE_FILE, DCD_WRITE or an SDPS download */
+    bool stream;
+    uint16_t command;
+    uint32_t address;
+    uint32_t remaining;
+    bool bad_address;
+    unsigned char dcd[SDP_MAX_DCD_SIZE];
+    uint32_t dcd_length;
+
+    /* Report 4 data of READ_REGISTER */
+    uint32_t read_address;
+    uint32_t read_remaining;
+
+    struct response responses[MAX_RESPONSES];
+    int response_head;
+    int response_count;
+
+    struct emu_board *next;
+};
+
+struct emu_transport
+{
+    sdp_transport base;
+    struct emu_board *board;
+    unsigned generation;
+    const wchar_t *error;
+};
+
+static struct emu_config config = {
+    .regions = {
+        {.start = 0x00900000, .size = 0x40000},
+        {.start = 0x80000000, .size = 0x40000000},
+    },
+    .region_count = 2,
+    .status = DEFAULT_STATUS,
+};
+static struct emu_board *boards;
+static pthread_mutex_t boards_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_us(int64_t us)
+{
+    if (us <= 0)
+        return;
+    struct timespec ts = {
+        .tv_sec = us / 1000000,
+        .tv_nsec = (us % 1000000) * 1000,
+    };
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+}
+
+static int parse_option(const char *key, const char *value)
+{
+    char *end;
+    if (!strcmp(key, "latency") && value)
+        config.latency_us = strtoul(value, &end, 10);
+    else if (!strcmp(key, "queue") && value)
+    {
+        config.queue = strtoul(value, &end, 10);
+        if (!config.queue)
+            return 1;
+    }
+    else if (!strcmp(key, "boot") && value)
+        config.boot_ms = strtoul(value, &end, 10);
+    else if (!strcmp(key, "status") && value)
+        config.status = strtoul(value, &end, 16);
+    else if (!strcmp(key, "fail_write") && value)
+        config.fail_write = strtoul(value, &end, 10);
+    else if (!strcmp(key, "fail_read") && value)
+        config.fail_read = strtoul(value, &end, 10);
+    else if (!strcmp(key, "hab") && value)
+    {
+        config.hab_closed = !strcmp(value, "closed");
+        if (!config.hab_closed && strcmp(value, "open"))
+            return 1;
+        return 0;
+    }
+    else if (!strcmp(key, "jump_fail") && !value)
+    {
+        config.jump_fail = true;
+        return 0;
+    }
+    else if (!strcmp(key, "mem") && value)
+    {
+        static bool custom_regions;
+        if (!custom_regions)
+            config.region_count = 0;
+        custom_regions = true;
+        if (config.region_count == MAX_REGIONS)
+            return 1;
+        struct region *region = config.regions + config.region_count;
+        region->start = strtoul(value, &end, 16);
+        if (*end != ':')
+            return 1;
+        region->size = strtoul(end + 1, &end, 16);
+        if (!region->size || (uint64_t)region->start + region->size > UINT32_MAX + 1ull)
+            return 1;
+        ++config.region_count;
+    }
+    else
+        return 1;
+
+    return value == end || *end ? 1 : 0;
+}
+
+int sdp_emu_configure(const char *s)
+{
+    config.enabled = true;
+    if (!s)
+        return 0;
+
+    char *copy = strdup(s);
+    if (!copy)
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        return 1;
+    }
+
+    int res = 0;
+    char *saveptr = NULL;
+    for (char *tok = strtok_r(copy, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr))
+    {
+        char *value = strchr(tok, '=');
+        if (value)
+            *value++ = '\0';
+        if (parse_option(tok, value))
+        {
+            sdp_error("ERROR: Invalid emulator option \"%s\"\n", tok);
+            res = 1;
+            break;
+        }
+    }
+
+    free(copy);
+    return res;
+}
+
+bool sdp_emu_enabled(void)
+{
+    return config.enabled;
+}
+
+static void free_board(struct emu_board *board)
+{
+    for (int i = 0; i < config.region_count; ++i)
+    {
+        if (board->regions[i].mem)
+            munmap(board->regions[i].mem, board->regions[i].size);
+    }
+    free(board->usb_path);
+    free(board);
+}
+
+static struct emu_board *new_board(const char *usb_path)
+{
+    struct emu_board *board = calloc(1, sizeof(struct emu_board));
+    if (!board)
+        return NULL;
+    board->usb_path = strdup(usb_path);
+    if (!board->usb_path)
+        goto free_board;
+    board->status = config.status;
+
+    /* Pages are only allocated once they are touched */
+    for (int i = 0; i < config.region_count; ++i)
+    {
+        struct region *region = board->regions + i;
+        *region = config.regions[i];
+        region->mem = mmap(NULL, region->size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region->mem == MAP_FAILED)
+        {
+            region->mem = NULL;
+            goto free_board;
+        }
+    }
+
+    return board;
+
+free_board:
+    free_board(board);
+    return NULL;
+}
+
+void sdp_emu_cleanup(void)
+{
+    pthread_mutex_lock(&boards_lock);
+    while (boards)
+    {
+        struct emu_board *next = boards->next;
+        free_board(boards);
+        boards = next;
+    }
+    pthread_mutex_unlock(&boards_lock);
+}
+
+static unsigned char *translate(struct emu_board *board, uint32_t address, uint32_t length)
+{
+    for (int i = 0; i < config.region_count; ++i)
+    {
+        struct region *region = board->regions + i;
+        if (address >= region->start && (uint64_t)address + length <= (uint64_t)region->start + region->size)
+            return region->mem + (address - region->start);
+    }
+    return NULL;
+}
+
+static void respond(struct emu_board *board, uint8_t report_id, uint32_t value)
+{
+    if (board->response_count == MAX_RESPONSES)
+        return;
+    struct response *r = board->responses + (board->response_head + board->response_count++) % MAX_RESPONSES;
+    memset(r->data, 0, sizeof(r->data));
+    r->data[0] = report_id;
+    memcpy(r->data + 1, &value, sizeof(value));
+    r->length = report_id == 3 ? 5 : 65;
+    r->writes = board->writes;
+}
+
+static void respond_hab(struct emu_board *board)
+{
+    respond(board, 3, config.hab_closed ? HAB_CLOSED : HAB_OPEN);
+}
+
+static void fail_command(struct emu_board *board, uint32_t status)
+{
+    board->status = status;
+    respond_hab(board);
+    respond(board, 4, status);
+}
+
+static uint32_t read_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/*
+ * Execute the write commands of a DCD table on the emulated memory. Writes
+ * outside the configured regions go to registers that aren't modelled and
+ * are dropped, check and unlock commands always pass.
+ */
+static bool run_dcd(struct emu_board *board)
+{
+    const unsigned char *dcd = board->dcd;
+    size_t length = board->dcd_length;
+    if (length < 4 || dcd[0] != 0xd2 || (size_t)(dcd[1] << 8 | dcd[2]) != length)
+        return false;
+
+    for (size_t pos = 4; pos < length;)
+    {
+        const unsigned char *cmd = dcd + pos;
+        size_t n = length - pos < 4 ? 0 : (size_t)(cmd[1] << 8 | cmd[2]);
+        if (n < 4 || n > length - pos)
+            return false;
+        if (cmd[0] == 0xcc)
+        {
+            unsigned width = cmd[3] & 7;
+            bool mask = cmd[3] & 0x08, set = cmd[3] & 0x10;
+            if ((width != 1 && width != 2 && width != 4) || (n - 4) % 8)
+                return false;
+            for (size_t i = 4; i < n; i += 8)
+            {
+                unsigned char *mem = translate(board, read_be32(cmd + i), width);
+                if (!mem)
+                    continue;
+                uint32_t value = read_be32(cmd + i + 4), old = 0;
+                for (unsigned j = 0; j < width; ++j)
+                    old |= (uint32_t)mem[j] << (8 * j);
+                if (mask)
+                    value = set ? old | value : old & ~value;
+                for (unsigned j = 0; j < width; ++j)
+                    mem[j] = value >> (8 * j);
+            }
+        }
+        else if (cmd[0] != 0xcf && cmd[0] != 0xc0 && cmd[0] != 0xb2)
+            return false;
+        pos += n;
+    }
+    return true;
+}
+
+/* The board leaves the bus and comes back with the next stage */
+static void boot(struct emu_board *board)
+{
+    ++board->generation;
+    board->available_at = now_us() + config.boot_ms * 1000ll;
+}
+
+static int handle_command(struct emu_transport *t, const struct command_report *report)
+{
+    struct emu_board *board = t->board;
+    uint32_t address = ntohl(report->address);
+    uint32_t count = ntohl(report->data_count);
+    uint32_t data = ntohl(report->data);
+
+    /* Pipelined register writes leave their replies queued */
+    if (report->command_type != WRITE_REGISTER)
+        board->response_count = 0;
+    board->remaining = 0;
+    board->read_remaining = 0;
+    board->stream = false;
+
+    switch (report->command_type)
+    {
+    case WRITE_FILE:
+    case DCD_WRITE:
+        board->command = report->command_type;
+        board->address = address;
+        board->remaining = count;
+        board->bad_address = report->command_type == WRITE_FILE ? !translate(board, address, count)
+                                                                : count > SDP_MAX_DCD_SIZE;
+        board->dcd_length = 0;
+        break;
+    case ERROR_STATUS:
+        respond_hab(board);
+        respond(board, 4, board->status);
+        break;
+    case JUMP_ADDRESS:
+        if (config.jump_fail || !translate(board, address, 4))
+        {
+            fail_command(board, BAD_ADDRESS_STATUS);
+            break;
+        }
+        /* The ROM acknowledges the jump and the board leaves the bus */
+        respond_hab(board);
+        boot(board);
+        break;
+    case WRITE_REGISTER:
+    {
+        unsigned width = report->format / 8;
+        unsigned char *mem = translate(board, address, width);
+        if ((width != 1 && width != 2 && width != 4) || !mem)
+        {
+            fail_command(board, BAD_ADDRESS_STATUS);
+            break;
+        }
+        /* The ROM runs little endian */
+        for (unsigned i = 0; i < width; ++i)
+            mem[i] = data >> (8 * i);
+        respond_hab(board);
+        respond(board, 4, WRITE_REGISTER_COMPLETE);
+        break;
+    }
+    case READ_REGISTER:
+        respond_hab(board);
+        board->read_address = address;
+        board->read_remaining = count;
+        break;
+    case SKIP_DCD_HEADER:
+        respond_hab(board);
+        respond(board, 4, SKIP_DCD_HEADER_ACK);
+        break;
+    default:
+        fail_command(board, BAD_COMMAND_STATUS);
+        break;
+    }
+    return 0;
+}
+
+static int handle_stream_command(struct emu_transport *t, const struct sdps_command_report *report)
+{
+    struct emu_board *board = t->board;
+    if (le32toh(report->signature) != SDPS_SIGNATURE || report->command != SDPS_DOWNLOAD_FW ||
+        ntohl(report->length) != le32toh(report->transfer_length) || !report->transfer_length)
+    {
+        t->error = L"Invalid SDPS command";
+        return -1;
+    }
+    board->response_count = 0;
+    board->read_remaining = 0;
+    board->stream = true;
+    board->remaining = le32toh(report->transfer_length);
+    return 0;
+}
+
+static int handle_data(struct emu_transport *t, const unsigned char *data, size_t length)
+{
+    struct emu_board *board = t->board;
+    if (!board->remaining)
+    {
+        t->error = L"Unexpected data report";
+        return -1;
+    }
+
+    uint32_t n = length < board->remaining ? length : board->remaining;
+    if (board->stream)
+    {
+        /* The container isn't modelled, the board just boots it */
+        board->remaining -= n;
+        if (!board->remaining)
+            boot(board);
+        return 0;
+    }
+    if (board->command == WRITE_FILE && !board->bad_address)
+        memcpy(translate(board, board->address, n), data, n);
+    else if (board->command == DCD_WRITE && !board->bad_address)
+    {
+        memcpy(board->dcd + board->dcd_length, data, n);
+        board->dcd_length += n;
+    }
+    board->address += n;
+    board->remaining -= n;
+
+    if (!board->remaining)
+    {
+        if (board->bad_address)
+            fail_command(board, BAD_ADDRESS_STATUS);
+        else if (board->command == DCD_WRITE && !run_dcd(board))
+            fail_command(board, BAD_COMMAND_STATUS);
+        else
+        {
+            respond_hab(board);
+            respond(board, 4, board->command == WRITE_FILE ? WRITE_FILE_COMPLETE : DCD_WRITE_COMPLETE);
+        }
+    }
+    return 0;
+}
+
+static bool connected(struct emu_transport *t)
+{
+    if (t->generation == t->board->generation)
+        return true;
+    t->error = L"Device disconnected";
+    return false;
+}
+
+/*
+ * Model a host that keeps up to config.queue data reports in flight: their
+ * round trips overlap, so only every queue-th one costs the full latency and
+ * the rest is paid when the queue is drained before the next command or read.
+ */
+static void report_latency(struct emu_board *board, bool data)
+{
+    if (config.queue > 1 && data)
+    {
+        if (++board->queued == config.queue)
+        {
+            sleep_us(config.latency_us);
+            board->queued = 0;
+        }
+        return;
+    }
+    if (board->queued)
+        sleep_us(config.latency_us);
+    board->queued = 0;
+    sleep_us(config.latency_us);
+}
+
+static int emu_write(sdp_transport *transport, const unsigned char *data, size_t length)
+{
+    struct emu_transport *t = (struct emu_transport *)transport;
+    struct emu_board *board = t->board;
+
+    report_latency(board, length && data[0] == 2);
+    if (++board->writes == config.fail_write)
+    {
+        t->error = L"Injected write failure";
+        return -1;
+    }
+    if (!connected(t) || !length)
+        return -1;
+
+    int res;
+    if (data[0] == 1 && length == sizeof(struct command_report))
+        res = handle_command(t, (const struct command_report *)data);
+    else if (data[0] == 1 && length == sizeof(struct sdps_command_report))
+        res = handle_stream_command(t, (const struct sdps_command_report *)data);
+    else if (data[0] == 2 && length > 1)
+        res = handle_data(t, data + 1, length - 1);
+    else
+    {
+        t->error = L"Invalid report";
+        res = -1;
+    }
+    return res ? res : (int)length;
+}
+
+static int emu_read(sdp_transport *transport, unsigned char *data, size_t length, int timeout)
+{
+    struct emu_transport *t = (struct emu_transport *)transport;
+    struct emu_board *board = t->board;
+    struct response r;
+
+    /* A reply that waited while further commands were written has arrived by now */
+    if (!board->response_count || board->responses[board->response_head].writes == board->writes)
+        report_latency(board, false);
+
+    if (board->response_count)
+    {
+        r = board->responses[board->response_head];
+        board->response_head = (board->response_head + 1) % MAX_RESPONSES;
+        --board->response_count;
+    }
+    else if (board->read_remaining && connected(t))
+    {
+        uint32_t n = board->read_remaining < 64 ? board->read_remaining : 64;
+        const unsigned char *mem = translate(board, board->read_address, n);
+        memset(r.data, 0, sizeof(r.data));
+        r.data[0] = 4;
+        if (mem)
+            memcpy(r.data + 1, mem, n);
+        r.length = 65;
+        board->read_address += n;
+        board->read_remaining -= n;
+    }
+    else if (!connected(t))
+        return -1;
+    else if (timeout >= 0)
+    {
+        /* Nothing to send, the host has to sit out its timeout */
+        sleep_us(timeout * 1000ll);
+        return 0;
+    }
+    else
+    {
+        /* A real device would block forever here */
+        t->error = L"No report pending";
+        return -1;
+    }
+
+    if (++board->reads == config.fail_read)
+    {
+        t->error = L"Injected read failure";
+        return -1;
+    }
+
+    size_t n = length < r.length ? length : r.length;
+    memcpy(data, r.data, n);
+    return n;
+}
+
+static const wchar_t *emu_error(sdp_transport *transport)
+{
+    struct emu_transport *t = (struct emu_transport *)transport;
+    return t->error ? t->error : L"Success";
+}
+
+static void emu_close(sdp_transport *transport)
+{
+    struct emu_transport *t = (struct emu_transport *)transport;
+    pthread_mutex_lock(&boards_lock);
+    t->board->opened = false;
+    pthread_mutex_unlock(&boards_lock);
+    free(t);
+}
+
+static const struct sdp_transport_ops emu_ops = {
+    .write = emu_write,
+    .read = emu_read,
+    .error = emu_error,
+    .close = emu_close,
+};
+
+static struct emu_board *get_board(const char *usb_path)
+{
+    for (struct emu_board *board = boards; board; board = board->next)
+    {
+        if (!strcmp(board->usb_path, usb_path))
+            return board;
+    }
+
+    struct emu_board *board = new_board(usb_path);
+    if (board)
+    {
+        board->next = boards;
+        boards = board;
+    }
+    return board;
+}
+
+sdp_transport *sdp_emu_open(uint16_t vid, uint16_t pid, const char *usb_path, bool wait, int64_t deadline)
+{
+    struct emu_transport *t = calloc(1, sizeof(struct emu_transport));
+    if (!t)
+    {
+        sdp_error("ERROR: Failed to allocate transport\n");
+        return NULL;
+    }
+    t->base.ops = &emu_ops;
+    t->base.input_buffer = MAX_RESPONSES;
+
+    pthread_mutex_lock(&boards_lock);
+    struct emu_board *board = get_board(usb_path ? usb_path : "emu");
+    if (!board)
+        sdp_error("ERROR: Failed to allocate emulated board\n");
+    else if (board->opened)
+    {
+        sdp_error("ERROR: Emulated board %s is already open\n", board->usb_path);
+        board = NULL;
+    }
+    else
+        board->opened = true;
+    pthread_mutex_unlock(&boards_lock);
+    if (!board)
+        goto free_transport;
+
+    int64_t boot_time = board->available_at - now_us();
+    if (boot_time > 0)
+    {
+        if (!wait)
+        {
+            sdp_error("ERROR: No matching device found\n");
+            goto close_board;
+        }
+        sdp_info("Waiting for device...\n");
+        if (deadline && board->available_at > deadline * 1000)
+        {
+            sleep_us(deadline * 1000 - now_us());
+            sdp_error("ERROR: Timeout!\n");
+            goto close_board;
+        }
+        sleep_us(boot_time);
+    }
+
+    /* Any VID/PID is fine, the board comes up as whatever the stage expects */
+    (void)vid;
+    (void)pid;
+    t->board = board;
+    t->generation = board->generation;
+    board->response_count = 0;
+    board->remaining = 0;
+    board->read_remaining = 0;
+    return &t->base;
+
+close_board:
+    pthread_mutex_lock(&boards_lock);
+    board->opened = false;
+    pthread_mutex_unlock(&boards_lock);
+free_transport:
+    free(t);
+    return NULL;
+}
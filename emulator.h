@@ -0,0 +1,34 @@
+#ifndef EMULATOR_H_
+#define EMULATOR_H_
+
+#include "transport.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * In-process emulation of the i.MX boot ROM's SDP implementation. Every USB
+ * path gets its own emulated board with its own memory; a board disappears
+ * on a successful jump and re-enumerates (with whatever VID/PID is asked for)
+ * after the configured boot time.
+ *
+ * The configuration is a comma separated list of:
+ *
+ *   latency=<US>          delay per report in either direction (default 0)
+ *   queue=<N>             overlap the latency of up to N data reports, like a
+ *                         host keeping N transfers in flight (default 1)
+ *   boot=<MS>             re-enumeration time after a jump (default 0)
+ *   mem=<START>:<SIZE>    memory region in hex, may be repeated (default
+ *                         00900000:40000 and 80000000:40000000)
+ *   status=<HEX>          value reported by ERROR_STATUS (default f0f0f0f0)
+ *   hab=open|closed       reported HAB state (default open)
+ *   fail_write=<N>        fail the N-th report written to each board
+ *   fail_read=<N>         fail the N-th report read from each board
+ *   jump_fail             reject every JUMP_ADDRESS
+ */
+int sdp_emu_configure(const char *config);
+bool sdp_emu_enabled(void);
+/* Open the emulated board, waiting until deadline for it to boot if wait is set */
+sdp_transport *sdp_emu_open(uint16_t vid, uint16_t pid, const char *usb_path, bool wait, int64_t deadline);
+void sdp_emu_cleanup(void);
+
+#endif
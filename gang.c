@@ -0,0 +1,866 @@
+#include "gang.h"
+#include "config.h"
+#include "deadline.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "udev.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#ifdef WITH_LIBUSB
+#include "transport_libusb.h"
+#endif
+#ifdef WITH_URING
+#include "transport_uring.h"
+#endif
+
+#define MAX_FINISHED_JOBS 256
+
+/*
+ * The gang engine boots several boards concurrently through the same stage
+ * list. A single epoll loop owns the udev monitor and every board's state
+ * machine:
+ *
+ *   WAITING --(matching device added)--> RUNNING --(stage done)--> WAITING
+ *                                                 \--(last stage)--> DONE
+ *
+ * The SDP exchange of a stage (open, error status, steps) runs on a worker
+ * thread per board: hidraw output reports are synchronous in the kernel, so
+ * writing them from the loop itself would serialize the data phase of all
+ * boards. Workers report back through an eventfd in the epoll set.
+ */
+
+enum board_state
+{
+    BOARD_QUEUED,
+    BOARD_WAITING,
+    BOARD_RUNNING,
+    BOARD_DONE,
+    BOARD_FAILED,
+};
+
+static const char *const state_names[] = {
+    [BOARD_QUEUED] = "queued",
+    [BOARD_WAITING] = "waiting",
+    [BOARD_RUNNING] = "running",
+    [BOARD_DONE] = "done",
+    [BOARD_FAILED] = "failed",
+};
+
+struct watch
+{
+    int fd;
+    sdp_gang_fd_handler handler;
+    void *arg;
+    struct watch *next;
+};
+
+struct board
+{
+    sdp_gang *gang;
+    int id;
+    char *usb_path;
+    enum board_state state;
+    int stage;
+    char *devnode;
+    /* Device which was added while the previous stage was still running */
+    char *pending;
+    uint16_t pending_vid;
+    uint16_t pending_pid;
+    /* End of the wait for the device, of the current stage and of the boot */
+    int64_t deadline;
+    int64_t stage_deadline;
+    int64_t run_deadline;
+    /* Position in the USB topology of the device of the current stage */
+    struct sdp_route route;
+    bool has_route;
+    /* Start of the current wait, on the trace clock */
+    int64_t wait_start;
+    int64_t start_time;
+    int64_t end_time;
+    struct watch watch;
+    pthread_t worker;
+    int result;
+    atomic_bool cancel;
+    const char *failure;
+};
+
+struct sdp_gang_
+{
+    const sdp_stages *stages;
+    bool initial_wait;
+    sdp_udev *udev;
+    struct watch udev_watch;
+    int epfd;
+    int count;
+    struct board **boards;
+    int next_id;
+    const char **allowed_paths;
+    int allowed_count;
+    struct watch *watches;
+    bool serving;
+    bool stop;
+    /* Holding a reference to the shared libusb context */
+    bool libusb;
+};
+
+static bool is_active(const struct board *board)
+{
+    return board->state != BOARD_DONE && board->state != BOARD_FAILED;
+}
+
+static int add_watch(sdp_gang *gang, struct watch *watch)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.ptr = watch,
+    };
+    if (epoll_ctl(gang->epfd, EPOLL_CTL_ADD, watch->fd, &ev))
+    {
+        sdp_error("ERROR: Failed to watch fd %d: %s\n", watch->fd, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static void handle_udev_event(void *arg);
+static void finish_stage(void *arg);
+
+sdp_gang *sdp_gang_new(const sdp_stages *stages, bool initial_wait)
+{
+    sdp_gang *gang = calloc(1, sizeof(sdp_gang));
+    if (!gang)
+    {
+        sdp_error("ERROR: Failed to allocate gang: %s\n", strerror(errno));
+        return NULL;
+    }
+    gang->stages = stages;
+    gang->initial_wait = initial_wait;
+
+    gang->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (gang->epfd < 0)
+    {
+        sdp_error("ERROR: Failed to create epoll instance: %s\n", strerror(errno));
+        goto free_gang;
+    }
+
+    /* Arm the monitor before looking for devices so no add event is lost */
+    gang->udev = sdp_udev_init();
+    if (!gang->udev)
+    {
+        sdp_error("ERROR: Failed to initialize udev\n");
+        goto close_epfd;
+    }
+
+    gang->udev_watch.fd = sdp_udev_get_fd(gang->udev);
+    gang->udev_watch.handler = handle_udev_event;
+    gang->udev_watch.arg = gang;
+    if (add_watch(gang, &gang->udev_watch))
+        goto free_udev;
+    if (sdp_metrics_fd() >= 0 && sdp_gang_watch_fd(gang, sdp_metrics_fd(), sdp_metrics_handle, NULL))
+        goto free_udev;
+
+    return gang;
+
+free_udev:
+    sdp_udev_free(gang->udev);
+close_epfd:
+    close(gang->epfd);
+free_gang:
+    free(gang);
+    return NULL;
+}
+
+static void free_board(struct board *board)
+{
+    close(board->watch.fd);
+    free(board->pending);
+    free(board->usb_path);
+    free(board);
+}
+
+void sdp_gang_free(sdp_gang *gang)
+{
+    for (int i = 0; i < gang->count; ++i)
+        free_board(gang->boards[i]);
+    free(gang->boards);
+    while (gang->watches)
+    {
+        struct watch *next = gang->watches->next;
+        free(gang->watches);
+        gang->watches = next;
+    }
+    free(gang->allowed_paths);
+    sdp_udev_free(gang->udev);
+    close(gang->epfd);
+    free(gang);
+}
+
+static struct board *find_active_board(sdp_gang *gang, const char *usb_path)
+{
+    for (int i = 0; i < gang->count; ++i)
+    {
+        if (is_active(gang->boards[i]) && !strcmp(gang->boards[i]->usb_path, usb_path))
+            return gang->boards[i];
+    }
+    return NULL;
+}
+
+static struct board *new_board(sdp_gang *gang, const char *usb_path)
+{
+    if (find_active_board(gang, usb_path))
+    {
+        sdp_error("ERROR: Board %s is already being booted\n", usb_path);
+        return NULL;
+    }
+
+    struct board **boards = realloc(gang->boards, (gang->count + 1) * sizeof(*boards));
+    if (!boards)
+    {
+        sdp_error("ERROR: Failed to allocate board: %s\n", strerror(errno));
+        return NULL;
+    }
+    gang->boards = boards;
+
+    struct board *board = calloc(1, sizeof(struct board));
+    if (!board)
+    {
+        sdp_error("ERROR: Failed to allocate board: %s\n", strerror(errno));
+        return NULL;
+    }
+    board->gang = gang;
+    board->state = BOARD_QUEUED;
+    atomic_init(&board->cancel, false);
+
+    board->usb_path = strdup(usb_path);
+    if (!board->usb_path)
+    {
+        sdp_error("ERROR: Failed to allocate board: %s\n", strerror(errno));
+        goto free_board;
+    }
+
+    board->watch.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (board->watch.fd < 0)
+    {
+        sdp_error("ERROR: Failed to create eventfd: %s\n", strerror(errno));
+        goto free_path;
+    }
+    board->watch.handler = finish_stage;
+    board->watch.arg = board;
+    if (add_watch(gang, &board->watch))
+        goto close_efd;
+
+    board->id = ++gang->next_id;
+    gang->boards[gang->count++] = board;
+    return board;
+
+close_efd:
+    close(board->watch.fd);
+free_path:
+    free(board->usb_path);
+free_board:
+    free(board);
+    return NULL;
+}
+
+/*
+ * Drop the oldest finished boards so a long running daemon stays bounded. A
+ * gang run keeps them all for its summary, the daemon reported each job as it
+ * ended.
+ */
+static void prune_boards(sdp_gang *gang)
+{
+    int finished = 0;
+    for (int i = 0; i < gang->count; ++i)
+        finished += !is_active(gang->boards[i]);
+
+    for (int i = 0; finished > MAX_FINISHED_JOBS && i < gang->count;)
+    {
+        struct board *board = gang->boards[i];
+        if (is_active(board))
+        {
+            ++i;
+            continue;
+        }
+        epoll_ctl(gang->epfd, EPOLL_CTL_DEL, board->watch.fd, NULL);
+        free_board(board);
+        memmove(gang->boards + i, gang->boards + i + 1, (gang->count - i - 1) * sizeof(*gang->boards));
+        --gang->count;
+        --finished;
+    }
+}
+
+static sdp_transport *open_transport(struct board *board)
+{
+#ifdef WITH_URING
+    if (sdp_uring_enabled())
+        return sdp_uring_open(board->devnode);
+#endif
+#ifdef WITH_LIBUSB
+    if (sdp_libusb_enabled())
+    {
+        uint16_t vid, pid;
+        sdp_transport *handle;
+        sdp_stage_usb_id(board->gang->stages, board->stage, &vid, &pid);
+        if (!sdp_libusb_open(vid, pid, board->usb_path, &handle))
+            return handle;
+    }
+#endif
+
+    int64_t start = sdp_trace_now();
+    hid_device *device = hid_open_path(board->devnode);
+    sdp_trace_span("hid_open_path", start);
+    if (!device)
+    {
+        sdp_error("ERROR: Failed to open device: %ls\n", hid_error(NULL));
+        return NULL;
+    }
+    return sdp_hidapi_transport(device);
+}
+
+static void *board_worker(void *arg)
+{
+    struct board *board = arg;
+    sdp_log_set_tag(board->usb_path);
+    sdp_trace_set_track(board->usb_path);
+    uint16_t vid, pid;
+    sdp_stage_usb_id(board->gang->stages, board->stage, &vid, &pid);
+    sdp_metrics_set_board(board->usb_path);
+    sdp_metrics_set_stage(board->stage + 1, vid, pid);
+
+    board->result = 1;
+    int64_t start = sdp_trace_now();
+    sdp_transport *handle = open_transport(board);
+    sdp_trace_span("open_device", start);
+    if (handle)
+    {
+        sdp_transport_set_deadline(handle, board->stage_deadline);
+        if (board->has_route)
+            sdp_transport_set_route(handle, &board->route);
+        board->result = sdp_run_stage(board->gang->stages, board->stage, handle, &board->cancel);
+        sdp_transport_close(handle);
+    }
+    else
+        sdp_metrics_failure();
+
+    uint64_t one = 1;
+    if (write(board->watch.fd, &one, sizeof(one)) != sizeof(one))
+        sdp_error("ERROR: Failed to signal stage completion: %s\n", strerror(errno));
+    return NULL;
+}
+
+static void trace_wait(struct board *board)
+{
+    sdp_trace_track_span(board->usb_path, "wait_device", board->wait_start, sdp_trace_now());
+}
+
+static void end_board(struct board *board, enum board_state state, const char *failure)
+{
+    if (board->state == BOARD_WAITING)
+        trace_wait(board);
+    /* Failures of a running stage were counted by its worker */
+    sdp_metrics_set_board(board->usb_path);
+    if (failure && board->state != BOARD_RUNNING)
+    {
+        uint16_t vid, pid;
+        sdp_stage_usb_id(board->gang->stages, board->stage, &vid, &pid);
+        sdp_metrics_set_stage(board->stage + 1, vid, pid);
+        sdp_metrics_failure();
+    }
+    board->state = state;
+    board->failure = failure;
+    board->end_time = sdp_now_ms();
+    if (board->start_time)
+        sdp_metrics_boot(state == BOARD_DONE, (board->end_time - board->start_time) / 1000.0);
+
+    if (failure)
+        sdp_error("[%s] ERROR: Stage %d: %s\n", board->usb_path, board->stage + 1, failure);
+    if (board->gang->serving)
+    {
+        sdp_info("[%s] Job %d %s in %.2f s\n", board->usb_path, board->id,
+                 state == BOARD_DONE ? "passed" : "failed",
+                 (board->end_time - board->start_time) / 1000.0);
+    }
+}
+
+static void start_stage(struct board *board, char *devnode)
+{
+    uint16_t vid, pid;
+    sdp_stage_usb_id(board->gang->stages, board->stage, &vid, &pid);
+    sdp_info("[%s] [Stage %d/%d] VID=0x%04x PID=0x%04x\n", board->usb_path, board->stage + 1,
+             sdp_stages_count(board->gang->stages), vid, pid);
+
+    if (board->state == BOARD_WAITING)
+        trace_wait(board);
+    board->devnode = devnode;
+    /* libudev isn't thread safe, so the worker gets a copy */
+    board->has_route = !sdp_udev_route(board->gang->udev, devnode, &board->route);
+    board->state = BOARD_RUNNING;
+    int res = pthread_create(&board->worker, NULL, board_worker, board);
+    if (res)
+    {
+        sdp_error("[%s] ERROR: Failed to start worker: %s\n", board->usb_path, strerror(res));
+        free(board->devnode);
+        board->devnode = NULL;
+        end_board(board, BOARD_FAILED, "Failed to start worker");
+    }
+}
+
+static void wait_stage(struct board *board)
+{
+    uint16_t vid, pid;
+    sdp_stage_usb_id(board->gang->stages, board->stage, &vid, &pid);
+
+    char *pending = board->pending;
+    board->pending = NULL;
+    if (pending && board->pending_vid == vid && board->pending_pid == pid)
+    {
+        start_stage(board, pending);
+        return;
+    }
+    free(pending);
+
+    sdp_info("[%s] Waiting for device...\n", board->usb_path);
+    board->state = BOARD_WAITING;
+    board->deadline = sdp_deadline_min(board->stage_deadline, sdp_deadline_after(sdp_timeouts()->device_ms));
+    board->wait_start = sdp_trace_now();
+}
+
+/* The stage's budget includes waiting for its device */
+static void begin_stage(struct board *board)
+{
+    board->stage_deadline = sdp_deadline_min(board->run_deadline, sdp_deadline_after(sdp_timeouts()->stage_ms));
+}
+
+static void begin_run(struct board *board)
+{
+    board->start_time = sdp_now_ms();
+    board->run_deadline = sdp_deadline_after(sdp_timeouts()->run_ms);
+    begin_stage(board);
+}
+
+static void start_board(struct board *board)
+{
+    uint16_t vid, pid;
+    sdp_stage_usb_id(board->gang->stages, 0, &vid, &pid);
+
+    begin_run(board);
+    char *devnode = sdp_udev_find(board->gang->udev, vid, pid, board->usb_path);
+    if (devnode)
+        start_stage(board, devnode);
+    else if (board->gang->initial_wait)
+        wait_stage(board);
+    else
+        end_board(board, BOARD_FAILED, "No matching device found");
+}
+
+static void finish_stage(void *arg)
+{
+    struct board *board = arg;
+    uint64_t value;
+    if (read(board->watch.fd, &value, sizeof(value)) != sizeof(value))
+        return;
+
+    pthread_join(board->worker, NULL);
+    free(board->devnode);
+    board->devnode = NULL;
+
+    if (atomic_load(&board->cancel))
+        end_board(board, BOARD_FAILED, "Cancelled");
+    else if (board->result && sdp_deadline_expired(board->stage_deadline))
+        end_board(board, BOARD_FAILED, "Deadline exceeded");
+    else if (board->result)
+        end_board(board, BOARD_FAILED, "Failed to execute stage");
+    else if (++board->stage == sdp_stages_count(board->gang->stages))
+        end_board(board, BOARD_DONE, NULL);
+    else
+    {
+        begin_stage(board);
+        wait_stage(board);
+    }
+
+    if (!is_active(board) && board->gang->serving)
+        prune_boards(board->gang);
+}
+
+static bool path_allowed(sdp_gang *gang, const char *usb_path)
+{
+    if (!gang->allowed_count)
+        return true;
+    for (int i = 0; i < gang->allowed_count; ++i)
+    {
+        if (!strcmp(gang->allowed_paths[i], usb_path))
+            return true;
+    }
+    return false;
+}
+
+static bool auto_boot(const struct sdp_udev_event *event, void *arg)
+{
+    sdp_gang *gang = arg;
+    uint16_t vid, pid;
+    sdp_stage_usb_id(gang->stages, 0, &vid, &pid);
+    if (event->vid != vid || event->pid != pid || !path_allowed(gang, event->usb_path) ||
+        find_active_board(gang, event->usb_path))
+        return false;
+
+    struct board *board = new_board(gang, event->usb_path);
+    if (!board)
+        return false;
+
+    char *devnode = strdup(event->devnode);
+    if (!devnode)
+    {
+        end_board(board, BOARD_FAILED, "Allocation failed");
+        return false;
+    }
+    sdp_info("[%s] Job %d started\n", board->usb_path, board->id);
+    begin_run(board);
+    start_stage(board, devnode);
+    return false;
+}
+
+static bool handle_add(const struct sdp_udev_event *event, void *arg)
+{
+    sdp_gang *gang = arg;
+    struct board *board = find_active_board(gang, event->usb_path);
+    if (!board)
+    {
+        if (gang->serving)
+            auto_boot(event, gang);
+        return false;
+    }
+
+    uint16_t vid, pid;
+    char *devnode;
+    switch (board->state)
+    {
+    case BOARD_WAITING:
+        sdp_stage_usb_id(gang->stages, board->stage, &vid, &pid);
+        if (event->vid != vid || event->pid != pid)
+            break;
+        devnode = strdup(event->devnode);
+        if (devnode)
+            start_stage(board, devnode);
+        else
+            end_board(board, BOARD_FAILED, "Allocation failed");
+        break;
+    case BOARD_RUNNING:
+        /*
+         * The next stage's device may enumerate before the worker has
+         * returned from the jump, keep it for later.
+         */
+        if (!strcmp(event->devnode, board->devnode))
+            break;
+        free(board->pending);
+        board->pending = strdup(event->devnode);
+        board->pending_vid = event->vid;
+        board->pending_pid = event->pid;
+        break;
+    default:
+        break;
+    }
+    return false;
+}
+
+static void handle_udev_event(void *arg)
+{
+    sdp_gang *gang = arg;
+    struct sdp_udev_event event;
+    int res = sdp_udev_receive(gang->udev, &event);
+    /* After lost events, only the devices they added count, like hot-plugs */
+    if (res < 0)
+        sdp_udev_enumerate_added(gang->udev, handle_add, gang);
+    else if (!res && event.add)
+        handle_add(&event, gang);
+}
+
+int sdp_gang_add_board(sdp_gang *gang, const char *usb_path)
+{
+    struct board *board = new_board(gang, usb_path);
+    if (!board)
+        return -1;
+    if (gang->serving)
+        start_board(board);
+    return board->id;
+}
+
+int sdp_gang_cancel(sdp_gang *gang, int id)
+{
+    for (int i = 0; i < gang->count; ++i)
+    {
+        struct board *board = gang->boards[i];
+        if (board->id != id)
+            continue;
+
+        switch (board->state)
+        {
+        case BOARD_QUEUED:
+        case BOARD_WAITING:
+            end_board(board, BOARD_FAILED, "Cancelled");
+            return 0;
+        case BOARD_RUNNING:
+            /* Takes effect once the current step is done */
+            atomic_store(&board->cancel, true);
+            return 0;
+        default:
+            return 1;
+        }
+    }
+    return 1;
+}
+
+void sdp_gang_foreach_job(sdp_gang *gang, sdp_gang_job_callback callback, void *arg)
+{
+    int64_t now = sdp_now_ms();
+    for (int i = 0; i < gang->count; ++i)
+    {
+        struct board *board = gang->boards[i];
+        int64_t end_time = is_active(board) ? now : board->end_time;
+        struct sdp_gang_job job = {
+            .id = board->id,
+            .usb_path = board->usb_path,
+            .state = state_names[board->state],
+            .stage = board->stage + 1,
+            .stage_count = sdp_stages_count(gang->stages),
+            .failure = board->failure,
+            .seconds = board->start_time ? (end_time - board->start_time) / 1000.0 : 0.0,
+        };
+        callback(&job, arg);
+    }
+}
+
+int sdp_gang_allow_path(sdp_gang *gang, const char *usb_path)
+{
+    const char **paths = realloc(gang->allowed_paths, (gang->allowed_count + 1) * sizeof(*paths));
+    if (!paths)
+    {
+        sdp_error("ERROR: Failed to allocate path: %s\n", strerror(errno));
+        return 1;
+    }
+    paths[gang->allowed_count++] = usb_path;
+    gang->allowed_paths = paths;
+    return 0;
+}
+
+int sdp_gang_watch_fd(sdp_gang *gang, int fd, sdp_gang_fd_handler handler, void *arg)
+{
+    struct watch *watch = calloc(1, sizeof(struct watch));
+    if (!watch)
+    {
+        sdp_error("ERROR: Failed to allocate watch: %s\n", strerror(errno));
+        return 1;
+    }
+    watch->fd = fd;
+    watch->handler = handler;
+    watch->arg = arg;
+    if (add_watch(gang, watch))
+    {
+        free(watch);
+        return 1;
+    }
+    watch->next = gang->watches;
+    gang->watches = watch;
+    return 0;
+}
+
+void sdp_gang_unwatch_fd(sdp_gang *gang, int fd)
+{
+    for (struct watch **w = &gang->watches; *w; w = &(*w)->next)
+    {
+        if ((*w)->fd != fd)
+            continue;
+        struct watch *watch = *w;
+        *w = watch->next;
+        epoll_ctl(gang->epfd, EPOLL_CTL_DEL, fd, NULL);
+        free(watch);
+        return;
+    }
+}
+
+void sdp_gang_stop(sdp_gang *gang)
+{
+    gang->stop = true;
+}
+
+static int next_timeout(sdp_gang *gang, bool *active)
+{
+    int64_t deadline = -1;
+    *active = false;
+    for (int i = 0; i < gang->count; ++i)
+    {
+        struct board *board = gang->boards[i];
+        if (board->state == BOARD_RUNNING)
+            *active = true;
+        else if (board->state == BOARD_WAITING)
+        {
+            *active = true;
+            if (board->deadline && (deadline < 0 || board->deadline < deadline))
+                deadline = board->deadline;
+        }
+    }
+
+    if (deadline < 0)
+        return -1;
+    int64_t remaining = deadline - sdp_now_ms();
+    return remaining > 0 ? (int)remaining : 0;
+}
+
+static void expire_boards(sdp_gang *gang)
+{
+    int64_t now = sdp_now_ms();
+    for (int i = 0; i < gang->count; ++i)
+    {
+        struct board *board = gang->boards[i];
+        if (board->state == BOARD_WAITING && board->deadline && board->deadline <= now)
+            end_board(board, BOARD_FAILED,
+                      sdp_deadline_expired(board->stage_deadline) ? "Deadline exceeded" : "Timeout waiting for device");
+    }
+}
+
+static int dispatch(sdp_gang *gang, int timeout)
+{
+    struct epoll_event events[16];
+    int n = epoll_wait(gang->epfd, events, sizeof(events) / sizeof(*events), timeout);
+    if (n < 0)
+    {
+        if (errno == EINTR)
+            return 0;
+        sdp_error("ERROR: epoll_wait failed: %s\n", strerror(errno));
+        return 1;
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+        struct watch *watch = events[i].data.ptr;
+        watch->handler(watch->arg);
+    }
+
+    expire_boards(gang);
+    return 0;
+}
+
+/* Cancel whatever is still in flight when the loop ends */
+static void abort_boards(sdp_gang *gang)
+{
+    for (int i = 0; i < gang->count; ++i)
+    {
+        struct board *board = gang->boards[i];
+        if (board->state == BOARD_RUNNING)
+        {
+            atomic_store(&board->cancel, true);
+            pthread_join(board->worker, NULL);
+            free(board->devnode);
+            board->devnode = NULL;
+        }
+        if (is_active(board))
+            end_board(board, BOARD_FAILED, "Aborted");
+    }
+}
+
+static int print_summary(sdp_gang *gang, int64_t start_time)
+{
+    int failed = 0;
+    for (int i = 0; i < gang->count; ++i)
+        failed += gang->boards[i]->state != BOARD_DONE;
+
+    sdp_info("Summary: %d/%d boards passed in %.2f s\n", gang->count - failed, gang->count,
+             (sdp_now_ms() - start_time) / 1000.0);
+    for (int i = 0; i < gang->count; ++i)
+    {
+        struct board *board = gang->boards[i];
+        double seconds = (board->end_time - board->start_time) / 1000.0;
+        if (board->state == BOARD_DONE)
+            sdp_info("  %-16s PASS  %.2f s\n", board->usb_path, seconds);
+        else
+            sdp_info("  %-16s FAIL  %.2f s  stage %d: %s\n", board->usb_path, seconds,
+                     board->stage + 1, board->failure);
+    }
+
+    return failed ? 1 : 0;
+}
+
+/* hidapi is the fallback of every transport, the libusb context is optional */
+static int init_transports(sdp_gang *gang)
+{
+    if (sdp_hidapi_init())
+        return 1;
+#ifdef WITH_LIBUSB
+    gang->libusb = sdp_libusb_enabled() && !sdp_libusb_init();
+#endif
+    return 0;
+}
+
+static void exit_transports(sdp_gang *gang)
+{
+#ifdef WITH_LIBUSB
+    if (gang->libusb)
+        sdp_libusb_exit();
+    gang->libusb = false;
+#endif
+    sdp_hidapi_exit();
+}
+
+int sdp_gang_run(sdp_gang *gang)
+{
+    if (init_transports(gang))
+        return 1;
+
+    int64_t start_time = sdp_now_ms();
+    for (int i = 0; i < gang->count; ++i)
+        start_board(gang->boards[i]);
+
+    bool active;
+    int timeout;
+    while ((timeout = next_timeout(gang, &active)), active && !gang->stop)
+    {
+        if (dispatch(gang, timeout))
+            break;
+    }
+
+    abort_boards(gang);
+    int res = print_summary(gang, start_time);
+
+    exit_transports(gang);
+
+    return res;
+}
+
+int sdp_gang_serve(sdp_gang *gang)
+{
+    if (init_transports(gang))
+        return 1;
+
+    gang->serving = true;
+    for (int i = 0; i < gang->count; ++i)
+    {
+        if (gang->boards[i]->state == BOARD_QUEUED)
+            start_board(gang->boards[i]);
+    }
+
+    /* Boot the boards which were already waiting before we started */
+    sdp_udev_enumerate(gang->udev, auto_boot, gang);
+
+    int res = 0;
+    bool active;
+    while (!gang->stop)
+    {
+        res = dispatch(gang, next_timeout(gang, &active));
+        if (res)
+            break;
+    }
+
+    abort_boards(gang);
+    gang->serving = false;
+
+    exit_transports(gang);
+
+    return res;
+}
@@ -0,0 +1,50 @@
+#ifndef GANG_H_
+#define GANG_H_
+
+#include "stages.h"
+
+struct sdp_gang_;
+typedef struct sdp_gang_ sdp_gang;
+
+struct sdp_gang_job
+{
+    int id;
+    const char *usb_path;
+    const char *state;
+    int stage;
+    int stage_count;
+    const char *failure;
+    double seconds;
+};
+
+typedef void (*sdp_gang_job_callback)(const struct sdp_gang_job *job, void *arg);
+typedef void (*sdp_gang_fd_handler)(void *arg);
+
+sdp_gang *sdp_gang_new(const sdp_stages *stages, bool initial_wait);
+void sdp_gang_free(sdp_gang *gang);
+
+/*
+ * Add a board to be booted. Returns the job ID, or -1 on error. While serving,
+ * the job is started right away.
+ */
+int sdp_gang_add_board(sdp_gang *gang, const char *usb_path);
+int sdp_gang_cancel(sdp_gang *gang, int id);
+void sdp_gang_foreach_job(sdp_gang *gang, sdp_gang_job_callback callback, void *arg);
+
+/* Restrict the boards booted automatically while serving to the given paths */
+int sdp_gang_allow_path(sdp_gang *gang, const char *usb_path);
+
+/* Dispatch readable events on fd to handler from the event loop */
+int sdp_gang_watch_fd(sdp_gang *gang, int fd, sdp_gang_fd_handler handler, void *arg);
+void sdp_gang_unwatch_fd(sdp_gang *gang, int fd);
+
+/* Boot all added boards and print a summary, returns non-zero if any failed */
+int sdp_gang_run(sdp_gang *gang);
+/*
+ * Boot every board whose first stage device appears on an allowed path until
+ * sdp_gang_stop() is called.
+ */
+int sdp_gang_serve(sdp_gang *gang);
+void sdp_gang_stop(sdp_gang *gang);
+
+#endif
@@ -0,0 +1,254 @@
+#include "image.h"
+#include "cache.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define READ_CHUNK_SIZE (64 * 1024)
+
+struct sdp_image_
+{
+    char *path;
+    unsigned char *data;
+    size_t size;
+    bool mapped;
+    /* Points into a bundle, which owns the data */
+    bool embedded;
+};
+
+struct embedded_image
+{
+    char *path;
+    const unsigned char *data;
+    size_t size;
+    struct embedded_image *next;
+};
+
+static struct embedded_image *embedded_images;
+
+int sdp_image_embed(const char *path, const unsigned char *data, size_t size)
+{
+    struct embedded_image *entry = malloc(sizeof(struct embedded_image));
+    if (!entry || !(entry->path = strdup(path)))
+    {
+        free(entry);
+        sdp_error("ERROR: Allocation failed\n");
+        return 1;
+    }
+    entry->data = data;
+    entry->size = size;
+    entry->next = embedded_images;
+    embedded_images = entry;
+    return 0;
+}
+
+void sdp_image_clear_embedded(void)
+{
+    while (embedded_images)
+    {
+        struct embedded_image *next = embedded_images->next;
+        free(embedded_images->path);
+        free(embedded_images);
+        embedded_images = next;
+    }
+}
+
+static const struct embedded_image *find_embedded(const char *path)
+{
+    for (const struct embedded_image *entry = embedded_images; entry; entry = entry->next)
+    {
+        if (!strcmp(entry->path, path))
+            return entry;
+    }
+    return NULL;
+}
+
+static int map_file(sdp_image *image, int fd, const struct stat *st)
+{
+    if ((uint64_t)st->st_size > SIZE_MAX)
+    {
+        sdp_error("ERROR: File \"%s\" is too large\n", image->path);
+        return 1;
+    }
+    image->size = st->st_size;
+    image->data = mmap(NULL, image->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image->data == MAP_FAILED)
+    {
+        image->data = NULL;
+        sdp_error("ERROR: Failed to map file \"%s\": %s\n", image->path, strerror(errno));
+        return 1;
+    }
+    image->mapped = true;
+
+    /*
+     * The data is sent front to back exactly once, so let the kernel read
+     * ahead aggressively and drop pages behind us. Failure is harmless.
+     */
+    madvise(image->data, image->size, MADV_SEQUENTIAL);
+    madvise(image->data, image->size, MADV_WILLNEED);
+    return 0;
+}
+
+static int read_file(sdp_image *image, int fd)
+{
+    size_t capacity = 0;
+    for (;;)
+    {
+        if (image->size == capacity)
+        {
+            capacity += READ_CHUNK_SIZE;
+            unsigned char *data = realloc(image->data, capacity);
+            if (!data)
+            {
+                sdp_error("ERROR: Out of memory reading \"%s\"\n", image->path);
+                return 1;
+            }
+            image->data = data;
+        }
+        ssize_t n = read(fd, image->data + image->size, capacity - image->size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            sdp_error("ERROR: Failed to read file \"%s\": %s\n", image->path, strerror(errno));
+            return 1;
+        }
+        if (n == 0)
+            return 0;
+        image->size += n;
+    }
+}
+
+static void unload(sdp_image *image)
+{
+    if (image->mapped)
+        munmap(image->data, image->size);
+    else if (!image->embedded)
+        free(image->data);
+    image->data = NULL;
+    image->size = 0;
+    image->mapped = false;
+}
+
+sdp_image *sdp_image_open(const char *path)
+{
+    sdp_image *image = calloc(1, sizeof(*image));
+    if (!image)
+        return NULL;
+    image->path = strdup(path);
+    if (!image->path)
+        goto free_image;
+
+    const struct embedded_image *embedded = find_embedded(path);
+    if (embedded)
+    {
+        image->data = (unsigned char *)embedded->data;
+        image->size = embedded->size;
+        image->embedded = true;
+        return image;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        sdp_error("ERROR: Failed to open file \"%s\": %s\n", path, strerror(errno));
+        goto free_image;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+        sdp_error("ERROR: Failed to stat file \"%s\": %s\n", path, strerror(errno));
+        goto close_fd;
+    }
+
+    int res;
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        int cache_fd = sdp_cache_lookup(path, &st);
+        if (cache_fd >= 0)
+        {
+            res = map_file(image, cache_fd, &st);
+            close(cache_fd);
+            if (!res)
+            {
+                close(fd);
+                return image;
+            }
+            unload(image);
+        }
+        res = map_file(image, fd, &st);
+    }
+    else
+        res = read_file(image, fd);
+    if (res)
+        goto close_fd;
+
+    if (image->size == 0)
+    {
+        sdp_error("ERROR: File \"%s\" is empty\n", path);
+        goto close_fd;
+    }
+
+    /*
+     * Reject files whose size changed while they were being mapped or read,
+     * e.g. because they are being rewritten. Later changes aren't detected.
+     */
+    if (S_ISREG(st.st_mode))
+    {
+        struct stat now;
+        if (fstat(fd, &now) || now.st_size != st.st_size || (size_t)now.st_size != image->size)
+        {
+            sdp_error("ERROR: File \"%s\" changed size while loading\n", path);
+            goto close_fd;
+        }
+
+        /* Don't publish an image that may mix old and new contents */
+        if (now.st_mtim.tv_sec == st.st_mtim.tv_sec && now.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            int cache_fd = sdp_cache_store(path, &st, image->data, image->size);
+            if (cache_fd >= 0)
+                close(cache_fd);
+        }
+    }
+
+    close(fd);
+    return image;
+
+close_fd:
+    close(fd);
+free_image:
+    sdp_image_close(image);
+    return NULL;
+}
+
+void sdp_image_close(sdp_image *image)
+{
+    if (!image)
+        return;
+    unload(image);
+    free(image->path);
+    free(image);
+}
+
+const char *sdp_image_path(const sdp_image *image)
+{
+    return image->path;
+}
+
+const unsigned char *sdp_image_data(const sdp_image *image)
+{
+    return image->data;
+}
+
+size_t sdp_image_size(const sdp_image *image)
+{
+    return image->size;
+}
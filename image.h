@@ -0,0 +1,30 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <stddef.h>
+
+struct sdp_image_;
+typedef struct sdp_image_ sdp_image;
+
+/*
+ * Load the file at path into a read-only view. Regular files are mapped with
+ * a sequential access hint, anything else (pipes, character devices) is read
+ * into memory. Empty files and files that change size while being loaded are
+ * rejected. Returns NULL on error.
+ */
+sdp_image *sdp_image_open(const char *path);
+void sdp_image_close(sdp_image *image);
+
+/*
+ * Serve sdp_image_open(path) from data instead of the file system, for the
+ * images of a bundle. data has to stay valid until the images opened from it
+ * are closed and sdp_image_clear_embedded() is called.
+ */
+int sdp_image_embed(const char *path, const unsigned char *data, size_t size);
+void sdp_image_clear_embedded(void);
+
+const char *sdp_image_path(const sdp_image *image);
+const unsigned char *sdp_image_data(const sdp_image *image);
+size_t sdp_image_size(const sdp_image *image);
+
+#endif
@@ -0,0 +1,177 @@
+#include "imxsdp.h"
+#include "log.h"
+#include "progress.h"
+#include "stages.h"
+#include "transport.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ERROR_SIZE 256
+
+struct sdp_context_
+{
+    int count;
+    /* sdp_parse_stages() cuts these up and the stages point into them */
+    char **arguments;
+    sdp_stages *stages;
+};
+
+struct sdp_session_
+{
+    sdp_context *context;
+    char *usb_path;
+    struct sdp_callbacks callbacks;
+    /* No callbacks given, print like the tool does */
+    bool print;
+    atomic_bool cancel;
+    char error[ERROR_SIZE];
+};
+
+static void discard_line(void *arg, const char *line)
+{
+    (void)arg;
+    (void)line;
+}
+
+/* Route the output of the calling thread to callbacks, if there are any */
+static void set_handlers(const struct sdp_callbacks *callbacks)
+{
+    if (!callbacks)
+        return;
+    sdp_log_set_handler(callbacks->log ? callbacks->log : discard_line,
+                        callbacks->error ? callbacks->error : discard_line, callbacks->arg);
+}
+
+static void clear_handlers(void)
+{
+    sdp_log_set_handler(NULL, NULL, NULL);
+    sdp_progress_set_handler(NULL, NULL);
+}
+
+static void free_arguments(char **arguments, int count)
+{
+    for (int i = 0; i < count; ++i)
+        free(arguments[i]);
+    free(arguments);
+}
+
+sdp_context *sdp_context_new(int count, const char *const stages[], const struct sdp_callbacks *callbacks)
+{
+    set_handlers(callbacks);
+
+    sdp_context *context = calloc(1, sizeof(sdp_context));
+    if (!context || !(context->arguments = calloc(count, sizeof(char *))))
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        goto free_context;
+    }
+    for (; context->count < count; ++context->count)
+    {
+        if (!(context->arguments[context->count] = strdup(stages[context->count])))
+        {
+            sdp_error("ERROR: Allocation failed\n");
+            goto free_context;
+        }
+    }
+
+    if (sdp_hidapi_init())
+        goto free_context;
+    /* Prepare all stages on this thread, so that their errors go to the caller's callbacks */
+    if (!(context->stages = sdp_parse_stages(count, context->arguments)) ||
+        sdp_compile_stages(context->stages, false))
+        goto exit_hidapi;
+
+    clear_handlers();
+    return context;
+
+exit_hidapi:
+    sdp_hidapi_exit();
+free_context:
+    if (context)
+    {
+        if (context->stages)
+            sdp_free_stages(context->stages);
+        free_arguments(context->arguments, context->count);
+        free(context);
+    }
+    clear_handlers();
+    return NULL;
+}
+
+void sdp_context_free(sdp_context *context)
+{
+    sdp_free_stages(context->stages);
+    free_arguments(context->arguments, context->count);
+    free(context);
+    sdp_hidapi_exit();
+}
+
+sdp_session *sdp_session_new(sdp_context *context, const char *usb_path, const struct sdp_callbacks *callbacks)
+{
+    sdp_session *session = calloc(1, sizeof(sdp_session));
+    if (!session)
+        return NULL;
+    if (usb_path && !(session->usb_path = strdup(usb_path)))
+    {
+        free(session);
+        return NULL;
+    }
+    session->context = context;
+    if (callbacks)
+        session->callbacks = *callbacks;
+    else
+        session->print = true;
+    atomic_init(&session->cancel, false);
+    return session;
+}
+
+void sdp_session_free(sdp_session *session)
+{
+    free(session->usb_path);
+    free(session);
+}
+
+static void session_log(void *arg, const char *line)
+{
+    sdp_session *session = arg;
+    if (session->callbacks.log)
+        session->callbacks.log(session->callbacks.arg, line);
+}
+
+/* Remember the first error, the ones after it only add context */
+static void session_error(void *arg, const char *line)
+{
+    sdp_session *session = arg;
+    if (!session->error[0])
+        snprintf(session->error, sizeof(session->error), "%s", line);
+    if (session->callbacks.error)
+        session->callbacks.error(session->callbacks.arg, line);
+    else if (session->print)
+        fprintf(stderr, "%s\n", line);
+}
+
+int sdp_session_run(sdp_session *session, bool wait)
+{
+    session->error[0] = '\0';
+    /* Errors always go through the session to keep the first one */
+    sdp_log_set_handler(session->print ? NULL : session_log, session_error, session);
+    if (session->callbacks.progress)
+        sdp_progress_set_handler(session->callbacks.progress, session->callbacks.arg);
+
+    int res = sdp_execute_stages(session->context->stages, wait, session->usb_path, &session->cancel);
+
+    clear_handlers();
+    return res;
+}
+
+void sdp_session_cancel(sdp_session *session)
+{
+    atomic_store(&session->cancel, true);
+}
+
+const char *sdp_session_error(const sdp_session *session)
+{
+    return session->error;
+}
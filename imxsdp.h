@@ -0,0 +1,89 @@
+#ifndef IMXSDP_H_
+#define IMXSDP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * libimxsdp boots boards through the i.MX Serial Download Protocol, the same
+ * way as the imx-sdp tool. A context holds a list of stages in the format of
+ * the tool's STAGE arguments, with all of their images loaded. A session
+ * boots one board with the stages of its context. Any number of sessions can
+ * be run at the same time, each one in its own thread.
+ */
+
+struct sdp_context_;
+typedef struct sdp_context_ sdp_context;
+
+struct sdp_session_;
+typedef struct sdp_session_ sdp_session;
+
+struct sdp_progress
+{
+    /* Current stage, starting at 1 */
+    int stage;
+    int stage_count;
+    /* Current step of the stage starting at 1, 0 while opening its device */
+    int step;
+    /* Bytes transferred by the current step so far, and in total */
+    uint64_t done;
+    uint64_t total;
+};
+
+/* Gets one line of output, without the trailing newline */
+typedef void (*sdp_log_callback)(void *arg, const char *line);
+typedef void (*sdp_progress_callback)(void *arg, const struct sdp_progress *progress);
+
+/*
+ * All callbacks are optional and are called from the thread that runs the
+ * session or creates the context. Without callbacks at all, messages are
+ * printed to stdout and stderr.
+ */
+struct sdp_callbacks
+{
+    sdp_log_callback log;
+    sdp_log_callback error;
+    sdp_progress_callback progress;
+    void *arg;
+};
+
+/*
+ * Parse and prepare count stages. Errors are passed to callbacks, which may
+ * be NULL. Returns NULL on error.
+ */
+sdp_context *sdp_context_new(int count, const char *const stages[], const struct sdp_callbacks *callbacks);
+/* All sessions of context have to be freed before */
+void sdp_context_free(sdp_context *context);
+
+/*
+ * Create a session booting the board on usb_path, e.g. "3-1.1", or the first
+ * matching device if usb_path is NULL.
+ */
+sdp_session *sdp_session_new(sdp_context *context, const char *usb_path, const struct sdp_callbacks *callbacks);
+void sdp_session_free(sdp_session *session);
+
+/*
+ * Execute all stages, waiting for the first stage's device if wait is set.
+ * Blocks until the board is booted. Returns 0 on success, otherwise the exit
+ * code imx-sdp would return: 16 * stage (from 1, at most 15) + 1 if the
+ * stage's device wasn't found, 2 if the stage failed or 3 if it ran out of
+ * time, or 1 if the boot couldn't be started at all.
+ */
+int sdp_session_run(sdp_session *session, bool wait);
+/*
+ * Stop a running session before its next step. Can be called from any
+ * thread. A cancelled session fails all further runs.
+ */
+void sdp_session_cancel(sdp_session *session);
+/* The last error message of the session, empty if there was none */
+const char *sdp_session_error(const sdp_session *session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
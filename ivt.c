@@ -0,0 +1,68 @@
+#include "ivt.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define IVT_TAG 0xd1
+#define IVT_LENGTH 0x20
+#define DCD_TAG 0xd2
+
+/* The IVT sits at the start of a boot image, 1 KiB or 4 KiB into flash */
+#define IVT_SEARCH_LIMIT 0x2000
+
+/*
+ * IVT and DCD headers share the layout tag, big endian length, version. The
+ * pointers in the IVT are little endian.
+ */
+static bool valid_header(const unsigned char *p, uint8_t tag)
+{
+    return p[0] == tag && (p[3] & 0xf0) == 0x40;
+}
+
+static size_t header_length(const unsigned char *p)
+{
+    return (size_t)p[1] << 8 | p[2];
+}
+
+static uint32_t read_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static bool valid_dcd(const unsigned char *data, size_t size, size_t offset, size_t *length)
+{
+    if (offset > size || size - offset < 4 || !valid_header(data + offset, DCD_TAG))
+        return false;
+    size_t n = header_length(data + offset);
+    if (n < 4 || n > size - offset)
+        return false;
+    *length = n;
+    return true;
+}
+
+int sdp_find_dcd(const unsigned char *data, size_t size, size_t *offset, size_t *length)
+{
+    if (valid_dcd(data, size, 0, length))
+    {
+        *offset = 0;
+        return 0;
+    }
+
+    for (size_t pos = 0; pos + IVT_LENGTH <= size && pos < IVT_SEARCH_LIMIT; pos += 4)
+    {
+        const unsigned char *ivt = data + pos;
+        if (!valid_header(ivt, IVT_TAG) || header_length(ivt) != IVT_LENGTH)
+            continue;
+        uint32_t dcd = read_le32(ivt + 12);
+        uint32_t self = read_le32(ivt + 20);
+        /* The DCD is linked behind the IVT, so its offset follows from self */
+        if (!dcd || dcd < self || dcd - self > size - pos)
+            continue;
+        size_t dcd_offset = pos + (dcd - self);
+        if (valid_dcd(data, size, dcd_offset, length))
+        {
+            *offset = dcd_offset;
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,18 @@
+#ifndef IVT_H_
+#define IVT_H_
+
+#include <stddef.h>
+
+/* The boot ROM of the i.MX6 and i.MX7 rejects larger DCD tables */
+#define SDP_MAX_DCD_SIZE 1768
+
+/*
+ * Locate the DCD table in data. This is either the whole of data, if it is a
+ * bare DCD table, or the table referenced by the first IVT found in the
+ * image, as in u-boot.imx or an SD card image with its 1 KiB offset. On
+ * success, offset and length describe the table including its header.
+ * Returns non-zero if no valid DCD table was found.
+ */
+int sdp_find_dcd(const unsigned char *data, size_t size, size_t *offset, size_t *length);
+
+#endif
@@ -0,0 +1,484 @@
+#include "loader.h"
+#include "log.h"
+#include <elf.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A WRITE_FILE costs a command report and two responses, so filling a gap
+ * of up to a few data reports is cheaper than starting a new segment.
+ */
+#define MERGE_GAP 4096
+#define ADDRESS_LIMIT ((uint64_t)UINT32_MAX + 1)
+#define MAX_RECORD_SIZE 260
+
+struct piece
+{
+    uint32_t address;
+    uint32_t size;
+    /* Points into the image, or NULL for data decoded into loader->buffer */
+    const unsigned char *data;
+    size_t offset;
+};
+
+struct segment
+{
+    uint32_t address;
+    uint32_t size;
+    const unsigned char *data;
+    unsigned char *owned;
+};
+
+struct sdp_loader_
+{
+    const char *format;
+    const char *path;
+    bool has_entry;
+    uint32_t entry;
+
+    struct piece *pieces;
+    size_t piece_count;
+    size_t piece_capacity;
+
+    /* Data of text records */
+    unsigned char *buffer;
+    size_t buffer_size;
+    size_t buffer_capacity;
+    /* Base address set by extended address records of Intel HEX */
+    uint32_t base;
+
+    struct segment *segments;
+    size_t count;
+};
+
+static int grow(void **array, size_t *capacity, size_t needed, size_t element_size)
+{
+    if (needed <= *capacity)
+        return 0;
+    size_t n = *capacity ? *capacity : 16;
+    while (n < needed)
+        n *= 2;
+    void *p = realloc(*array, n * element_size);
+    if (!p)
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        return 1;
+    }
+    *array = p;
+    *capacity = n;
+    return 0;
+}
+
+static int add_piece(sdp_loader *loader, uint32_t address, const unsigned char *data, size_t size)
+{
+    if (grow((void **)&loader->pieces, &loader->piece_capacity, loader->piece_count + 1,
+             sizeof(struct piece)))
+        return 1;
+    loader->pieces[loader->piece_count++] = (struct piece){
+        .address = address,
+        .size = size,
+        .data = data,
+    };
+    return 0;
+}
+
+/* Append record data, extending the previous piece if it continues it */
+static int add_record_data(sdp_loader *loader, uint64_t address, const unsigned char *data, size_t size)
+{
+    if (!size)
+        return 0;
+    if (address + size > ADDRESS_LIMIT)
+        return -1;
+    if (grow((void **)&loader->buffer, &loader->buffer_capacity, loader->buffer_size + size, 1))
+        return -2;
+    memcpy(loader->buffer + loader->buffer_size, data, size);
+
+    struct piece *last = loader->piece_count ? loader->pieces + loader->piece_count - 1 : NULL;
+    if (last && last->offset + last->size == loader->buffer_size &&
+        (uint64_t)last->address + last->size == address)
+        last->size += size;
+    else
+    {
+        if (add_piece(loader, address, NULL, size))
+            return -2;
+        loader->pieces[loader->piece_count - 1].offset = loader->buffer_size;
+    }
+    loader->buffer_size += size;
+    return 0;
+}
+
+static uint64_t read_uint(const unsigned char *p, size_t n, bool big_endian)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < n; ++i)
+        value |= (uint64_t)p[big_endian ? i : n - 1 - i] << (8 * (n - 1 - i));
+    return value;
+}
+
+#define FIELD(p, type, field) \
+    read_uint((p) + offsetof(type, field), sizeof(((type *)0)->field), big_endian)
+
+static int parse_elf(sdp_loader *loader, const unsigned char *data, size_t size)
+{
+    bool elf64 = data[EI_CLASS] == ELFCLASS64;
+    bool big_endian = data[EI_DATA] == ELFDATA2MSB;
+    if ((!elf64 && data[EI_CLASS] != ELFCLASS32) ||
+        (!big_endian && data[EI_DATA] != ELFDATA2LSB) ||
+        size < (elf64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr)))
+    {
+        sdp_error("ERROR: Invalid ELF header in \"%s\"\n", loader->path);
+        return 1;
+    }
+
+    uint64_t entry, phoff, phentsize, phnum;
+    if (elf64)
+    {
+        entry = FIELD(data, Elf64_Ehdr, e_entry);
+        phoff = FIELD(data, Elf64_Ehdr, e_phoff);
+        phentsize = FIELD(data, Elf64_Ehdr, e_phentsize);
+        phnum = FIELD(data, Elf64_Ehdr, e_phnum);
+    }
+    else
+    {
+        entry = FIELD(data, Elf32_Ehdr, e_entry);
+        phoff = FIELD(data, Elf32_Ehdr, e_phoff);
+        phentsize = FIELD(data, Elf32_Ehdr, e_phentsize);
+        phnum = FIELD(data, Elf32_Ehdr, e_phnum);
+    }
+    if (phentsize < (elf64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr)) ||
+        phoff > size || phnum > (size - phoff) / phentsize)
+    {
+        sdp_error("ERROR: Invalid ELF program headers in \"%s\"\n", loader->path);
+        return 1;
+    }
+    if (entry < ADDRESS_LIMIT)
+    {
+        loader->has_entry = entry != 0;
+        loader->entry = entry;
+    }
+
+    for (uint64_t i = 0; i < phnum; ++i)
+    {
+        const unsigned char *ph = data + phoff + i * phentsize;
+        uint64_t type, offset, address, filesz;
+        if (elf64)
+        {
+            type = FIELD(ph, Elf64_Phdr, p_type);
+            offset = FIELD(ph, Elf64_Phdr, p_offset);
+            address = FIELD(ph, Elf64_Phdr, p_paddr);
+            filesz = FIELD(ph, Elf64_Phdr, p_filesz);
+        }
+        else
+        {
+            type = FIELD(ph, Elf32_Phdr, p_type);
+            offset = FIELD(ph, Elf32_Phdr, p_offset);
+            address = FIELD(ph, Elf32_Phdr, p_paddr);
+            filesz = FIELD(ph, Elf32_Phdr, p_filesz);
+        }
+        /* The rest of memsz is .bss, which the firmware clears itself */
+        if (type != PT_LOAD || !filesz)
+            continue;
+        if (offset > size || filesz > size - offset || address > ADDRESS_LIMIT - filesz)
+        {
+            sdp_error("ERROR: Invalid ELF segment %lu in \"%s\"\n", (unsigned long)i, loader->path);
+            return 1;
+        }
+        if (add_piece(loader, address, data + offset, filesz))
+            return 1;
+    }
+    return 0;
+}
+
+static int hex_digit(unsigned char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Decode a string of hex digit pairs, returns the number of bytes or -1 */
+static int decode_hex(const unsigned char *s, size_t length, unsigned char *out)
+{
+    if (length % 2 || length / 2 > MAX_RECORD_SIZE)
+        return -1;
+    for (size_t i = 0; i < length / 2; ++i)
+    {
+        int hi = hex_digit(s[2 * i]), lo = hex_digit(s[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return -1;
+        out[i] = hi << 4 | lo;
+    }
+    return length / 2;
+}
+
+static void set_entry(sdp_loader *loader, uint32_t entry)
+{
+    loader->has_entry = true;
+    loader->entry = entry;
+}
+
+/*
+ * Record parsers return 0 to continue, 1 after the end of file record, -1 if
+ * the record is invalid and -2 on errors that have been reported already.
+ */
+static int parse_ihex_record(sdp_loader *loader, const unsigned char *line, size_t length)
+{
+    unsigned char rec[MAX_RECORD_SIZE];
+    int n = line[0] == ':' ? decode_hex(line + 1, length - 1, rec) : -1;
+    if (n < 5 || n != rec[0] + 5)
+        return -1;
+    unsigned char sum = 0;
+    for (int i = 0; i < n; ++i)
+        sum += rec[i];
+    if (sum)
+        return -1;
+
+    const unsigned char *payload = rec + 4;
+    uint32_t offset = rec[1] << 8 | rec[2];
+    switch (rec[3])
+    {
+    case 0x00:
+        return add_record_data(loader, (uint64_t)loader->base + offset, payload, rec[0]);
+    case 0x01:
+        return 1;
+    case 0x02:
+        if (rec[0] != 2)
+            return -1;
+        loader->base = (uint32_t)read_uint(payload, 2, true) << 4;
+        return 0;
+    case 0x03:
+        if (rec[0] != 4)
+            return -1;
+        set_entry(loader, (read_uint(payload, 2, true) << 4) + read_uint(payload + 2, 2, true));
+        return 0;
+    case 0x04:
+        if (rec[0] != 2)
+            return -1;
+        loader->base = (uint32_t)read_uint(payload, 2, true) << 16;
+        return 0;
+    case 0x05:
+        if (rec[0] != 4)
+            return -1;
+        set_entry(loader, read_uint(payload, 4, true));
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static int parse_srec_record(sdp_loader *loader, const unsigned char *line, size_t length)
+{
+    /* Address length of the record types S0 to S9, 0 for invalid ones */
+    static const int address_length[10] = {2, 2, 3, 4, 0, 2, 3, 4, 3, 2};
+    unsigned char rec[MAX_RECORD_SIZE];
+    if (length < 2 || line[0] != 'S' || hex_digit(line[1]) < 0 || hex_digit(line[1]) > 9)
+        return -1;
+    int type = line[1] - '0';
+    int n = decode_hex(line + 2, length - 2, rec);
+    int alen = address_length[type];
+    if (!alen || n < alen + 2 || n != rec[0] + 1)
+        return -1;
+    unsigned char sum = 0;
+    for (int i = 0; i < n; ++i)
+        sum += rec[i];
+    if (sum != 0xff)
+        return -1;
+
+    uint32_t address = read_uint(rec + 1, alen, true);
+    switch (type)
+    {
+    case 1:
+    case 2:
+    case 3:
+        return add_record_data(loader, address, rec + 1 + alen, n - alen - 2);
+    case 7:
+    case 8:
+    case 9:
+        set_entry(loader, address);
+        return 1;
+    default:
+        /* Header and record counts */
+        return 0;
+    }
+}
+
+static int parse_lines(sdp_loader *loader, const unsigned char *data, size_t size,
+                       int (*parse_record)(sdp_loader *, const unsigned char *, size_t))
+{
+    size_t number = 0;
+    for (size_t pos = 0; pos < size;)
+    {
+        const unsigned char *line = data + pos;
+        const unsigned char *newline = memchr(line, '\n', size - pos);
+        size_t length = newline ? (size_t)(newline - line) : size - pos;
+        pos += length + 1;
+        ++number;
+
+        while (length && (line[length - 1] == '\r' || line[length - 1] == ' ' || line[length - 1] == '\t'))
+            --length;
+        if (!length)
+            continue;
+        int res = parse_record(loader, line, length);
+        if (res == -1)
+            sdp_error("ERROR: Invalid %s record in \"%s\" line %zu\n", loader->format, loader->path, number);
+        if (res < 0)
+            return 1;
+        if (res > 0)
+            break;
+    }
+
+    for (size_t i = 0; i < loader->piece_count; ++i)
+        loader->pieces[i].data = loader->buffer + loader->pieces[i].offset;
+    return 0;
+}
+
+static int compare_pieces(const void *a, const void *b)
+{
+    const struct piece *pa = a, *pb = b;
+    return pa->address < pb->address ? -1 : pa->address > pb->address;
+}
+
+static int merge_pieces(sdp_loader *loader)
+{
+    if (!loader->piece_count)
+    {
+        sdp_error("ERROR: \"%s\" contains no data to load\n", loader->path);
+        return 1;
+    }
+    qsort(loader->pieces, loader->piece_count, sizeof(struct piece), compare_pieces);
+
+    loader->segments = calloc(loader->piece_count, sizeof(struct segment));
+    if (!loader->segments)
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        return 1;
+    }
+
+    for (size_t first = 0, last; first < loader->piece_count; first = last + 1)
+    {
+        uint64_t start = loader->pieces[first].address;
+        uint64_t end = start + loader->pieces[first].size;
+        for (last = first; last + 1 < loader->piece_count; ++last)
+        {
+            const struct piece *next = loader->pieces + last + 1;
+            if (next->address < end)
+            {
+                sdp_error("ERROR: Overlapping data at 0x%08x in \"%s\"\n", next->address, loader->path);
+                return 1;
+            }
+            if (next->address - end > MERGE_GAP || next->address + (uint64_t)next->size - start > UINT32_MAX)
+                break;
+            end = next->address + (uint64_t)next->size;
+        }
+
+        struct segment *segment = loader->segments + loader->count++;
+        segment->address = start;
+        segment->size = end - start;
+        if (first == last)
+        {
+            segment->data = loader->pieces[first].data;
+            continue;
+        }
+        segment->owned = calloc(1, segment->size);
+        if (!segment->owned)
+        {
+            sdp_error("ERROR: Allocation failed\n");
+            return 1;
+        }
+        for (size_t i = first; i <= last; ++i)
+            memcpy(segment->owned + (loader->pieces[i].address - start), loader->pieces[i].data,
+                   loader->pieces[i].size);
+        segment->data = segment->owned;
+    }
+    return 0;
+}
+
+sdp_loader *sdp_loader_open(const sdp_image *image)
+{
+    const unsigned char *data = sdp_image_data(image);
+    size_t size = sdp_image_size(image);
+
+    sdp_loader *loader = calloc(1, sizeof(sdp_loader));
+    if (!loader)
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        return NULL;
+    }
+    loader->path = sdp_image_path(image);
+
+    int res;
+    if (size >= SELFMAG && !memcmp(data, ELFMAG, SELFMAG))
+    {
+        loader->format = "ELF";
+        res = parse_elf(loader, data, size);
+    }
+    else if (data[0] == ':')
+    {
+        loader->format = "Intel HEX";
+        res = parse_lines(loader, data, size, parse_ihex_record);
+    }
+    else if (data[0] == 'S' && size > 1 && data[1] >= '0' && data[1] <= '9')
+    {
+        loader->format = "S-record";
+        res = parse_lines(loader, data, size, parse_srec_record);
+    }
+    else
+    {
+        sdp_error("ERROR: \"%s\" is not an ELF, Intel HEX or S-record file\n", loader->path);
+        res = 1;
+    }
+
+    if (res || merge_pieces(loader))
+    {
+        sdp_loader_close(loader);
+        return NULL;
+    }
+    return loader;
+}
+
+void sdp_loader_close(sdp_loader *loader)
+{
+    for (size_t i = 0; i < loader->count; ++i)
+        free(loader->segments[i].owned);
+    free(loader->segments);
+    free(loader->pieces);
+    free(loader->buffer);
+    free(loader);
+}
+
+const char *sdp_loader_path(const sdp_loader *loader)
+{
+    return loader->path;
+}
+
+const char *sdp_loader_format(const sdp_loader *loader)
+{
+    return loader->format;
+}
+
+size_t sdp_loader_count(const sdp_loader *loader)
+{
+    return loader->count;
+}
+
+const unsigned char *sdp_loader_segment(const sdp_loader *loader, size_t i,
+                                        uint32_t *address, uint32_t *size)
+{
+    *address = loader->segments[i].address;
+    *size = loader->segments[i].size;
+    return loader->segments[i].data;
+}
+
+int sdp_loader_entry(const sdp_loader *loader, uint32_t *entry)
+{
+    if (!loader->has_entry)
+        return 1;
+    *entry = loader->entry;
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef LOADER_H_
+#define LOADER_H_
+
+#include "image.h"
+#include <stddef.h>
+#include <stdint.h>
+
+struct sdp_loader_;
+typedef struct sdp_loader_ sdp_loader;
+
+/*
+ * Split an ELF, Intel HEX or S-record image into the memory ranges it loads.
+ * Ranges that are only a few KiB apart are merged into one segment with the
+ * gap zero filled, as that is cheaper to send than another command. Returns
+ * NULL if the image isn't in one of these formats or is malformed. The
+ * segments point into image, which has to stay open while they are used.
+ */
+sdp_loader *sdp_loader_open(const sdp_image *image);
+void sdp_loader_close(sdp_loader *loader);
+
+const char *sdp_loader_path(const sdp_loader *loader);
+const char *sdp_loader_format(const sdp_loader *loader);
+size_t sdp_loader_count(const sdp_loader *loader);
+/* Return the data of segment i, which is loaded to address */
+const unsigned char *sdp_loader_segment(const sdp_loader *loader, size_t i,
+                                        uint32_t *address, uint32_t *size);
+/* Get the entry point, returns non-zero if the image doesn't name one */
+int sdp_loader_entry(const sdp_loader *loader, uint32_t *entry);
+
+#endif
@@ -0,0 +1,107 @@
+#include "log.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+struct line
+{
+    char buf[1024];
+    size_t len;
+};
+
+struct handler
+{
+    sdp_log_callback info;
+    sdp_log_callback error;
+    void *arg;
+};
+
+static __thread const char *tag;
+static __thread struct line info_line, error_line;
+static __thread struct handler handler;
+
+void sdp_log_set_tag(const char *t)
+{
+    tag = t;
+}
+
+void sdp_log_set_handler(sdp_log_callback info, sdp_log_callback error, void *arg)
+{
+    handler.info = info;
+    handler.error = error;
+    handler.arg = arg;
+    /* Don't hand the rest of a previous line to the new handler */
+    info_line.len = 0;
+    error_line.len = 0;
+}
+
+static void flush_line(FILE *stream, sdp_log_callback callback, char *s, size_t len)
+{
+    if (callback)
+    {
+        s[len - 1] = '\0';
+        callback(handler.arg, s);
+        return;
+    }
+
+    flockfile(stream);
+    fprintf(stream, "[%s] ", tag);
+    fwrite(s, 1, len, stream);
+    funlockfile(stream);
+}
+
+static void vlog(FILE *stream, sdp_log_callback callback, struct line *line, const char *format, va_list ap)
+{
+    if (!tag && !callback)
+    {
+        vfprintf(stream, format, ap);
+        return;
+    }
+
+    /*
+     * Several threads may print at the same time, so only ever emit complete
+     * lines, each one prefixed with the tag of the thread. Handlers get
+     * complete lines as well.
+     */
+    size_t space = sizeof(line->buf) - line->len;
+    int n = vsnprintf(line->buf + line->len, space, format, ap);
+    if (n < 0)
+        return;
+    line->len += (size_t)n < space ? (size_t)n : space - 1;
+
+    char *start = line->buf;
+    char *end = line->buf + line->len;
+    char *nl;
+    while ((nl = memchr(start, '\n', end - start)))
+    {
+        flush_line(stream, callback, start, nl - start + 1);
+        start = nl + 1;
+    }
+
+    line->len = end - start;
+    if (line->len == sizeof(line->buf) - 1)
+    {
+        /* Overlong line, emit what we have */
+        line->buf[line->len++] = '\n';
+        flush_line(stream, callback, line->buf, line->len);
+        line->len = 0;
+    }
+    else
+        memmove(line->buf, start, line->len);
+}
+
+void sdp_info(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vlog(stdout, handler.info, &info_line, format, ap);
+    va_end(ap);
+}
+
+void sdp_error(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vlog(stderr, handler.error, &error_line, format, ap);
+    va_end(ap);
+}
@@ -0,0 +1,20 @@
+#ifndef LOG_H_
+#define LOG_H_
+
+#include "imxsdp.h"
+
+/*
+ * Tag all messages printed by the calling thread with "[<tag>] ", e.g. the
+ * USB path of the board the thread is working on. Pass NULL to clear it.
+ */
+void sdp_log_set_tag(const char *tag);
+/*
+ * Pass the messages of the calling thread to info and error line by line
+ * instead of printing them. Pass NULLs to print them again.
+ */
+void sdp_log_set_handler(sdp_log_callback info, sdp_log_callback error, void *arg);
+
+void sdp_info(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void sdp_error(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+#endif
@@ -1,5 +1,25 @@
 #include "config.h"
+#include "cache.h"
+#include "deadline.h"
+#include "metrics.h"
+#include "plan.h"
+#include "scheduler.h"
+#include "sdp.h"
 #include "stages.h"
+#include "trace.h"
+#ifdef WITH_EMULATOR
+#include "emulator.h"
+#endif
+#ifdef WITH_LIBUSB
+#include "transport_libusb.h"
+#endif
+#ifdef WITH_URING
+#include "transport_uring.h"
+#endif
+#ifdef WITH_UDEV
+#include "daemon.h"
+#include "gang.h"
+#endif
 #include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -7,10 +27,42 @@
 #include <stdlib.h>
 
 static void usage(const char *progname);
+static int execute_gang(sdp_stages *stages, bool initial_wait, const char *usb_paths[], int count);
+static int execute_daemon(sdp_stages *stages, const char *socket_path, const char *usb_paths[], int count);
+
+#define DEFAULT_SOCKET_PATH "/tmp/imx-sdp.sock"
 
 static const struct option longopts[] = {
+	{"bundle", required_argument, NULL, 'B'},
+	{"backoff", required_argument, NULL, 'b'},
+	{"cache", required_argument, NULL, 'c'},
+	{"daemon", no_argument, NULL, 'd'},
+#ifdef WITH_EMULATOR
+	{"emulate", optional_argument, NULL, 'e'},
+#endif
+#ifdef WITH_UDEV
+	{"hub-limit", required_argument, NULL, 'H'},
+#endif
 	{"help", no_argument, NULL, 'h'},
+	{"load-plan", required_argument, NULL, 'L'},
+#ifdef WITH_LIBUSB
+	{"libusb", no_argument, NULL, 'l'},
+	{"queue", required_argument, NULL, 'q'},
+#endif
+#ifdef WITH_UDEV
+	{"metrics-listen", required_argument, NULL, 'M'},
+#endif
+	{"metrics", required_argument, NULL, 'm'},
+	{"make-bundle", required_argument, NULL, 'P'},
 	{"path", required_argument, NULL, 'p'},
+	{"retries", required_argument, NULL, 'r'},
+	{"save-plan", required_argument, NULL, 'S'},
+	{"socket", required_argument, NULL, 's'},
+	{"timeout", required_argument, NULL, 'T'},
+	{"trace", required_argument, NULL, 't'},
+#ifdef WITH_URING
+	{"io-uring", no_argument, NULL, 'u'},
+#endif
 	{"version", no_argument, NULL, 'V'},
 	{"wait", no_argument, NULL, 'w'},
 	{0},
@@ -24,18 +76,129 @@ int main(int argc, char *argv[])
 
 	int opt;
 	bool initial_wait = false;
-	const char *usb_path = NULL;
+	bool run_daemon = false;
+#ifdef WITH_LIBUSB
+	bool use_libusb = false;
+	int queue_depth = SDP_LIBUSB_DEFAULT_DEPTH;
+#endif
+	const char *socket_path = DEFAULT_SOCKET_PATH;
+	unsigned long retries = 0;
+	unsigned long backoff_ms = SDP_DEFAULT_BACKOFF_MS;
+	unsigned long max_backoff_ms = SDP_DEFAULT_MAX_BACKOFF_MS;
+	char *end;
+	const char *load_plan = NULL;
+	const char *save_plan = NULL;
+	const char *bundle = NULL;
+	const char *make_bundle = NULL;
+	const char *metrics_address = NULL;
+	const char **usb_paths = calloc(argc, sizeof(*usb_paths));
+	int usb_path_count = 0;
+	if (!usb_paths)
+	{
+		fprintf(stderr, "ERROR: Allocation failed\n");
+		return EXIT_FAILURE;
+	}
 
-	while ((opt = getopt_long(argc, argv, "hp:wV", longopts, NULL)) != -1)
+	while ((opt = getopt_long(argc, argv, "B:b:c:de::H:hL:lM:m:P:p:q:r:S:s:T:t:uwV", longopts, NULL)) != -1)
 	{
 		switch (opt)
 		{
+		case 'B':
+			bundle = optarg;
+			break;
+		case 'b':
+			backoff_ms = strtoul(optarg, &end, 10);
+			if (*end == ':')
+				max_backoff_ms = strtoul(end + 1, &end, 10);
+			else
+				max_backoff_ms = backoff_ms > max_backoff_ms ? backoff_ms : max_backoff_ms;
+			if (end == optarg || *end || max_backoff_ms < backoff_ms || max_backoff_ms > 60000)
+			{
+				fprintf(stderr, "ERROR: Invalid backoff \"%s\"\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c':
+			if (sdp_cache_init(optarg))
+				return EXIT_FAILURE;
+			break;
+		case 'd':
+			run_daemon = true;
+			break;
+#ifdef WITH_EMULATOR
+		case 'e':
+			if (sdp_emu_configure(optarg))
+				return EXIT_FAILURE;
+			break;
+#endif
+#ifdef WITH_UDEV
+		case 'H':
+			if (sdp_sched_configure(optarg))
+				return EXIT_FAILURE;
+			break;
+#endif
 		case 'h':
 			usage(argv[0]);
 			return EXIT_SUCCESS;
+		case 'L':
+			load_plan = optarg;
+			break;
+#ifdef WITH_LIBUSB
+		case 'l':
+			use_libusb = true;
+			break;
+		case 'q':
+			queue_depth = atoi(optarg);
+			if (queue_depth < 1 || queue_depth > SDP_LIBUSB_MAX_DEPTH)
+			{
+				fprintf(stderr, "ERROR: Queue depth must be between 1 and %d\n", SDP_LIBUSB_MAX_DEPTH);
+				return EXIT_FAILURE;
+			}
+			break;
+#endif
+#ifdef WITH_UDEV
+		case 'M':
+			metrics_address = optarg;
+			break;
+#endif
+		case 'm':
+			if (sdp_metrics_set_textfile(optarg))
+				return EXIT_FAILURE;
+			break;
+		case 'P':
+			make_bundle = optarg;
+			break;
 		case 'p':
-			usb_path = optarg;
+			usb_paths[usb_path_count++] = optarg;
+			break;
+		case 'r':
+			retries = strtoul(optarg, &end, 10);
+			if (end == optarg || *end || retries > 1000)
+			{
+				fprintf(stderr, "ERROR: Invalid retry count \"%s\"\n", optarg);
+				return EXIT_FAILURE;
+			}
 			break;
+		case 'S':
+			save_plan = optarg;
+			break;
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'T':
+			if (sdp_timeouts_configure(optarg))
+				return EXIT_FAILURE;
+			break;
+		case 't':
+			if (sdp_trace_init(optarg))
+				return EXIT_FAILURE;
+			break;
+#ifdef WITH_URING
+		case 'u':
+			if (sdp_uring_init())
+				return EXIT_FAILURE;
+			break;
+#endif
 		case 'w':
 			initial_wait = true;
 			break;
@@ -47,50 +210,250 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (optind >= argc)
+	sdp_set_retry_policy(retries, backoff_ms, max_backoff_ms);
+#ifdef WITH_LIBUSB
+	if (use_libusb)
+		sdp_libusb_configure(queue_depth);
+#endif
+#if defined(WITH_LIBUSB) && defined(WITH_URING)
+	if (use_libusb && sdp_uring_enabled())
 	{
-		fprintf(stderr, "ERROR: Expected at least one stage\n");
-		usage(argv[0]);
+		fprintf(stderr, "ERROR: --libusb and --io-uring can't be combined\n");
 		return EXIT_FAILURE;
 	}
+#endif
 
-	sdp_stages *stages = sdp_parse_stages(argc - optind, argv + optind);
+	sdp_plan *plan;
+	if (load_plan && bundle)
+	{
+		fprintf(stderr, "ERROR: --load-plan and --bundle can't be combined\n");
+		return EXIT_FAILURE;
+	}
+	if (load_plan || bundle)
+	{
+		if (optind < argc)
+		{
+			fprintf(stderr, "ERROR: No stages can be given together with %s\n",
+				load_plan ? "--load-plan" : "--bundle");
+			return EXIT_FAILURE;
+		}
+		plan = load_plan ? sdp_plan_load(load_plan) : sdp_plan_load_bundle(bundle);
+	}
+	else
+	{
+		if (optind >= argc)
+		{
+			fprintf(stderr, "ERROR: Expected at least one stage\n");
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		plan = sdp_plan_new(argc - optind, argv + optind);
+	}
+	if (!plan)
+		return EXIT_FAILURE;
+
+	sdp_stages *stages = sdp_parse_stages(sdp_plan_count(plan), sdp_plan_arguments(plan));
 	if (!stages)
 	{
 		fprintf(stderr, "ERROR: Failed to parse stages\n");
 		return EXIT_FAILURE;
 	}
+	/* Load and check all images before the first device is opened */
+	if (sdp_compile_stages(stages, true) || ((load_plan || bundle) && sdp_plan_check(plan, stages)))
+		return EXIT_FAILURE;
+	if (save_plan || make_bundle)
+	{
+		/* Reject images that would only fail once their stage is reached */
+		int result = EXIT_FAILURE;
+		if (!sdp_prepare_stages(stages) && (!save_plan || !sdp_plan_save(plan, save_plan, stages)) &&
+			(!make_bundle || !sdp_plan_save_bundle(plan, make_bundle, stages)))
+			result = EXIT_SUCCESS;
+		sdp_free_stages(stages);
+		sdp_plan_free(plan);
+		return result;
+	}
 
-	int result = sdp_execute_stages(stages, initial_wait, usb_path);
+	int result;
+#ifdef WITH_EMULATOR
+	if (sdp_emu_enabled() && (run_daemon || usb_path_count > 1))
+	{
+		fprintf(stderr, "ERROR: The emulator only supports booting a single board\n");
+		return EXIT_FAILURE;
+	}
+#endif
+	/* Scrapes are answered from the event loop of the gang */
+	if (metrics_address && !run_daemon && usb_path_count < 2)
+	{
+		fprintf(stderr, "ERROR: --metrics-listen needs --daemon or several --path's\n");
+		return EXIT_FAILURE;
+	}
+	if (metrics_address && sdp_metrics_listen(metrics_address))
+		return EXIT_FAILURE;
+
+	if (run_daemon)
+		result = execute_daemon(stages, socket_path, usb_paths, usb_path_count);
+	else if (usb_path_count > 1)
+		result = execute_gang(stages, initial_wait, usb_paths, usb_path_count);
+	else
+		result = sdp_execute_stages(stages, initial_wait, usb_path_count ? usb_paths[0] : NULL, NULL);
 
 	sdp_free_stages(stages);
+	sdp_plan_free(plan);
+	free(usb_paths);
+	sdp_cache_cleanup();
+	sdp_trace_cleanup();
+	sdp_metrics_cleanup();
+	sdp_sched_cleanup();
+#ifdef WITH_URING
+	sdp_uring_cleanup();
+#endif
+#ifdef WITH_EMULATOR
+	sdp_emu_cleanup();
+#endif
 
 	return result;
 }
 
+#ifdef WITH_UDEV
+static int execute_gang(sdp_stages *stages, bool initial_wait, const char *usb_paths[], int count)
+{
+	sdp_gang *gang = sdp_gang_new(stages, initial_wait);
+	if (!gang)
+		return EXIT_FAILURE;
+
+	int result = EXIT_SUCCESS;
+	for (int i = 0; !result && i < count; ++i)
+	{
+		if (sdp_gang_add_board(gang, usb_paths[i]) < 0)
+			result = EXIT_FAILURE;
+	}
+
+	if (!result)
+		result = sdp_gang_run(gang);
+
+	sdp_gang_free(gang);
+	return result;
+}
+
+static int execute_daemon(sdp_stages *stages, const char *socket_path, const char *usb_paths[], int count)
+{
+	return sdp_daemon_run(stages, socket_path, usb_paths, count) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#else
+static int execute_gang(sdp_stages *stages, bool initial_wait, const char *usb_paths[], int count)
+{
+	fprintf(stderr, "ERROR: Booting several boards at once is only supported with udev support\n");
+	return EXIT_FAILURE;
+}
+
+static int execute_daemon(sdp_stages *stages, const char *socket_path, const char *usb_paths[], int count)
+{
+	fprintf(stderr, "ERROR: Daemon mode is only supported with udev support\n");
+	return EXIT_FAILURE;
+}
+#endif
+
 static void usage(const char *progname)
 {
 	printf(
 		"Usage: %s [OPTION]... <STAGE>...\n"
+		"       %s [OPTION]... --load-plan <FILE>\n"
+		"       %s [OPTION]... --bundle <FILE>\n"
 		"\n"
 		"The following OPTIONs are available:\n"
 		"\n"
+		"  -B, --bundle  take the STAGEs and all their images from a bundle made\n"
+		"                with --make-bundle, refusing to boot if it is corrupt\n"
+		"  -b, --backoff  milliseconds to wait before the first retry of a transfer,\n"
+		"                 doubled for each further one up to an optional maximum\n"
+		"                 given after a colon (default: 10:1000)\n"
+		"  -c, --cache  share loaded images with other imx-sdp processes through\n"
+		"               entries in the given directory, e.g. /dev/shm\n"
+		"  -d, --daemon  keep running and boot every board whose first stage\n"
+		"                device appears (on one of the --path's, if given)\n"
+#ifdef WITH_EMULATOR
+		"  -e, --emulate[=CONFIG]  talk to an emulated boot ROM instead of USB\n"
+		"                devices, CONFIG is a comma separated list of:\n"
+		"                latency=<US>, queue=<N>, boot=<MS>, mem=<START>:<SIZE>, status=<HEX>,\n"
+		"                hab=open|closed, fail_write=<N>, fail_read=<N>, jump_fail\n"
+#endif
+#ifdef WITH_UDEV
+		"  -H, --hub-limit  limit the number of concurrent file transfers of\n"
+		"                   several boards, given as a comma separated list of\n"
+		"                   bus=<N> (per root bus), hub=<N> (per hub), tt=<N> (per\n"
+		"                   transaction translator) and <HUB-PATH>=<N> (one hub)\n"
+#endif
 		"  -h, --help  print this usage message\n"
-		"  -p, --path  specify the USB device path, e.g. 3-1.1\n"
+		"  -L, --load-plan  take the STAGEs from a boot plan saved with --save-plan,\n"
+		"                   refusing to boot if any of its images changed\n"
+#ifdef WITH_LIBUSB
+		"  -l, --libusb  talk to devices through libusb, keeping several data\n"
+		"                reports in flight; falls back to hidapi if the kernel\n"
+		"                driver can't be detached\n"
+#endif
+#ifdef WITH_UDEV
+		"  -M, --metrics-listen  serve metrics to Prometheus on unix:<PATH> or\n"
+		"                        [<HOST>]:<PORT> during gang and daemon runs\n"
+#endif
+		"  -m, --metrics  write boot counters and latency histograms to the given\n"
+		"                 file in Prometheus text format on exit\n"
+		"  -P, --make-bundle  load and check all images of the STAGEs, save them\n"
+		"                     together with the STAGEs to the given file and exit\n"
+		"  -p, --path  specify the USB device path, e.g. 3-1.1; given several\n"
+		"              times, all boards are booted concurrently\n"
+#ifdef WITH_LIBUSB
+		"  -q, --queue  number of data reports in flight with --libusb (default: 8)\n"
+#endif
+		"  -r, --retries  number of times a file transfer that fails partway is\n"
+		"                 resumed, if the boot ROM still answers (default: 0)\n"
+		"  -S, --save-plan  load and check all images of the STAGEs, save them as\n"
+		"                   a boot plan to the given file and exit\n"
+		"  -s, --socket  control socket of the daemon (default: " DEFAULT_SOCKET_PATH ")\n"
+		"  -T, --timeout  limit the time in milliseconds, given as a comma separated\n"
+		"                 list of io=<MS> (each reply of the device), device=<MS>\n"
+		"                 (waiting for a device, default: 20000), stage=<MS> (each\n"
+		"                 stage) and run=<MS> (all stages of a board), 0 is no limit\n"
+		"  -t, --trace  write the duration of every boot phase to the given file\n"
+		"               in Chrome trace event format\n"
+#ifdef WITH_URING
+		"  -u, --io-uring  write and read reports on hidraw through a single\n"
+		"                io_uring shared by all boards, in batches\n"
+#endif
 		"  -V, --version  print version\n"
 		"  -w, --wait  wait for the first stage\n"
 		"\n"
 		"The STAGEs have the following format:\n"
 		"\n"
-		"  <VID>:<PID>[,<STEP>...]\n"
+		"  <VID>:<PID>[:<PROTOCOL>][,<STEP>...]\n"
 		"    VID  USB Vendor ID as 4-digit hex number\n"
 		"    PID  USB Product ID as 4-digit hex number\n"
+		"    PROTOCOL  sdp or sdps, by default sdps for the i.MX8 and later ROMs\n"
+		"              that require it and sdp otherwise\n"
 		"\n"
 		"The STEPs can be one of the following operations:\n"
 		"\n"
 		"  write_file:<FILE>:<ADDRESS>\n"
 		"    Write the contents of FILE to ADDRESS\n"
+		"    (gzip, zstd and lz4 compressed FILEs are decompressed on the fly)\n"
 		"  jump_address:<ADDRESS>\n"
-		"    Jump to the IMX image located at ADDRESS\n",
-		progname);
+		"    Jump to the IMX image located at ADDRESS\n"
+		"  load_file:<FILE>[:jump]\n"
+		"    Write each segment of the ELF, Intel HEX or S-record FILE to its\n"
+		"    address, then optionally jump to the entry point of FILE\n"
+		"  verify_file:<FILE>:<ADDRESS>[:<SAMPLES>]\n"
+		"    Read back the memory at ADDRESS and compare it to FILE, only\n"
+		"    SAMPLES blocks of 4 KiB spread over FILE if given\n"
+		"  read_memory:<ADDRESS>:<LENGTH>:<FILE>\n"
+		"    Write LENGTH (hex) bytes of memory at ADDRESS to FILE\n"
+		"  register_script:<FILE>\n"
+		"    Run the register writes, read-modify-writes and polls in FILE\n"
+		"  dcd_write:<FILE>[:<ADDRESS>]\n"
+		"    Execute the DCD table of the IMX image or bare DCD FILE, staging it\n"
+		"    at ADDRESS (default: 00910000)\n"
+		"  skip_dcd_header\n"
+		"    Ignore the DCD pointer of the image started by the next jump\n"
+		"  stream_file:<FILE>\n"
+		"    Send the boot container FILE to an SDPS boot ROM, which boots it;\n"
+		"    the only step of SDPS stages\n",
+		progname, progname, progname);
 }
@@ -0,0 +1,486 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include "log.h"
+#include "trace.h"
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define LABELS_SIZE 256
+
+enum metric
+{
+    BOARDS,
+    FAILURES,
+    BYTES,
+    RETRIES,
+    PHASE_SECONDS,
+    STAGE_SECONDS,
+    BOOT_SECONDS,
+    METRIC_COUNT,
+};
+
+static const struct
+{
+    const char *name;
+    const char *help;
+    bool histogram;
+} metrics[METRIC_COUNT] = {
+    [BOARDS] = {"imx_sdp_boards_total", "Boards whose boot has ended, by result", false},
+    [FAILURES] = {"imx_sdp_failures_total", "Failed stages, by the step and device status they failed at", false},
+    [BYTES] = {"imx_sdp_bytes_sent_total", "File data written to the devices", false},
+    [RETRIES] = {"imx_sdp_retries_total", "Resumed file transfers", false},
+    [PHASE_SECONDS] = {"imx_sdp_phase_seconds", "Duration of the phases of a boot", true},
+    [STAGE_SECONDS] = {"imx_sdp_stage_seconds", "Duration of the stages once their device was opened", true},
+    [BOOT_SECONDS] = {"imx_sdp_boot_seconds", "Duration of a boot through all stages", true},
+};
+
+static const double buckets[] = {0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60};
+#define BUCKET_COUNT (sizeof(buckets) / sizeof(*buckets))
+
+struct series
+{
+    enum metric metric;
+    char labels[LABELS_SIZE];
+    /* The counter value or the sum of the histogram */
+    double value;
+    uint64_t count;
+    /* Not cumulative, unlike the output */
+    uint64_t bucket_counts[BUCKET_COUNT];
+    struct series *next;
+};
+
+struct labels
+{
+    char usb_path[64];
+    int stage;
+    uint16_t vid;
+    uint16_t pid;
+    int step;
+    bool has_status;
+    uint32_t status;
+};
+
+static bool enabled;
+static char *textfile;
+static int listen_fd = -1;
+static char *socket_path;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct series *series;
+static __thread struct labels labels;
+
+int sdp_metrics_set_textfile(const char *path)
+{
+    free(textfile);
+    if (!(textfile = strdup(path)))
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        return 1;
+    }
+    enabled = true;
+    return 0;
+}
+
+static int listen_unix(const char *path)
+{
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX,
+    };
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        sdp_error("ERROR: Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        sdp_error("ERROR: Failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Remove a stale socket left behind by a previous instance */
+    struct stat st;
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 8))
+    {
+        sdp_error("ERROR: Failed to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (!(socket_path = strdup(path)))
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_tcp(const char *address)
+{
+    char host[256];
+    const char *port = strrchr(address, ':');
+    size_t length = port ? (size_t)(port - address) : 0;
+    if (!port || !port[1] || length >= sizeof(host))
+    {
+        sdp_error("ERROR: Invalid metrics address \"%s\"\n", address);
+        return -1;
+    }
+    /* Strip the brackets around an IPv6 address */
+    if (length >= 2 && address[0] == '[' && address[length - 1] == ']')
+    {
+        ++address;
+        length -= 2;
+    }
+    memcpy(host, address, length);
+    host[length] = '\0';
+
+    struct addrinfo hints = {
+        .ai_flags = AI_PASSIVE,
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *info;
+    int res = getaddrinfo(length ? host : "127.0.0.1", port + 1, &hints, &info);
+    if (res)
+    {
+        sdp_error("ERROR: Failed to resolve \"%s\": %s\n", address, gai_strerror(res));
+        return -1;
+    }
+
+    int fd = socket(info->ai_family, info->ai_socktype | SOCK_CLOEXEC, info->ai_protocol);
+    if (fd < 0)
+    {
+        sdp_error("ERROR: Failed to create socket: %s\n", strerror(errno));
+        goto free_info;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, info->ai_addr, info->ai_addrlen) || listen(fd, 8))
+    {
+        sdp_error("ERROR: Failed to listen on %s: %s\n", address, strerror(errno));
+        close(fd);
+        fd = -1;
+    }
+
+free_info:
+    freeaddrinfo(info);
+    return fd;
+}
+
+int sdp_metrics_listen(const char *address)
+{
+    listen_fd = strncmp(address, "unix:", 5) ? listen_tcp(address) : listen_unix(address + 5);
+    if (listen_fd < 0)
+        return 1;
+    enabled = true;
+    return 0;
+}
+
+int sdp_metrics_fd(void)
+{
+    return listen_fd;
+}
+
+static void write_metrics(FILE *f)
+{
+    pthread_mutex_lock(&lock);
+    for (int m = 0; m < METRIC_COUNT; ++m)
+    {
+        const char *name = metrics[m].name;
+        fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, metrics[m].help, name,
+                metrics[m].histogram ? "histogram" : "counter");
+        for (const struct series *s = series; s; s = s->next)
+        {
+            if (s->metric != (enum metric)m)
+                continue;
+            if (!metrics[m].histogram)
+            {
+                fprintf(f, "%s{%s} %.15g\n", name, s->labels, s->value);
+                continue;
+            }
+
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < BUCKET_COUNT; ++i)
+            {
+                cumulative += s->bucket_counts[i];
+                fprintf(f, "%s_bucket{%s,le=\"%g\"} %llu\n", name, s->labels, buckets[i],
+                        (unsigned long long)cumulative);
+            }
+            fprintf(f, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, s->labels, (unsigned long long)s->count);
+            fprintf(f, "%s_sum{%s} %.9g\n", name, s->labels, s->value);
+            fprintf(f, "%s_count{%s} %llu\n", name, s->labels, (unsigned long long)s->count);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static int send_all(int fd, const char *data, size_t length)
+{
+    while (length)
+    {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/*
+ * Answer every connection with a minimal HTTP response, which is what
+ * Prometheus scrapes expect. The request is read, but not looked at.
+ */
+void sdp_metrics_handle(void *arg)
+{
+    (void)arg;
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+        sdp_error("ERROR: Failed to accept metrics connection: %s\n", strerror(errno));
+        return;
+    }
+
+    /* Don't let a silent client stall the event loop */
+    struct timeval timeout = {
+        .tv_usec = 100000,
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    char request[1024];
+    if (recv(fd, request, sizeof(request), 0) < 0)
+        goto close_fd;
+
+    char *body;
+    size_t length;
+    FILE *f = open_memstream(&body, &length);
+    if (!f)
+        goto close_fd;
+    write_metrics(f);
+    if (fclose(f))
+        goto close_fd;
+
+    char header[128];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\n\r\n",
+                     length);
+    if (!send_all(fd, header, n))
+        send_all(fd, body, length);
+    free(body);
+
+close_fd:
+    close(fd);
+}
+
+/* Write to a temporary file first, so that collectors never see half of it */
+static void write_textfile(void)
+{
+    size_t size = strlen(textfile) + 5;
+    char *tmp = malloc(size);
+    if (!tmp)
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        return;
+    }
+    snprintf(tmp, size, "%s.tmp", textfile);
+
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+    {
+        sdp_error("ERROR: Failed to open metrics file \"%s\": %s\n", tmp, strerror(errno));
+        goto free_tmp;
+    }
+    write_metrics(f);
+    if (fclose(f) || rename(tmp, textfile))
+    {
+        sdp_error("ERROR: Failed to write metrics file \"%s\": %s\n", textfile, strerror(errno));
+        unlink(tmp);
+    }
+
+free_tmp:
+    free(tmp);
+}
+
+void sdp_metrics_cleanup(void)
+{
+    if (textfile)
+        write_textfile();
+    free(textfile);
+    textfile = NULL;
+
+    if (listen_fd >= 0)
+        close(listen_fd);
+    listen_fd = -1;
+    if (socket_path)
+        unlink(socket_path);
+    free(socket_path);
+    socket_path = NULL;
+
+    while (series)
+    {
+        struct series *next = series->next;
+        free(series);
+        series = next;
+    }
+    enabled = false;
+}
+
+void sdp_metrics_set_board(const char *usb_path)
+{
+    /* USB paths are given by the user, keep the label value valid */
+    size_t n = 0;
+    for (; *usb_path && n < sizeof(labels.usb_path) - 2; ++usb_path)
+    {
+        if (*usb_path == '"' || *usb_path == '\\')
+            labels.usb_path[n++] = '\\';
+        else if (*usb_path == '\n')
+            continue;
+        labels.usb_path[n++] = *usb_path;
+    }
+    labels.usb_path[n] = '\0';
+}
+
+void sdp_metrics_set_stage(int stage, uint16_t vid, uint16_t pid)
+{
+    labels.stage = stage;
+    labels.vid = vid;
+    labels.pid = pid;
+    labels.step = 0;
+    labels.has_status = false;
+}
+
+void sdp_metrics_set_step(int step)
+{
+    labels.step = step;
+    labels.has_status = false;
+}
+
+void sdp_metrics_set_status(uint32_t status)
+{
+    labels.status = status;
+    labels.has_status = true;
+}
+
+/* Must be called with lock held, returns NULL if allocation fails */
+static struct series *get_series(enum metric metric, const char *s)
+{
+    struct series **p = &series;
+    for (; *p; p = &(*p)->next)
+    {
+        if ((*p)->metric == metric && !strcmp((*p)->labels, s))
+            return *p;
+    }
+    /* Appended, so that the output keeps the order of appearance */
+    *p = calloc(1, sizeof(struct series));
+    if (*p)
+    {
+        (*p)->metric = metric;
+        strcpy((*p)->labels, s);
+    }
+    return *p;
+}
+
+static void add(enum metric metric, const char *s, double value)
+{
+    pthread_mutex_lock(&lock);
+    struct series *entry = get_series(metric, s);
+    if (entry)
+    {
+        entry->value += value;
+        ++entry->count;
+        for (size_t i = 0; metrics[metric].histogram && i < BUCKET_COUNT; ++i)
+        {
+            if (value <= buckets[i])
+            {
+                ++entry->bucket_counts[i];
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static int device_labels(char *s, size_t size)
+{
+    return snprintf(s, size, "usb_path=\"%s\",vid=\"%04x\",pid=\"%04x\"", labels.usb_path, labels.vid, labels.pid);
+}
+
+void sdp_metrics_failure(void)
+{
+    if (!enabled)
+        return;
+    char s[LABELS_SIZE], step[16] = "", status[16] = "";
+    int n = device_labels(s, sizeof(s));
+    if (labels.step)
+        snprintf(step, sizeof(step), "%d", labels.step);
+    if (labels.has_status)
+        snprintf(status, sizeof(status), "0x%08x", labels.status);
+    snprintf(s + n, sizeof(s) - n, ",stage=\"%d\",step=\"%s\",status=\"%s\"", labels.stage, step, status);
+    add(FAILURES, s, 1);
+}
+
+void sdp_metrics_phase(const char *name, int64_t start, int64_t end)
+{
+    if (!enabled)
+        return;
+    char s[LABELS_SIZE];
+    int n = snprintf(s, sizeof(s), "phase=\"%s\",", name);
+    device_labels(s + n, sizeof(s) - n);
+    add(PHASE_SECONDS, s, (end - start) / 1e6);
+}
+
+void sdp_metrics_stage(int64_t start)
+{
+    if (!enabled)
+        return;
+    char s[LABELS_SIZE];
+    int n = device_labels(s, sizeof(s));
+    snprintf(s + n, sizeof(s) - n, ",stage=\"%d\"", labels.stage);
+    add(STAGE_SECONDS, s, (sdp_trace_now() - start) / 1e6);
+}
+
+void sdp_metrics_boot(bool passed, double seconds)
+{
+    if (!enabled)
+        return;
+    char s[LABELS_SIZE];
+    snprintf(s, sizeof(s), "usb_path=\"%s\",result=\"%s\"", labels.usb_path, passed ? "passed" : "failed");
+    add(BOARDS, s, 1);
+    add(BOOT_SECONDS, s, seconds);
+}
+
+void sdp_metrics_bytes(uint64_t bytes)
+{
+    if (!enabled)
+        return;
+    char s[LABELS_SIZE];
+    device_labels(s, sizeof(s));
+    add(BYTES, s, bytes);
+}
+
+void sdp_metrics_retry(void)
+{
+    if (!enabled)
+        return;
+    char s[LABELS_SIZE];
+    device_labels(s, sizeof(s));
+    add(RETRIES, s, 1);
+}
@@ -0,0 +1,43 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Counters and latency histograms of the boards booted by this process, in
+ * the Prometheus text format. They are only recorded once an output is set
+ * up: a file written by sdp_metrics_cleanup() (for the node exporter's
+ * textfile collector) and/or a socket they are served on.
+ */
+int sdp_metrics_set_textfile(const char *path);
+/*
+ * Listen for scrapes on "unix:<PATH>" or "[<HOST>]:<PORT>" (default host
+ * 127.0.0.1). Connections are answered from sdp_metrics_handle(), which the
+ * gang calls from its event loop for the fd returned by sdp_metrics_fd().
+ */
+int sdp_metrics_listen(const char *address);
+int sdp_metrics_fd(void);
+void sdp_metrics_handle(void *arg);
+void sdp_metrics_cleanup(void);
+
+/*
+ * Everything recorded by a thread is labelled with the board, stage and step
+ * it set last, and failures also with the last status code of the device.
+ */
+void sdp_metrics_set_board(const char *usb_path);
+void sdp_metrics_set_stage(int stage, uint16_t vid, uint16_t pid);
+void sdp_metrics_set_step(int step);
+void sdp_metrics_set_status(uint32_t status);
+
+/* Count a failure of the current stage */
+void sdp_metrics_failure(void);
+/* Record a phase of the name given to sdp_trace_span(), times from sdp_trace_now() */
+void sdp_metrics_phase(const char *name, int64_t start, int64_t end);
+void sdp_metrics_stage(int64_t start);
+/* Count a board whose boot has ended, after seconds */
+void sdp_metrics_boot(bool passed, double seconds);
+void sdp_metrics_bytes(uint64_t bytes);
+void sdp_metrics_retry(void);
+
+#endif
@@ -0,0 +1,121 @@
+#include "payload.h"
+#include "decoder.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define REPORT_DATA_SIZE (SDP_REPORT_SIZE - 1)
+
+struct sdp_payload_
+{
+    char *path;
+    uint32_t size;
+    size_t count;
+    unsigned char *reports;
+};
+
+static void copy_image(sdp_payload *payload, const sdp_image *image)
+{
+    const unsigned char *data = sdp_image_data(image);
+    for (size_t i = 0; i < payload->count; ++i)
+    {
+        size_t offset = i * REPORT_DATA_SIZE;
+        size_t n = payload->size - offset < REPORT_DATA_SIZE ? payload->size - offset : REPORT_DATA_SIZE;
+        unsigned char *report = payload->reports + i * SDP_REPORT_SIZE;
+        report[0] = 2;
+        memcpy(report + 1, data + offset, n);
+    }
+}
+
+/* Straight into the reports, behind the ID of each */
+static int decompress_image(sdp_payload *payload, sdp_decoder *decoder)
+{
+    for (size_t i = 0; i < payload->count; ++i)
+    {
+        unsigned char *report = payload->reports + i * SDP_REPORT_SIZE;
+        report[0] = 2;
+        if (sdp_decoder_read(decoder, report + 1, REPORT_DATA_SIZE) <= 0)
+            return 1;
+    }
+    /* The decoder checks that nothing follows */
+    unsigned char rest;
+    return sdp_decoder_read(decoder, &rest, 1) != 0;
+}
+
+sdp_payload *sdp_payload_new(const sdp_image *image)
+{
+    sdp_decoder *decoder = NULL;
+    sdp_payload *payload = calloc(1, sizeof(sdp_payload));
+    if (!payload || !(payload->path = strdup(sdp_image_path(image))))
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        goto free_payload;
+    }
+
+    if (sdp_decoder_detect(image))
+    {
+        if (!(decoder = sdp_decoder_open(image)))
+            goto free_payload;
+        payload->size = sdp_decoder_size(decoder);
+    }
+    else if (sdp_image_size(image) > UINT32_MAX)
+    {
+        sdp_error("ERROR: File \"%s\" too large for WRITE_FILE\n", payload->path);
+        goto free_payload;
+    }
+    else
+        payload->size = sdp_image_size(image);
+
+    payload->count = (payload->size + REPORT_DATA_SIZE - 1) / REPORT_DATA_SIZE;
+    payload->reports = malloc(payload->count ? payload->count * SDP_REPORT_SIZE : 1);
+    int res = 1;
+    if (!payload->reports)
+        sdp_error("ERROR: Allocation failed\n");
+    else if (decoder)
+        res = decompress_image(payload, decoder);
+    else
+    {
+        copy_image(payload, image);
+        res = 0;
+    }
+
+    if (decoder && sdp_decoder_close(decoder))
+        res = 1;
+    if (res)
+        goto free_payload;
+    return payload;
+
+free_payload:
+    if (payload)
+        sdp_payload_free(payload);
+    return NULL;
+}
+
+void sdp_payload_free(sdp_payload *payload)
+{
+    free(payload->reports);
+    free(payload->path);
+    free(payload);
+}
+
+const char *sdp_payload_path(const sdp_payload *payload)
+{
+    return payload->path;
+}
+
+uint32_t sdp_payload_size(const sdp_payload *payload)
+{
+    return payload->size;
+}
+
+size_t sdp_payload_count(const sdp_payload *payload)
+{
+    return payload->count;
+}
+
+const unsigned char *sdp_payload_report(const sdp_payload *payload, size_t i, size_t *length)
+{
+    size_t offset = i * REPORT_DATA_SIZE;
+    *length = 1 + (payload->size - offset < REPORT_DATA_SIZE ? payload->size - offset : REPORT_DATA_SIZE);
+    return payload->reports + i * SDP_REPORT_SIZE;
+}
@@ -0,0 +1,28 @@
+#ifndef PAYLOAD_H_
+#define PAYLOAD_H_
+
+#include "image.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Report ID 2 followed by up to 1024 bytes of data */
+#define SDP_REPORT_SIZE 1025
+
+struct sdp_payload_;
+typedef struct sdp_payload_ sdp_payload;
+
+/*
+ * Lay out the contents of image, decompressed if needed, as the data reports
+ * of a WRITE_FILE: back to back in one buffer, each preceded by its report
+ * ID. The payload is read-only afterwards and can be sent to any number of
+ * boards concurrently. Returns NULL on error.
+ */
+sdp_payload *sdp_payload_new(const sdp_image *image);
+void sdp_payload_free(sdp_payload *payload);
+
+const char *sdp_payload_path(const sdp_payload *payload);
+uint32_t sdp_payload_size(const sdp_payload *payload);
+size_t sdp_payload_count(const sdp_payload *payload);
+const unsigned char *sdp_payload_report(const sdp_payload *payload, size_t i, size_t *length);
+
+#endif
@@ -0,0 +1,547 @@
+#include "plan.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PLAN_MAGIC "IMXSDPPL"
+#define PLAN_VERSION 1
+#define BUNDLE_MAGIC "IMXSDPBN"
+#define BUNDLE_VERSION 1
+/* Images start on page boundaries, so they can be mapped and read ahead alone */
+#define BUNDLE_ALIGNMENT 4096
+/* Sanity limits for loading */
+#define MAX_ENTRIES 4096
+#define MAX_STRING 65536
+
+struct image_entry
+{
+    char *path;
+    uint64_t size;
+    uint64_t hash;
+    /* Of the data in a bundle */
+    uint64_t offset;
+};
+
+struct sdp_plan_
+{
+    int count;
+    char **stages;
+    char **arguments;
+    int image_count;
+    struct image_entry *images;
+    /* The bundle the images are embedded in, if any */
+    unsigned char *bundle;
+    size_t bundle_size;
+};
+
+static uint64_t fnv1a(const unsigned char *data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static sdp_plan *alloc_plan(int count)
+{
+    sdp_plan *plan = calloc(1, sizeof(sdp_plan));
+    if (plan)
+    {
+        plan->stages = calloc(count + 1, sizeof(char *));
+        plan->arguments = calloc(count + 1, sizeof(char *));
+    }
+    if (!plan || !plan->stages || !plan->arguments)
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        if (plan)
+            sdp_plan_free(plan);
+        return NULL;
+    }
+    return plan;
+}
+
+static int add_stage(sdp_plan *plan, const char *stage)
+{
+    plan->stages[plan->count] = strdup(stage);
+    plan->arguments[plan->count] = strdup(stage);
+    if (!plan->stages[plan->count] || !plan->arguments[plan->count])
+    {
+        free(plan->stages[plan->count]);
+        free(plan->arguments[plan->count]);
+        plan->stages[plan->count] = plan->arguments[plan->count] = NULL;
+        sdp_error("ERROR: Allocation failed\n");
+        return 1;
+    }
+    ++plan->count;
+    return 0;
+}
+
+sdp_plan *sdp_plan_new(int count, char *const stages[])
+{
+    sdp_plan *plan = alloc_plan(count);
+    for (int i = 0; plan && i < count; ++i)
+    {
+        if (add_stage(plan, stages[i]))
+        {
+            sdp_plan_free(plan);
+            return NULL;
+        }
+    }
+    return plan;
+}
+
+void sdp_plan_free(sdp_plan *plan)
+{
+    for (int i = 0; i < plan->count; ++i)
+    {
+        free(plan->stages[i]);
+        free(plan->arguments[i]);
+    }
+    free(plan->stages);
+    free(plan->arguments);
+    for (int i = 0; i < plan->image_count; ++i)
+        free(plan->images[i].path);
+    free(plan->images);
+    if (plan->bundle)
+    {
+        sdp_image_clear_embedded();
+        munmap(plan->bundle, plan->bundle_size);
+    }
+    free(plan);
+}
+
+int sdp_plan_count(const sdp_plan *plan)
+{
+    return plan->count;
+}
+
+char **sdp_plan_arguments(sdp_plan *plan)
+{
+    return plan->arguments;
+}
+
+/* Integers are stored little endian, strings with their length in front */
+static void put_uint(FILE *file, uint64_t value, int size)
+{
+    for (int i = 0; i < size; ++i)
+        fputc(value >> (8 * i), file);
+}
+
+static void put_string(FILE *file, const char *s)
+{
+    size_t length = strlen(s);
+    put_uint(file, length, 4);
+    fwrite(s, 1, length, file);
+}
+
+static int get_uint(FILE *file, uint64_t *value, int size)
+{
+    *value = 0;
+    for (int i = 0; i < size; ++i)
+    {
+        int c = fgetc(file);
+        if (c == EOF)
+            return 1;
+        *value |= (uint64_t)c << (8 * i);
+    }
+    return 0;
+}
+
+static char *get_string(FILE *file)
+{
+    uint64_t length;
+    if (get_uint(file, &length, 4) || length > MAX_STRING)
+        return NULL;
+    char *s = malloc(length + 1);
+    if (!s)
+        return NULL;
+    if (fread(s, 1, length, file) != length || memchr(s, '\0', length))
+    {
+        free(s);
+        return NULL;
+    }
+    s[length] = '\0';
+    return s;
+}
+
+struct save_args
+{
+    FILE *file;
+    int count;
+};
+
+static int count_image(const sdp_image *image, void *arg)
+{
+    (void)image;
+    ++((struct save_args *)arg)->count;
+    return 0;
+}
+
+static int save_image(const sdp_image *image, void *arg)
+{
+    FILE *file = ((struct save_args *)arg)->file;
+    put_string(file, sdp_image_path(image));
+    put_uint(file, sdp_image_size(image), 8);
+    put_uint(file, fnv1a(sdp_image_data(image), sdp_image_size(image)), 8);
+    return 0;
+}
+
+int sdp_plan_save(const sdp_plan *plan, const char *path, const sdp_stages *stages)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        sdp_error("ERROR: Failed to create plan \"%s\": %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    fwrite(PLAN_MAGIC, 1, strlen(PLAN_MAGIC), file);
+    put_uint(file, PLAN_VERSION, 4);
+    put_uint(file, plan->count, 4);
+    for (int i = 0; i < plan->count; ++i)
+        put_string(file, plan->stages[i]);
+
+    struct save_args args = {
+        .file = file,
+    };
+    sdp_stages_foreach_image(stages, count_image, &args);
+    put_uint(file, args.count, 4);
+    sdp_stages_foreach_image(stages, save_image, &args);
+
+    int res = ferror(file);
+    if (fclose(file))
+        res = 1;
+    if (res)
+        sdp_error("ERROR: Failed to write plan \"%s\"\n", path);
+    return res;
+}
+
+struct bundle_args
+{
+    const sdp_image **images;
+    int count;
+};
+
+static int collect_image(const sdp_image *image, void *arg)
+{
+    struct bundle_args *args = arg;
+    args->images[args->count++] = image;
+    return 0;
+}
+
+static uint64_t align(uint64_t offset)
+{
+    return (offset + BUNDLE_ALIGNMENT - 1) / BUNDLE_ALIGNMENT * BUNDLE_ALIGNMENT;
+}
+
+/* Index of the first image with the same path as image i, which holds the data */
+static int first_with_path(const struct bundle_args *args, int i)
+{
+    for (int j = 0; j < i; ++j)
+    {
+        if (!strcmp(sdp_image_path(args->images[j]), sdp_image_path(args->images[i])))
+            return j;
+    }
+    return i;
+}
+
+/*
+ * A bundle has the layout of a plan, with the offset of its data added to
+ * every image and an FNV-1a hash of all that in front of the data. An image
+ * used by several steps is stored once.
+ */
+int sdp_plan_save_bundle(const sdp_plan *plan, const char *path, const sdp_stages *stages)
+{
+    int res = 1;
+    struct save_args counter = {0};
+    sdp_stages_foreach_image(stages, count_image, &counter);
+    struct bundle_args args = {
+        .images = calloc(counter.count ? counter.count : 1, sizeof(*args.images)),
+    };
+    uint64_t *offsets = calloc(counter.count ? counter.count : 1, sizeof(*offsets));
+    char *index = NULL;
+    size_t index_size;
+    if (!args.images || !offsets)
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        goto free_args;
+    }
+    sdp_stages_foreach_image(stages, collect_image, &args);
+
+    /* Magic, version, counts and checksum, then the strings and entries */
+    uint64_t offset = strlen(BUNDLE_MAGIC) + 4 + 4 + 4 + 8;
+    for (int i = 0; i < plan->count; ++i)
+        offset += 4 + strlen(plan->stages[i]);
+    for (int i = 0; i < args.count; ++i)
+        offset += 4 + strlen(sdp_image_path(args.images[i])) + 3 * 8;
+    for (int i = 0; i < args.count; ++i)
+    {
+        int first = first_with_path(&args, i);
+        if (first < i)
+        {
+            offsets[i] = offsets[first];
+            continue;
+        }
+        offsets[i] = align(offset);
+        offset = offsets[i] + sdp_image_size(args.images[i]);
+    }
+
+    FILE *file = open_memstream(&index, &index_size);
+    if (!file)
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        goto free_args;
+    }
+    fwrite(BUNDLE_MAGIC, 1, strlen(BUNDLE_MAGIC), file);
+    put_uint(file, BUNDLE_VERSION, 4);
+    put_uint(file, plan->count, 4);
+    for (int i = 0; i < plan->count; ++i)
+        put_string(file, plan->stages[i]);
+    put_uint(file, args.count, 4);
+    for (int i = 0; i < args.count; ++i)
+    {
+        const sdp_image *image = args.images[i];
+        put_string(file, sdp_image_path(image));
+        put_uint(file, sdp_image_size(image), 8);
+        put_uint(file, fnv1a(sdp_image_data(image), sdp_image_size(image)), 8);
+        put_uint(file, offsets[i], 8);
+    }
+    if (fclose(file))
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        goto free_args;
+    }
+
+    if (!(file = fopen(path, "wb")))
+    {
+        sdp_error("ERROR: Failed to create bundle \"%s\": %s\n", path, strerror(errno));
+        goto free_args;
+    }
+    fwrite(index, 1, index_size, file);
+    put_uint(file, fnv1a((const unsigned char *)index, index_size), 8);
+    offset = index_size + 8;
+    for (int i = 0; i < args.count; ++i)
+    {
+        if (first_with_path(&args, i) < i)
+            continue;
+        for (; offset < offsets[i]; ++offset)
+            fputc(0, file);
+        fwrite(sdp_image_data(args.images[i]), 1, sdp_image_size(args.images[i]), file);
+        offset += sdp_image_size(args.images[i]);
+    }
+
+    res = ferror(file);
+    if (fclose(file))
+        res = 1;
+    if (res)
+        sdp_error("ERROR: Failed to write bundle \"%s\"\n", path);
+
+free_args:
+    free(index);
+    free(offsets);
+    free(args.images);
+    return res;
+}
+
+/*
+ * Read a plan or the index of a bundle, which also has the offset of every
+ * image, up to the checksum of a bundle
+ */
+static sdp_plan *read_plan(FILE *file, const char *path, bool bundle)
+{
+    const char *expected = bundle ? BUNDLE_MAGIC : PLAN_MAGIC;
+    const char *kind = bundle ? "bundle" : "boot plan";
+    sdp_plan *plan = NULL;
+    char magic[sizeof(PLAN_MAGIC) - 1];
+    uint64_t version, count;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, expected, sizeof(magic)) ||
+        get_uint(file, &version, 4))
+    {
+        sdp_error("ERROR: \"%s\" is not a %s\n", path, kind);
+        return NULL;
+    }
+    if (version != (bundle ? BUNDLE_VERSION : PLAN_VERSION))
+    {
+        sdp_error("ERROR: Unsupported version %u of %s \"%s\"\n", (unsigned)version, kind, path);
+        return NULL;
+    }
+    if (get_uint(file, &count, 4) || !count || count > MAX_ENTRIES || !(plan = alloc_plan(count)))
+        goto invalid;
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        char *stage = get_string(file);
+        int res = !stage || add_stage(plan, stage);
+        free(stage);
+        if (res)
+            goto invalid;
+    }
+
+    if (get_uint(file, &count, 4) || count > MAX_ENTRIES)
+        goto invalid;
+    plan->images = calloc(count ? count : 1, sizeof(struct image_entry));
+    if (!plan->images)
+        goto invalid;
+    for (; (uint64_t)plan->image_count < count; ++plan->image_count)
+    {
+        struct image_entry *entry = plan->images + plan->image_count;
+        if (!(entry->path = get_string(file)) || get_uint(file, &entry->size, 8) ||
+            get_uint(file, &entry->hash, 8) || (bundle && get_uint(file, &entry->offset, 8)))
+        {
+            free(entry->path);
+            goto invalid;
+        }
+    }
+    return plan;
+
+invalid:
+    sdp_error("ERROR: %s \"%s\" is corrupt\n", bundle ? "Bundle" : "Boot plan", path);
+    if (plan)
+        sdp_plan_free(plan);
+    return NULL;
+}
+
+sdp_plan *sdp_plan_load(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        sdp_error("ERROR: Failed to open plan \"%s\": %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    sdp_plan *plan = read_plan(file, path, false);
+    fclose(file);
+    return plan;
+}
+
+/* Serve the images of a loaded bundle from its mapping */
+static int embed_images(sdp_plan *plan, const char *path, uint64_t data_start)
+{
+    for (int i = 0; i < plan->image_count; ++i)
+    {
+        const struct image_entry *entry = plan->images + i;
+        if (entry->offset % BUNDLE_ALIGNMENT || entry->offset < data_start || !entry->size ||
+            entry->size > plan->bundle_size || entry->offset > plan->bundle_size - entry->size)
+        {
+            sdp_error("ERROR: Bundle \"%s\" is corrupt\n", path);
+            return 1;
+        }
+
+        bool stored = false;
+        for (int j = 0; j < i; ++j)
+            stored = stored || !strcmp(plan->images[j].path, entry->path);
+        if (!stored && sdp_image_embed(entry->path, plan->bundle + entry->offset, entry->size))
+            return 1;
+    }
+    return 0;
+}
+
+sdp_plan *sdp_plan_load_bundle(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        sdp_error("ERROR: Failed to open bundle \"%s\": %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size || (uint64_t)st.st_size > SIZE_MAX)
+    {
+        sdp_error("ERROR: \"%s\" is not a bundle\n", path);
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        sdp_error("ERROR: Failed to map bundle \"%s\": %s\n", path, strerror(errno));
+        return NULL;
+    }
+    madvise(data, size, MADV_WILLNEED);
+
+    sdp_plan *plan = NULL;
+    FILE *file = fmemopen(data, size, "rb");
+    if (!file)
+        sdp_error("ERROR: Failed to read bundle \"%s\": %s\n", path, strerror(errno));
+    else
+    {
+        plan = read_plan(file, path, true);
+        long index_size = ftell(file);
+        uint64_t checksum;
+        if (plan && (get_uint(file, &checksum, 8) || checksum != fnv1a(data, index_size)))
+        {
+            sdp_error("ERROR: Bundle \"%s\" is corrupt\n", path);
+            sdp_plan_free(plan);
+            plan = NULL;
+        }
+        fclose(file);
+        if (plan)
+        {
+            plan->bundle = data;
+            plan->bundle_size = size;
+            if (embed_images(plan, path, index_size + 8))
+            {
+                sdp_plan_free(plan);
+                return NULL;
+            }
+            return plan;
+        }
+    }
+    munmap(data, size);
+    return NULL;
+}
+
+struct check_args
+{
+    const sdp_plan *plan;
+    int index;
+};
+
+static int check_image(const sdp_image *image, void *arg)
+{
+    struct check_args *args = arg;
+    const sdp_plan *plan = args->plan;
+    if (args->index == plan->image_count)
+    {
+        sdp_error("ERROR: \"%s\" is not part of the boot plan\n", sdp_image_path(image));
+        return 1;
+    }
+    const struct image_entry *entry = plan->images + args->index++;
+    if (strcmp(entry->path, sdp_image_path(image)) || entry->size != sdp_image_size(image) ||
+        entry->hash != fnv1a(sdp_image_data(image), sdp_image_size(image)))
+    {
+        if (plan->bundle)
+            sdp_error("ERROR: Image \"%s\" in the bundle is corrupt\n", sdp_image_path(image));
+        else
+            sdp_error("ERROR: \"%s\" has changed since the boot plan was saved\n", sdp_image_path(image));
+        return 1;
+    }
+    return 0;
+}
+
+int sdp_plan_check(const sdp_plan *plan, const sdp_stages *stages)
+{
+    struct check_args args = {
+        .plan = plan,
+    };
+    if (sdp_stages_foreach_image(stages, check_image, &args))
+        return 1;
+    if (args.index != plan->image_count)
+    {
+        sdp_error("ERROR: The boot plan lists more images than its stages use\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef PLAN_H_
+#define PLAN_H_
+
+#include "stages.h"
+
+struct sdp_plan_;
+typedef struct sdp_plan_ sdp_plan;
+
+/*
+ * A boot plan is the list of STAGE arguments together with the size and
+ * content hash of every image the compiled stages use. Saved to a file, it
+ * replaces the command line and makes sure the images haven't changed since.
+ */
+sdp_plan *sdp_plan_new(int count, char *const stages[]);
+sdp_plan *sdp_plan_load(const char *path);
+void sdp_plan_free(sdp_plan *plan);
+
+int sdp_plan_count(const sdp_plan *plan);
+/*
+ * Copies of the STAGE arguments to pass to sdp_parse_stages(), which
+ * modifies them. They live as long as the plan.
+ */
+char **sdp_plan_arguments(sdp_plan *plan);
+
+int sdp_plan_save(const sdp_plan *plan, const char *path, const sdp_stages *stages);
+/* Check the images of the compiled stages against a loaded plan or bundle */
+int sdp_plan_check(const sdp_plan *plan, const sdp_stages *stages);
+
+/*
+ * A bundle is a saved plan with every image embedded, page aligned, so that a
+ * single file carries all a boot needs. Loading maps the file once and serves
+ * the images from the mapping (see sdp_image_embed()) until the plan is freed,
+ * which has to happen after the stages using them are freed. Their hashes are
+ * verified by sdp_plan_check().
+ */
+int sdp_plan_save_bundle(const sdp_plan *plan, const char *path, const sdp_stages *stages);
+sdp_plan *sdp_plan_load_bundle(const char *path);
+
+#endif
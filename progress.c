@@ -0,0 +1,69 @@
+#include "progress.h"
+#include <stddef.h>
+
+/* Don't bother the handler for every single report */
+#define REPORT_INTERVAL (64 * 1024)
+
+struct handler
+{
+    sdp_progress_callback callback;
+    void *arg;
+    struct sdp_progress progress;
+    uint64_t reported;
+};
+
+static __thread struct handler handler;
+
+void sdp_progress_set_handler(sdp_progress_callback callback, void *arg)
+{
+    handler = (struct handler){
+        .callback = callback,
+        .arg = arg,
+    };
+}
+
+static void report(void)
+{
+    handler.reported = handler.progress.done;
+    handler.callback(handler.arg, &handler.progress);
+}
+
+void sdp_progress_stage(int stage, int count)
+{
+    if (!handler.callback)
+        return;
+    handler.progress = (struct sdp_progress){
+        .stage = stage,
+        .stage_count = count,
+    };
+    report();
+}
+
+void sdp_progress_step(int step)
+{
+    if (!handler.callback)
+        return;
+    handler.progress.step = step;
+    handler.progress.done = 0;
+    handler.progress.total = 0;
+    report();
+}
+
+void sdp_progress_start(uint64_t total)
+{
+    if (!handler.callback)
+        return;
+    handler.progress.done = 0;
+    handler.progress.total = total;
+    report();
+}
+
+void sdp_progress_advance(uint64_t bytes)
+{
+    if (!handler.callback)
+        return;
+    handler.progress.done += bytes;
+    if (handler.progress.done - handler.reported >= REPORT_INTERVAL ||
+        handler.progress.done >= handler.progress.total)
+        report();
+}
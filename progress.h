@@ -0,0 +1,19 @@
+#ifndef PROGRESS_H_
+#define PROGRESS_H_
+
+#include "imxsdp.h"
+#include <stdint.h>
+
+/*
+ * Report the progress of the stages executed by the calling thread to
+ * callback. Pass NULL to stop reporting.
+ */
+void sdp_progress_set_handler(sdp_progress_callback callback, void *arg);
+
+void sdp_progress_stage(int stage, int count);
+void sdp_progress_step(int step);
+/* Start a transfer of total bytes within the current step */
+void sdp_progress_start(uint64_t total);
+void sdp_progress_advance(uint64_t bytes);
+
+#endif
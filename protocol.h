@@ -0,0 +1,65 @@
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include <stdint.h>
+
+enum command_type
+{
+	READ_REGISTER = 0x0101,
+	WRITE_REGISTER = 0x0202,
+	WRITE_FILE = 0x0404,
+	ERROR_STATUS = 0x0505,
+	DCD_WRITE = 0x0A0A,
+	JUMP_ADDRESS = 0x0B0B,
+	SKIP_DCD_HEADER = 0x0C0C,
+};
+
+enum hab_status
+{
+	HAB_CLOSED = 0x12343412,
+	HAB_OPEN = 0x56787856,
+};
+
+enum response_code
+{
+	WRITE_REGISTER_COMPLETE = 0x128A8A12,
+	WRITE_FILE_COMPLETE = 0x88888888,
+	DCD_WRITE_COMPLETE = 0x128A8A12,
+	SKIP_DCD_HEADER_ACK = 0x900DD009,
+};
+
+/* Report 1, multi-byte fields are big endian */
+struct command_report
+{
+	uint8_t report_id;
+	uint16_t command_type;
+	uint32_t address;
+	uint8_t format;
+	uint32_t data_count;
+	uint32_t data;
+	uint8_t reserved;
+} __attribute__((packed));
+
+/*
+ * SDPS, the stream mode of the i.MX8 and later boot ROMs, knows a single
+ * command: download the boot container that follows in data reports.
+ */
+#define SDPS_SIGNATURE 0x43544c42 /* "BLTC" */
+#define SDPS_DOWNLOAD_FW 2
+
+/* Report 1 in SDPS mode, little endian except for the command block */
+struct sdps_command_report
+{
+	uint8_t report_id;
+	uint32_t signature;
+	uint32_t tag;
+	uint32_t transfer_length;
+	uint8_t flags;
+	uint8_t reserved[2];
+	/* Command block, length is big endian */
+	uint8_t command;
+	uint32_t length;
+	uint8_t command_reserved[11];
+} __attribute__((packed));
+
+#endif
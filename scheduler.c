@@ -0,0 +1,278 @@
+#include "scheduler.h"
+#include "log.h"
+#include "trace.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct limit
+{
+    char *hub;
+    int capacity;
+    struct limit *next;
+};
+
+struct domain
+{
+    char name[SDP_DOMAIN_SIZE];
+    int capacity;
+    int used;
+    struct domain *next;
+};
+
+struct waiter
+{
+    struct domain *domains[SDP_ROUTE_DOMAINS];
+    uint64_t size;
+    bool admitted;
+    struct waiter *next;
+};
+
+static bool enabled;
+static int bus_capacity, hub_capacity, tt_capacity;
+static struct limit *hub_limits;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+static struct domain *domains;
+/* In arrival order */
+static struct waiter *waiting;
+
+static int parse_limit(const char *key, const char *value)
+{
+    char *end;
+    if (!value)
+        return 1;
+    unsigned long n = strtoul(value, &end, 10);
+    if (end == value || *end || n > 1000)
+        return 1;
+
+    if (!strcmp(key, "bus"))
+        bus_capacity = n;
+    else if (!strcmp(key, "hub"))
+        hub_capacity = n;
+    else if (!strcmp(key, "tt"))
+        tt_capacity = n;
+    else
+    {
+        struct limit *limit = malloc(sizeof(struct limit));
+        if (!limit || !(limit->hub = strdup(key)))
+        {
+            free(limit);
+            return 1;
+        }
+        limit->capacity = n;
+        limit->next = hub_limits;
+        hub_limits = limit;
+    }
+    return 0;
+}
+
+int sdp_sched_configure(const char *s)
+{
+    char *copy = strdup(s);
+    if (!copy)
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        return 1;
+    }
+
+    int res = 0;
+    char *saveptr = NULL;
+    for (char *tok = strtok_r(copy, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr))
+    {
+        char *value = strchr(tok, '=');
+        if (value)
+            *value++ = '\0';
+        if (parse_limit(tok, value))
+        {
+            if (value)
+                value[-1] = '=';
+            sdp_error("ERROR: Invalid transfer limit \"%s\"\n", tok);
+            res = 1;
+            break;
+        }
+    }
+    free(copy);
+    if (res)
+        return 1;
+
+    if (enabled)
+        return 0;
+
+    /* Waits are bounded by deadlines on the monotonic clock */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond, &attr);
+    pthread_condattr_destroy(&attr);
+    enabled = true;
+    return 0;
+}
+
+void sdp_sched_cleanup(void)
+{
+    while (hub_limits)
+    {
+        struct limit *next = hub_limits->next;
+        free(hub_limits->hub);
+        free(hub_limits);
+        hub_limits = next;
+    }
+    while (domains)
+    {
+        struct domain *next = domains->next;
+        free(domains);
+        domains = next;
+    }
+    if (enabled)
+        pthread_cond_destroy(&cond);
+    enabled = false;
+}
+
+static int domain_capacity(const char *name)
+{
+    if (!strncmp(name, "bus:", 4))
+        return bus_capacity;
+    if (!strncmp(name, "tt:", 3))
+        return tt_capacity;
+    for (struct limit *limit = hub_limits; limit; limit = limit->next)
+    {
+        if (!strcmp(name + 4, limit->hub))
+            return limit->capacity;
+    }
+    return hub_capacity;
+}
+
+/* Domains without a limit aren't tracked, NULL is returned for them */
+static struct domain *get_domain(const char *name)
+{
+    if (!name[0])
+        return NULL;
+    for (struct domain *domain = domains; domain; domain = domain->next)
+    {
+        if (!strcmp(domain->name, name))
+            return domain;
+    }
+
+    int capacity = domain_capacity(name);
+    if (!capacity)
+        return NULL;
+    struct domain *domain = calloc(1, sizeof(struct domain));
+    if (!domain)
+        return NULL;
+    strcpy(domain->name, name);
+    domain->capacity = capacity;
+    domain->next = domains;
+    domains = domain;
+    return domain;
+}
+
+static bool fits(const struct waiter *waiter)
+{
+    for (int i = 0; i < SDP_ROUTE_DOMAINS; ++i)
+    {
+        const struct domain *domain = waiter->domains[i];
+        if (domain && domain->used >= domain->capacity)
+            return false;
+    }
+    return true;
+}
+
+/* Admit the largest waiting transfers that fit, called with lock held */
+static void admit(void)
+{
+    bool admitted = false;
+    for (;;)
+    {
+        struct waiter **best = NULL;
+        for (struct waiter **w = &waiting; *w; w = &(*w)->next)
+        {
+            if (fits(*w) && (!best || (*w)->size > (*best)->size))
+                best = w;
+        }
+        if (!best)
+            break;
+
+        struct waiter *waiter = *best;
+        *best = waiter->next;
+        for (int i = 0; i < SDP_ROUTE_DOMAINS; ++i)
+        {
+            if (waiter->domains[i])
+                ++waiter->domains[i]->used;
+        }
+        waiter->admitted = true;
+        admitted = true;
+    }
+    if (admitted)
+        pthread_cond_broadcast(&cond);
+}
+
+static void remove_waiter(struct waiter *waiter)
+{
+    for (struct waiter **w = &waiting; *w; w = &(*w)->next)
+    {
+        if (*w == waiter)
+        {
+            *w = waiter->next;
+            return;
+        }
+    }
+}
+
+int sdp_sched_acquire(const struct sdp_route *route, uint64_t size, int64_t deadline)
+{
+    if (!route || !enabled)
+        return 0;
+
+    int64_t start = sdp_trace_now();
+    struct waiter waiter = {
+        .size = size,
+    };
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < SDP_ROUTE_DOMAINS; ++i)
+        waiter.domains[i] = get_domain(route->domains[i]);
+    struct waiter **tail = &waiting;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = &waiter;
+    admit();
+
+    struct timespec ts = {
+        .tv_sec = deadline / 1000,
+        .tv_nsec = deadline % 1000 * 1000000,
+    };
+    int res = 0;
+    while (!waiter.admitted && res != ETIMEDOUT)
+        res = deadline ? pthread_cond_timedwait(&cond, &lock, &ts) : pthread_cond_wait(&cond, &lock);
+    if (!waiter.admitted)
+        remove_waiter(&waiter);
+    pthread_mutex_unlock(&lock);
+    sdp_trace_span("schedule", start);
+
+    if (!waiter.admitted)
+    {
+        sdp_error("ERROR: Deadline exceeded waiting for a transfer slot\n");
+        return 1;
+    }
+    return 0;
+}
+
+void sdp_sched_release(const struct sdp_route *route)
+{
+    if (!route || !enabled)
+        return;
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < SDP_ROUTE_DOMAINS; ++i)
+    {
+        struct domain *domain = get_domain(route->domains[i]);
+        if (domain)
+            --domain->used;
+    }
+    admit();
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,39 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdint.h>
+
+#define SDP_ROUTE_DOMAINS 3
+#define SDP_DOMAIN_SIZE 80
+
+/*
+ * The parts of the USB topology a board's transfers compete for: its root
+ * bus ("bus:<N>"), the external hub it hangs off ("hub:<PATH>") and the
+ * transaction translator serving it if it is a full or low speed device
+ * behind a high speed hub ("tt:<HUB>", or "tt:<HUB>:<PORT>" for hubs with
+ * one TT per port). Unused domains are empty.
+ */
+struct sdp_route
+{
+    char domains[SDP_ROUTE_DOMAINS][SDP_DOMAIN_SIZE];
+};
+
+/*
+ * Limit the number of concurrent write_file transfers per domain, given as
+ * a comma separated list of bus=<N>, hub=<N>, tt=<N> and <HUB-PATH>=<N> for
+ * a single hub. Domains without a limit are shared freely.
+ */
+int sdp_sched_configure(const char *s);
+void sdp_sched_cleanup(void);
+
+/*
+ * Wait until every domain of route has room for another transfer of size
+ * bytes, or fail once deadline (see deadline.h) has passed. Of the waiting
+ * transfers that fit, the largest is admitted first: finishing the long
+ * transfers early shortens the time until all boards are done. Does nothing
+ * for a NULL route or without limits.
+ */
+int sdp_sched_acquire(const struct sdp_route *route, uint64_t size, int64_t deadline);
+void sdp_sched_release(const struct sdp_route *route);
+
+#endif
@@ -0,0 +1,201 @@
+#include "script.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LINE_LENGTH 256
+#define DEFAULT_POLL_TIMEOUT_MS 1000
+
+struct sdp_script_
+{
+    const char *path;
+    struct sdp_register_op *ops;
+    size_t count;
+    size_t capacity;
+};
+
+static int parse_hex(const char *s, uint32_t *value)
+{
+    char *end;
+    unsigned long ul = strtoul(s, &end, 16);
+    if (s == end || *end || ul > UINT32_MAX)
+        return 1;
+    *value = ul;
+    return 0;
+}
+
+/* Split the command into its name and width suffix */
+static void parse_width(char *command, uint8_t *width)
+{
+    size_t length = strlen(command);
+    *width = 32;
+    if (length > 1 && !strcmp(command + length - 1, "8"))
+    {
+        *width = 8;
+        command[length - 1] = '\0';
+    }
+    else if (length > 2 && !strcmp(command + length - 2, "16"))
+    {
+        *width = 16;
+        command[length - 2] = '\0';
+    }
+    else if (length > 2 && !strcmp(command + length - 2, "32"))
+        command[length - 2] = '\0';
+}
+
+static int parse_line(char *line, struct sdp_register_op *op)
+{
+    char *saveptr = NULL;
+    char *command = strtok_r(line, " \t", &saveptr);
+    char *args[4];
+    int count = 0;
+    for (char *tok; (tok = strtok_r(NULL, " \t", &saveptr)); ++count)
+    {
+        if (count == 4)
+            return 1;
+        args[count] = tok;
+    }
+
+    parse_width(command, &op->width);
+    if (!count || parse_hex(args[0], &op->address))
+        return 1;
+
+    if (!strcmp(command, "write") && count == 2)
+    {
+        op->type = SDP_REGISTER_WRITE;
+        if (parse_hex(args[1], &op->value))
+            return 1;
+    }
+    else if ((!strcmp(command, "set") || !strcmp(command, "clear")) && count == 2)
+    {
+        op->type = SDP_REGISTER_MODIFY;
+        if (parse_hex(args[1], &op->mask))
+            return 1;
+        op->value = !strcmp(command, "set") ? op->mask : 0;
+    }
+    else if (!strcmp(command, "modify") && count == 3)
+    {
+        op->type = SDP_REGISTER_MODIFY;
+        if (parse_hex(args[1], &op->mask) || parse_hex(args[2], &op->value) || (op->value & ~op->mask))
+            return 1;
+    }
+    else if (!strcmp(command, "poll") && (count == 3 || count == 4))
+    {
+        op->type = SDP_REGISTER_POLL;
+        if (parse_hex(args[1], &op->mask) || parse_hex(args[2], &op->value) || (op->value & ~op->mask))
+            return 1;
+        op->timeout_ms = DEFAULT_POLL_TIMEOUT_MS;
+        if (count == 4)
+        {
+            char *end;
+            unsigned long ul = strtoul(args[3], &end, 10);
+            if (args[3] == end || *end || !ul || ul > 3600000)
+                return 1;
+            op->timeout_ms = ul;
+        }
+    }
+    else
+        return 1;
+
+    /* Registers are naturally aligned and values fit them */
+    uint32_t limit = op->width == 32 ? UINT32_MAX : (1u << op->width) - 1;
+    if (op->address % (op->width / 8) || op->value > limit || op->mask > limit)
+        return 1;
+    return 0;
+}
+
+static int append(sdp_script *script, const struct sdp_register_op *op)
+{
+    if (script->count == script->capacity)
+    {
+        size_t capacity = script->capacity ? 2 * script->capacity : 64;
+        struct sdp_register_op *ops = realloc(script->ops, capacity * sizeof(*ops));
+        if (!ops)
+        {
+            sdp_error("ERROR: Allocation failed\n");
+            return 1;
+        }
+        script->ops = ops;
+        script->capacity = capacity;
+    }
+    script->ops[script->count++] = *op;
+    return 0;
+}
+
+sdp_script *sdp_script_parse(const sdp_image *image)
+{
+    sdp_script *script = calloc(1, sizeof(sdp_script));
+    if (!script)
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        return NULL;
+    }
+    script->path = sdp_image_path(image);
+
+    const char *data = (const char *)sdp_image_data(image);
+    size_t size = sdp_image_size(image);
+    char line[MAX_LINE_LENGTH];
+    int number = 0;
+    for (size_t offset = 0; offset < size;)
+    {
+        const char *end = memchr(data + offset, '\n', size - offset);
+        size_t length = (end ? (size_t)(end - data) : size) - offset;
+        ++number;
+        if (length >= sizeof(line))
+        {
+            sdp_error("ERROR: Line %d of register script \"%s\" is too long\n", number, script->path);
+            goto free_script;
+        }
+        memcpy(line, data + offset, length);
+        line[length] = '\0';
+        offset += length + 1;
+
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+        line[strcspn(line, "\r")] = '\0';
+        if (!line[strspn(line, " \t")])
+            continue;
+
+        struct sdp_register_op op = {.line = number};
+        if (parse_line(line, &op))
+        {
+            sdp_error("ERROR: Invalid command in line %d of register script \"%s\"\n", number, script->path);
+            goto free_script;
+        }
+        if (append(script, &op))
+            goto free_script;
+    }
+
+    if (!script->count)
+    {
+        sdp_error("ERROR: Register script \"%s\" has no commands\n", script->path);
+        goto free_script;
+    }
+    return script;
+
+free_script:
+    sdp_script_free(script);
+    return NULL;
+}
+
+void sdp_script_free(sdp_script *script)
+{
+    free(script->ops);
+    free(script);
+}
+
+const char *sdp_script_path(const sdp_script *script)
+{
+    return script->path;
+}
+
+size_t sdp_script_count(const sdp_script *script)
+{
+    return script->count;
+}
+
+const struct sdp_register_op *sdp_script_op(const sdp_script *script, size_t i)
+{
+    return script->ops + i;
+}
@@ -0,0 +1,55 @@
+#ifndef SCRIPT_H_
+#define SCRIPT_H_
+
+#include "image.h"
+#include <stddef.h>
+#include <stdint.h>
+
+struct sdp_script_;
+typedef struct sdp_script_ sdp_script;
+
+enum sdp_register_op_type
+{
+    /* Write value */
+    SDP_REGISTER_WRITE,
+    /* Read, then write (old & ~mask) | value */
+    SDP_REGISTER_MODIFY,
+    /* Read until (old & mask) == value or timeout_ms have passed */
+    SDP_REGISTER_POLL,
+};
+
+struct sdp_register_op
+{
+    enum sdp_register_op_type type;
+    /* Line of the script, for error messages */
+    int line;
+    uint32_t address;
+    /* Register width in bits, 8, 16 or 32 */
+    uint8_t width;
+    uint32_t mask;
+    uint32_t value;
+    unsigned timeout_ms;
+};
+
+/*
+ * Parse the register script in image, a text file with one command per line
+ * and comments starting with '#':
+ *
+ *   write <ADDRESS> <VALUE>
+ *   set <ADDRESS> <BITS>
+ *   clear <ADDRESS> <BITS>
+ *   modify <ADDRESS> <MASK> <VALUE>
+ *   poll <ADDRESS> <MASK> <VALUE> [<TIMEOUT-MS>]
+ *
+ * Numbers are hex like the addresses of steps, the timeout (default: 1000)
+ * is decimal. Commands work on 32 bit registers unless 8 or 16 is appended,
+ * e.g. write16. Returns NULL and reports the line if the script is malformed.
+ */
+sdp_script *sdp_script_parse(const sdp_image *image);
+void sdp_script_free(sdp_script *script);
+
+const char *sdp_script_path(const sdp_script *script);
+size_t sdp_script_count(const sdp_script *script);
+const struct sdp_register_op *sdp_script_op(const sdp_script *script, size_t i);
+
+#endif
@@ -1,51 +1,61 @@
 #include "sdp.h"
+#include "deadline.h"
+#include "ivt.h"
+#include "loader.h"
+#include "log.h"
+#include "metrics.h"
+#include "progress.h"
+#include "protocol.h"
+#include "scheduler.h"
+#include "script.h"
+#include "trace.h"
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <unistd.h>
-
-enum command_type
-{
-	READ_REGISTER = 0x0101,
-	WRITE_REGISTER = 0x0202,
-	WRITE_FILE = 0x0404,
-	ERROR_STATUS = 0x0505,
-	DCD_WRITE = 0x0A0A,
-	JUMP_ADDRESS = 0x0B0B,
-	SKIP_DCD_HEADER = 0x0C0C,
-};
+#include <time.h>
+
+#define READ_BUFFER_SIZE (64 * 1024)
+#define VERIFY_SAMPLE_SIZE 4096
+/* Register writes of a script sent before the replies of the first are read */
+#define MAX_PIPELINE_DEPTH 16
+/* Pause between the reads of a polled register, doubled up to the maximum */
+#define POLL_INTERVAL_MS 1
+#define MAX_POLL_INTERVAL_MS 50
 
-enum hab_status
+static int check_deadline(sdp_transport *handle)
 {
-	HAB_CLOSED = 0x12343412,
-	HAB_OPEN = 0x56787856,
-};
+	if (!sdp_deadline_expired(handle->deadline))
+		return 0;
+	sdp_error("ERROR: Deadline exceeded\n");
+	return 1;
+}
 
-enum response_code
+static int write_command_report(sdp_transport *handle, const void *report, size_t length)
 {
-	WRITE_REGISTER_COMPLETE = 0x128A8A12,
-	WRITE_FILE_COMPLETE = 0x88888888,
-	DCD_WRITE_COMPLETE = 0x128A8A12,
-	SKIP_DCD_HEADER_ACK = 0x900DD009,
-};
+	if (check_deadline(handle))
+		return 1;
+	int res = sdp_transport_write(handle, report, length);
+	if (res < 0)
+	{
+		sdp_error("ERROR: Failed to write command: %ls\n", sdp_transport_error(handle));
+		return 1;
+	}
+	if ((size_t)res != length)
+	{
+		sdp_error("ERROR: Short command write (wrote %d bytes)\n", res);
+		return 1;
+	}
+	return 0;
+}
 
-static int write_command(hid_device *handle, enum command_type cmd, uint32_t address,
+static int write_command(sdp_transport *handle, enum command_type cmd, uint32_t address,
 						 uint8_t format, uint32_t data_count, uint32_t data)
 {
-	struct
-	{
-		uint8_t report_id;
-		uint16_t command_type;
-		uint32_t address;
-		uint8_t format;
-		uint32_t data_count;
-		uint32_t data;
-		uint8_t reserved;
-	} __attribute__((packed)) report1 = {
+	struct command_report report1 = {
 		.report_id = 1,
 		.command_type = cmd,
 		.address = htonl(address),
@@ -54,82 +64,97 @@ static int write_command(hid_device *handle, enum command_type cmd, uint32_t add
 		.data = htonl(data),
 		.reserved = 0,
 	};
+	return write_command_report(handle, &report1, sizeof(report1));
+}
 
-	int res = hid_write(handle, (const unsigned char *)&report1, sizeof(report1));
-	if (res < 0)
-	{
-		fprintf(stderr, "ERROR: Failed to write command: %ls\n", hid_error(handle));
-		return 1;
-	}
-	if (res != sizeof(report1))
-	{
-		fprintf(stderr, "ERROR: Short command write (wrote %d bytes)\n", res);
-		return 1;
-	}
-	return 0;
+static int write_stream_command(sdp_transport *handle, uint32_t size)
+{
+	struct sdps_command_report report1 = {
+		.report_id = 1,
+		.signature = htole32(SDPS_SIGNATURE),
+		.tag = htole32(1),
+		.transfer_length = htole32(size),
+		.flags = 0, /* host to device */
+		.command = SDPS_DOWNLOAD_FW,
+		.length = htonl(size),
+	};
+	return write_command_report(handle, &report1, sizeof(report1));
 }
 
-static int read_report(hid_device *handle, uint8_t report_id, unsigned char *buf,
+static int read_report(sdp_transport *handle, uint8_t report_id, unsigned char *buf,
 					   size_t length, bool optional)
 {
-	int res = hid_read_timeout(handle, buf, length, optional ? 500 : -1);
+	int timeout = optional ? 500 : sdp_timeouts()->io_ms ? sdp_timeouts()->io_ms : -1;
+	int res = sdp_transport_read(handle, buf, length, sdp_deadline_timeout(handle->deadline, timeout));
+	if (res == 0 && !optional)
+	{
+		if (sdp_deadline_expired(handle->deadline))
+			sdp_error("ERROR: Deadline exceeded waiting for report %d\n", report_id);
+		else
+			sdp_error("ERROR: Timeout waiting for report %d\n", report_id);
+		return 1;
+	}
 	if (res < 0)
 	{
 		if (!optional)
-			fprintf(stderr, "ERROR: Failed to read report %d: %ls\n",
-					report_id, hid_error(handle));
+			sdp_error("ERROR: Failed to read report %d: %ls\n",
+					report_id, sdp_transport_error(handle));
 		return 1;
 	}
 	if ((size_t)res != length)
 	{
-		/* This covers the timeout case (res==0) */
+		/* This covers the timeout case (res==0) of optional reports */
 		if (!optional)
-			fprintf(stderr, "ERROR: Short report %d read (got=%d, wanted=%ld)\n",
+			sdp_error("ERROR: Short report %d read (got=%d, wanted=%ld)\n",
 					report_id, res, length);
 		return 1;
 	}
 	if (buf[0] != report_id)
 	{
-		fprintf(stderr, "ERROR: Unexpected report ID (got=%d, expected=%d)\n", buf[0], report_id);
+		sdp_error("ERROR: Unexpected report ID (got=%d, expected=%d)\n", buf[0], report_id);
 		return 1;
 	}
 	return 0;
 }
 
-static int read_hab_status(hid_device *handle, uint32_t *status)
+static int read_hab_status(sdp_transport *handle, uint32_t *status)
 {
 	unsigned char buf[5];
+	int64_t start = sdp_trace_now();
 	int res = read_report(handle, 3, buf, sizeof(buf), false);
+	sdp_trace_span("hab_status", start);
 	if (res)
-		fprintf(stderr, "ERROR: Failed to read HAB status\n");
+		sdp_error("ERROR: Failed to read HAB status\n");
 	else
 	{
 		uint32_t tmp = *(uint32_t *)(buf + 1);
 		if (status)
 			*status = tmp;
-		printf("HAB: ");
+		sdp_info("HAB: ");
 		switch (tmp)
 		{
 		case HAB_CLOSED:
-			printf("closed\n");
+			sdp_info("closed\n");
 			break;
 		case HAB_OPEN:
-			printf("open\n");
+			sdp_info("open\n");
 			break;
 		default:
-			printf("unknown (0x%08x)\n", *status);
+			sdp_info("unknown (0x%08x)\n", *status);
 			break;
 		}
 	}
 	return res;
 }
 
-static int read_response(hid_device *handle, uint32_t *status, bool optional)
+static int read_response(sdp_transport *handle, uint32_t *status, bool optional)
 {
 	unsigned char buf[65];
+	int64_t start = sdp_trace_now();
 	int res = read_report(handle, 4, buf, sizeof(buf), optional);
+	sdp_trace_span("response", start);
 	if (res && !optional)
-		fprintf(stderr, "ERROR: Failed to read response\n");
+		sdp_error("ERROR: Failed to read response\n");
 	else
 	{
 		uint32_t tmp = *(uint32_t *)(buf + 1);
@@ -139,108 +164,640 @@ static int read_response(hid_device *handle, uint32_t *status, bool optional)
 	return res;
 }
 
-int sdp_write_file(hid_device *handle, const char *file_path, uint32_t address)
+static int write_data_report(sdp_transport *handle, const unsigned char *report, size_t length)
 {
-	int res;
-	int fd = open(file_path, O_RDONLY);
-	if (fd < 0)
+	if (check_deadline(handle))
+		return 1;
+	int res = sdp_transport_write(handle, report, length);
+	if (res < 0)
+	{
+		sdp_error("ERROR: Failed to write data chunk: %ls\n", sdp_transport_error(handle));
+		return 1;
+	}
+	if ((size_t)res != length)
 	{
-		fprintf(stderr, "ERROR: Failed to open file \"%s\": %s\n", file_path, strerror(errno));
-		res = -1;
-		goto out;
+		sdp_error("ERROR: Short data chunk write (wrote %d bytes, wanted %zu bytes)\n",
+				  res, length);
+		return 1;
 	}
+	sdp_progress_advance(length - 1);
+	return 0;
+}
 
-	struct stat stat;
-	res = fstat(fd, &stat);
-	if (res)
+static int flush_reports(sdp_transport *handle)
+{
+	if (!sdp_transport_flush(handle))
+		return 0;
+	sdp_error("ERROR: Failed to write data chunk: %ls\n", sdp_transport_error(handle));
+	return 1;
+}
+
+static int write_data(sdp_transport *handle, const unsigned char *data, size_t size)
+{
+	/*
+	 * Reports are cut straight from the image. The copy is only needed
+	 * because the report ID has to precede the payload in the same buffer.
+	 */
+	unsigned char buf[1025];
+	buf[0] = 2;
+	sdp_progress_start(size);
+	for (size_t offset = 0; offset < size;)
 	{
-		fprintf(stderr, "ERROR: Failed to stat file \"%s\": %s\n", file_path, strerror(errno));
-		goto close_fd;
+		size_t n = size - offset > 1024 ? 1024 : size - offset;
+		memcpy(buf + 1, data + offset, n);
+		offset += n;
+
+		if (write_data_report(handle, buf, n + 1))
+			return 1;
 	}
-	printf("Writing file \"%s\" (size: %ld) to 0x%08x\n", file_path, stat.st_size, address);
+	return 0;
+}
 
-	res = write_command(handle, WRITE_FILE, address, 0, stat.st_size, 0);
+static int read_completion(sdp_transport *handle, uint32_t expected, const char *what)
+{
+	uint32_t hab_status, status;
+	int res = read_hab_status(handle, &hab_status);
+	if (res)
+		return 1;
+	res = read_response(handle, &status, false);
 	if (res)
-		goto close_fd;
+		return 1;
+	if (status != expected)
+	{
+		sdp_metrics_set_status(status);
+		sdp_error("ERROR: Failed to %s: 0x%08x\n", what, status);
+		return 1;
+	}
+	return 0;
+}
+
+static unsigned retry_limit;
+static unsigned retry_backoff_ms = SDP_DEFAULT_BACKOFF_MS;
+static unsigned retry_max_backoff_ms = SDP_DEFAULT_MAX_BACKOFF_MS;
+
+void sdp_set_retry_policy(unsigned retries, unsigned backoff_ms, unsigned max_backoff_ms)
+{
+	retry_limit = retries;
+	retry_backoff_ms = backoff_ms;
+	retry_max_backoff_ms = max_backoff_ms;
+}
+
+static void sleep_ms(unsigned ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000l,
+	};
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+/*
+ * Return the data report that starts at offset into the data. Offsets only
+ * grow, but the last report is asked for again if sending it failed.
+ */
+typedef const unsigned char *(*report_source)(void *arg, uint32_t offset, size_t *length);
+
+/*
+ * Recover from a failed data report once offset bytes have gone through: if
+ * ERROR_STATUS shows the ROM is still alive, start a new WRITE_FILE for the
+ * rest of the data. The waits between attempts double up to a maximum.
+ */
+static int resume_write(sdp_transport *handle, uint32_t address, uint32_t size, uint32_t offset,
+						unsigned *attempts)
+{
+	if (*attempts == retry_limit || sdp_deadline_expired(handle->deadline))
+		return 1;
+	unsigned backoff = retry_backoff_ms;
+	for (unsigned i = 0; i < *attempts && backoff < retry_max_backoff_ms; ++i)
+		backoff *= 2;
+	if (backoff > retry_max_backoff_ms)
+		backoff = retry_max_backoff_ms;
+	++*attempts;
+	sdp_metrics_retry();
+	sdp_info("Resuming at offset 0x%x in %u ms (attempt %u/%u)\n", offset, backoff, *attempts, retry_limit);
+
+	int64_t start = sdp_trace_now();
+	sleep_ms(sdp_deadline_timeout(handle->deadline, backoff));
+	uint32_t hab_status, status;
+	int res = sdp_error_status(handle, &hab_status, &status);
+	if (!res)
+		res = write_command(handle, WRITE_FILE, address + offset, 0, size - offset, 0);
+	sdp_trace_span("resume", start);
+	return res;
+}
+
+static int write_file_data(sdp_transport *handle, uint32_t address, uint32_t size,
+						   report_source source, void *arg)
+{
+	/* Wait for room on the hubs shared with other boards */
+	if (sdp_sched_acquire(handle->route, size, handle->deadline))
+		return 1;
+
+	int64_t start = sdp_trace_now();
+	int res = write_command(handle, WRITE_FILE, address, 0, size, 0);
 
 	/*
 	 * Optionally send ERROR_STATUS command here to see whether the device has
 	 * rejected the address.
 	 */
 
-	/* We need one extra byte for the initial report ID */
-	unsigned char buf[1025];
-	buf[0] = 2;
-	while (stat.st_size > 0)
+	/*
+	 * A queuing transport may report a failure only on a later write, when
+	 * reports after the failed one have been counted as sent already. To
+	 * know where to resume, each report is confirmed before the next one is
+	 * sent while retries are enabled; the sources can't go back further
+	 * than their last report anyway.
+	 */
+	bool confirm = retry_limit > 0;
+	int64_t data_start = sdp_trace_now();
+	sdp_progress_start(size);
+	unsigned attempts = 0;
+	for (uint32_t offset = 0; !res && offset < size;)
 	{
-		ssize_t n = read(fd, buf + 1, stat.st_size > 1024 ? 1024 : stat.st_size);
-		if (n <= 0)
+		size_t length;
+		const unsigned char *report = source(arg, offset, &length);
+		if (!report)
+			res = 1;
+		else if (!write_data_report(handle, report, length) && (!confirm || !flush_reports(handle)))
+			offset += length - 1;
+		else
+			res = resume_write(handle, address, size, offset, &attempts);
+	}
+	sdp_trace_span("data", data_start);
+
+	if (!res)
+		res = read_completion(handle, WRITE_FILE_COMPLETE, "write file");
+	if (!res)
+		sdp_metrics_bytes(size);
+	sdp_trace_transfer("write_file", start, size);
+	sdp_sched_release(handle->route);
+	return res;
+}
+
+struct memory_source
+{
+	const unsigned char *data;
+	uint32_t size;
+	unsigned char report[SDP_REPORT_SIZE];
+};
+
+static const unsigned char *next_chunk(void *arg, uint32_t offset, size_t *length)
+{
+	/*
+	 * Reports are cut straight from the image. The copy is only needed
+	 * because the report ID has to precede the payload in the same buffer.
+	 */
+	struct memory_source *src = arg;
+	size_t n = src->size - offset > 1024 ? 1024 : src->size - offset;
+	src->report[0] = 2;
+	memcpy(src->report + 1, src->data + offset, n);
+	*length = n + 1;
+	return src->report;
+}
+
+static int write_memory(sdp_transport *handle, const unsigned char *data, size_t size, uint32_t address)
+{
+	if (size > UINT32_MAX)
+	{
+		sdp_error("ERROR: File too large for WRITE_FILE\n");
+		return 1;
+	}
+	struct memory_source src = {
+		.data = data,
+		.size = size,
+	};
+	return write_file_data(handle, address, size, next_chunk, &src);
+}
+
+/* The reports are laid out already, they only need to be submitted */
+static int write_payload_reports(sdp_transport *handle, const sdp_payload *payload)
+{
+	int64_t start = sdp_trace_now();
+	size_t count = sdp_payload_count(payload);
+	sdp_progress_start(sdp_payload_size(payload));
+	int res = 0;
+	for (size_t i = 0; !res && i < count; ++i)
+	{
+		size_t length;
+		const unsigned char *report = sdp_payload_report(payload, i, &length);
+		res = write_data_report(handle, report, length);
+	}
+	sdp_trace_span("data", start);
+	return res;
+}
+
+static const unsigned char *next_payload_report(void *arg, uint32_t offset, size_t *length)
+{
+	return sdp_payload_report(arg, offset / (SDP_REPORT_SIZE - 1), length);
+}
+
+int sdp_write_payload(sdp_transport *handle, const sdp_payload *payload, uint32_t address)
+{
+	uint32_t size = sdp_payload_size(payload);
+	sdp_info("Writing file \"%s\" (size: %u) to 0x%08x\n", sdp_payload_path(payload), size, address);
+	return write_file_data(handle, address, size, next_payload_report, (void *)payload);
+}
+
+int sdp_stream_payload(sdp_transport *handle, const sdp_payload *payload)
+{
+	uint32_t size = sdp_payload_size(payload);
+	sdp_info("Streaming file \"%s\" (size: %u)\n", sdp_payload_path(payload), size);
+
+	if (sdp_sched_acquire(handle->route, size, handle->deadline))
+		return 1;
+
+	/* The ROM doesn't answer, it boots the container once it has all of it */
+	int64_t start = sdp_trace_now();
+	int res = write_stream_command(handle, size);
+	if (!res)
+		res = write_payload_reports(handle, payload);
+	if (!res)
+		sdp_metrics_bytes(size);
+	sdp_trace_transfer("stream_file", start, size);
+	sdp_sched_release(handle->route);
+	return res;
+}
+
+/* Consume size bytes read from offset, returns non-zero to fail the read */
+typedef int (*read_sink)(void *arg, uint32_t offset, const unsigned char *data, size_t size);
+
+/*
+ * Read size bytes from address with a single READ_REGISTER. The ROM streams
+ * the data back in 64 byte reports without waiting for further commands,
+ * which are gathered into large blocks for sink. Once sink has failed, the
+ * rest of the data is still read so that no stale reports are left behind.
+ */
+static int read_memory(sdp_transport *handle, uint32_t address, uint32_t size,
+					   read_sink sink, void *arg)
+{
+	unsigned char *buf = malloc(READ_BUFFER_SIZE);
+	if (!buf)
+	{
+		sdp_error("ERROR: Allocation failed\n");
+		return 1;
+	}
+
+	unsigned char report[65];
+	int res = write_command(handle, READ_REGISTER, address, 32, size, 0);
+	if (!res)
+		res = read_report(handle, 3, report, 5, false);
+	if (res)
+		sdp_error("ERROR: Failed to read memory at 0x%08x\n", address);
+
+	int sink_res = 0;
+	size_t fill = 0;
+	sdp_progress_start(size);
+	for (uint32_t offset = 0; !res && offset < size;)
+	{
+		res = read_report(handle, 4, report, sizeof(report), false);
+		if (res)
+			break;
+		size_t n = size - offset < 64 ? size - offset : 64;
+		memcpy(buf + fill, report + 1, n);
+		fill += n;
+		offset += n;
+		if (fill == READ_BUFFER_SIZE || offset == size)
 		{
+			if (!sink_res)
+				sink_res = sink(arg, offset - fill, buf, fill);
+			sdp_progress_advance(fill);
+			fill = 0;
 		}
-		stat.st_size -= n;
+	}
+
+	free(buf);
+	return res || sink_res;
+}
 
-		res = hid_write(handle, buf, n + 1);
-		if (res < 0)
+static int write_to_file(void *arg, uint32_t offset, const unsigned char *data, size_t size)
+{
+	(void)offset;
+	if (fwrite(data, 1, size, arg) != size)
+	{
+		sdp_error("ERROR: Failed to write memory dump: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+int sdp_read_memory(sdp_transport *handle, uint32_t address, uint32_t size, const char *file_path)
+{
+	sdp_info("Reading memory at 0x%08x (size: %u) to \"%s\"\n", address, size, file_path);
+	FILE *file = fopen(file_path, "wb");
+	if (!file)
+	{
+		sdp_error("ERROR: Failed to open \"%s\": %s\n", file_path, strerror(errno));
+		return 1;
+	}
+
+	int64_t start = sdp_trace_now();
+	int res = read_memory(handle, address, size, write_to_file, file);
+	sdp_trace_transfer("read_memory", start, size);
+	if (fclose(file) && !res)
+	{
+		sdp_error("ERROR: Failed to write memory dump: %s\n", strerror(errno));
+		res = 1;
+	}
+	return res;
+}
+
+struct verify_args
+{
+	const sdp_payload *payload;
+	uint32_t offset;
+	uint32_t address;
+};
+
+/* The expected data is interleaved with report IDs, compare report by report */
+static int compare(void *arg, uint32_t offset, const unsigned char *data, size_t size)
+{
+	const struct verify_args *args = arg;
+	for (size_t done = 0; done < size;)
+	{
+		uint32_t position = args->offset + offset + done;
+		size_t length;
+		const unsigned char *report = sdp_payload_report(args->payload, position / 1024, &length);
+		const unsigned char *expected = report + 1 + position % 1024;
+		size_t n = length - 1 - position % 1024;
+		if (n > size - done)
+			n = size - done;
+		if (memcmp(data + done, expected, n))
 		{
-			fprintf(stderr, "ERROR: Failed to write data chunk: %ls\n", hid_error(handle));
-			goto close_fd;
+			size_t i = 0;
+			while (data[done + i] == expected[i])
+				++i;
+			sdp_error("ERROR: Verification failed at 0x%08x (read 0x%02x, expected 0x%02x)\n",
+					  args->address + position + (uint32_t)i, data[done + i], expected[i]);
+			return 1;
 		}
-		if (res != n + 1)
+		done += n;
+	}
+	return 0;
+}
+
+int sdp_verify_payload(sdp_transport *handle, const sdp_payload *payload, uint32_t address, uint32_t samples)
+{
+	uint32_t size = sdp_payload_size(payload);
+	struct verify_args args = {
+		.payload = payload,
+		.address = address,
+	};
+	int64_t start = sdp_trace_now();
+	int res = 0;
+	uint64_t bytes = 0;
+	if (!samples || (uint64_t)samples * VERIFY_SAMPLE_SIZE >= size)
+	{
+		sdp_info("Verifying file \"%s\" (size: %u) at 0x%08x\n", sdp_payload_path(payload), size, address);
+		res = read_memory(handle, address, size, compare, &args);
+		bytes = size;
+	}
+	else
+	{
+		sdp_info("Verifying file \"%s\" (size: %u) at 0x%08x with %u samples of %d bytes\n",
+				 sdp_payload_path(payload), size, address, samples, VERIFY_SAMPLE_SIZE);
+		/* Spread evenly from the first to the last block, word aligned */
+		uint64_t span = size - VERIFY_SAMPLE_SIZE;
+		for (uint32_t i = 0; !res && i < samples; ++i)
 		{
-			fprintf(stderr, "ERROR: Short data chunk write (wrote %d bytes, wanted %ld bytes)\n", res, n);
-			goto close_fd;
+			uint32_t offset = samples > 1 ? (span * i / (samples - 1)) & ~3u : 0;
+			uint32_t n = size - offset < VERIFY_SAMPLE_SIZE ? size - offset : VERIFY_SAMPLE_SIZE;
+			args.offset = offset;
+			res = read_memory(handle, address + offset, n, compare, &args);
+			bytes += n;
 		}
 	}
+	sdp_trace_transfer("verify_file", start, bytes);
+	return res;
+}
 
-	uint32_t hab_status, status;
-	res = read_hab_status(handle, &hab_status);
-	if (res)
-		goto close_fd;
-	res = read_response(handle, &status, false);
-	if (res)
-		goto close_fd;
-	if (status != WRITE_FILE_COMPLETE)
+int sdp_load(sdp_transport *handle, const sdp_loader *loader, bool jump)
+{
+	size_t count = sdp_loader_count(loader);
+	sdp_info("Loading %s file \"%s\" (%zu segments)\n",
+			 sdp_loader_format(loader), sdp_loader_path(loader), count);
+
+	uint32_t entry;
+	if (jump && sdp_loader_entry(loader, &entry))
 	{
-		fprintf(stderr, "ERROR: Failed to write file: 0x%08x\n", status);
-		res = 1;
+		sdp_error("ERROR: \"%s\" has no entry point to jump to\n", sdp_loader_path(loader));
+		return 1;
+	}
+	for (size_t i = 0; i < count; ++i)
+	{
+		uint32_t address, size;
+		const unsigned char *data = sdp_loader_segment(loader, i, &address, &size);
+		sdp_info("Writing segment %zu/%zu (size: %u) to 0x%08x\n", i + 1, count, size, address);
+		if (write_memory(handle, data, size, address))
+			return 1;
 	}
+	return jump ? sdp_jump_address(handle, entry) : 0;
+}
+
+/*
+ * The commands of a register script don't depend on the replies to earlier
+ * writes, so those are only read once the pipeline is full or a register is
+ * read. Only the replies are checked, the HAB state isn't printed for every
+ * command.
+ */
+struct pipeline
+{
+	sdp_transport *handle;
+	const sdp_script *script;
+	/* Writes whose replies haven't been read, oldest first */
+	const struct sdp_register_op *ops[MAX_PIPELINE_DEPTH];
+	size_t head;
+	size_t count;
+	size_t depth;
+};
 
-close_fd:
-	close(fd);
-out:
+static int script_error(const struct pipeline *p, const struct sdp_register_op *op)
+{
+	sdp_error("ERROR: Register script \"%s\" failed in line %d\n", sdp_script_path(p->script), op->line);
+	return 1;
+}
+
+/* Read the replies of the oldest writes until at most keep are left */
+static int drain_pipeline(struct pipeline *p, size_t keep)
+{
+	while (p->count > keep)
+	{
+		const struct sdp_register_op *op = p->ops[p->head];
+		p->head = (p->head + 1) % MAX_PIPELINE_DEPTH;
+		--p->count;
+
+		unsigned char report[5];
+		uint32_t status;
+		if (read_report(p->handle, 3, report, sizeof(report), false) || read_response(p->handle, &status, false))
+			return script_error(p, op);
+		if (status != WRITE_REGISTER_COMPLETE)
+		{
+			sdp_metrics_set_status(status);
+			sdp_error("ERROR: Failed to write register 0x%08x: 0x%08x\n", op->address, status);
+			return script_error(p, op);
+		}
+	}
+	return 0;
+}
+
+static int pipeline_write(struct pipeline *p, const struct sdp_register_op *op, uint32_t value)
+{
+	if (drain_pipeline(p, p->depth - 1))
+		return 1;
+	if (write_command(p->handle, WRITE_REGISTER, op->address, op->width, op->width / 8, value))
+		return script_error(p, op);
+	p->ops[(p->head + p->count++) % MAX_PIPELINE_DEPTH] = op;
+	return 0;
+}
+
+static int read_register(struct pipeline *p, const struct sdp_register_op *op, uint32_t *value)
+{
+	unsigned char report[65];
+	if (drain_pipeline(p, 0))
+		return 1;
+	if (write_command(p->handle, READ_REGISTER, op->address, op->width, op->width / 8, 0) ||
+		read_report(p->handle, 3, report, 5, false) || read_report(p->handle, 4, report, sizeof(report), false))
+		return script_error(p, op);
+	/* The ROM runs little endian */
+	*value = 0;
+	for (unsigned i = 0; i < op->width / 8u; ++i)
+		*value |= (uint32_t)report[1 + i] << (8 * i);
+	return 0;
+}
+
+static int poll_register(struct pipeline *p, const struct sdp_register_op *op)
+{
+	int64_t deadline = sdp_deadline_after(op->timeout_ms);
+	unsigned interval = POLL_INTERVAL_MS;
+	for (;;)
+	{
+		uint32_t value;
+		if (read_register(p, op, &value))
+			return 1;
+		if ((value & op->mask) == op->value)
+			return 0;
+		int remaining = sdp_deadline_timeout(deadline, interval);
+		if (!remaining)
+		{
+			sdp_error("ERROR: Register 0x%08x still reads 0x%08x after %u ms\n",
+					  op->address, value, op->timeout_ms);
+			return script_error(p, op);
+		}
+		/* Leave the bus to other boards while the hardware settles */
+		sleep_ms(remaining);
+		interval = interval * 2 < MAX_POLL_INTERVAL_MS ? interval * 2 : MAX_POLL_INTERVAL_MS;
+	}
+}
+
+int sdp_run_script(sdp_transport *handle, const sdp_script *script)
+{
+	size_t count = sdp_script_count(script);
+	sdp_info("Running register script \"%s\" (%zu commands)\n", sdp_script_path(script), count);
+
+	/* Every write is answered with two reports, which the host has to keep */
+	struct pipeline p = {
+		.handle = handle,
+		.script = script,
+		.depth = handle->input_buffer / 2,
+	};
+	if (p.depth > MAX_PIPELINE_DEPTH)
+		p.depth = MAX_PIPELINE_DEPTH;
+	if (!p.depth)
+		p.depth = 1;
+
+	int64_t start = sdp_trace_now();
+	int res = 0;
+	for (size_t i = 0; !res && i < count; ++i)
+	{
+		const struct sdp_register_op *op = sdp_script_op(script, i);
+		uint32_t value;
+		switch (op->type)
+		{
+		case SDP_REGISTER_WRITE:
+			res = pipeline_write(&p, op, op->value);
+			break;
+		case SDP_REGISTER_MODIFY:
+			res = read_register(&p, op, &value) || pipeline_write(&p, op, (value & ~op->mask) | op->value);
+			break;
+		case SDP_REGISTER_POLL:
+			res = poll_register(&p, op);
+			break;
+		}
+	}
+	if (!res)
+		res = drain_pipeline(&p, 0);
+	sdp_trace_span("register_script", start);
 	return res;
 }
 
-int sdp_error_status(hid_device *handle, uint32_t *hab_status, uint32_t *status)
+int sdp_dcd_write_image(sdp_transport *handle, const sdp_image *image, uint32_t address)
 {
-	int res = write_command(handle, ERROR_STATUS, 0x00000000, 0, 0, 0);
-	if (res)
+	size_t offset, size;
+	if (sdp_find_dcd(sdp_image_data(image), sdp_image_size(image), &offset, &size))
+	{
+		sdp_error("ERROR: No DCD table found in \"%s\"\n", sdp_image_path(image));
 		return 1;
-	res = read_hab_status(handle, hab_status);
+	}
+	if (size > SDP_MAX_DCD_SIZE)
+	{
+		sdp_error("ERROR: DCD table of \"%s\" is too large (size: %zu, max: %d)\n",
+				  sdp_image_path(image), size, SDP_MAX_DCD_SIZE);
+		return 1;
+	}
+	sdp_info("Writing DCD of \"%s\" (offset: 0x%zx, size: %zu) to 0x%08x\n",
+			 sdp_image_path(image), offset, size, address);
+
+	int64_t start = sdp_trace_now();
+	int res = write_command(handle, DCD_WRITE, address, 0, size, 0);
+	if (!res)
+		res = write_data(handle, sdp_image_data(image) + offset, size);
+	if (!res)
+		res = read_completion(handle, DCD_WRITE_COMPLETE, "write DCD");
+	sdp_trace_transfer("dcd_write", start, size);
+	return res;
+}
+
+int sdp_skip_dcd_header(sdp_transport *handle)
+{
+	sdp_info("Skipping DCD header of the next image\n");
+	int res = write_command(handle, SKIP_DCD_HEADER, 0x00000000, 0, 0, 0);
 	if (res)
 		return 1;
-	res = read_response(handle, status, false);
+	return read_completion(handle, SKIP_DCD_HEADER_ACK, "skip DCD header");
+}
+
+int sdp_error_status(sdp_transport *handle, uint32_t *hab_status, uint32_t *status)
+{
+	int64_t start = sdp_trace_now();
+	int res = write_command(handle, ERROR_STATUS, 0x00000000, 0, 0, 0);
+	if (!res)
+		res = read_hab_status(handle, hab_status);
+	if (!res)
+		res = read_response(handle, status, false);
+	sdp_trace_span("error_status", start);
 	if (res)
 		return 1;
-	printf("Error status: 0x%08x\n", *status);
+	sdp_info("Error status: 0x%08x\n", *status);
 	return 0;
 }
 
-int sdp_jump_address(hid_device *handle, uint32_t address)
+int sdp_jump_address(sdp_transport *handle, uint32_t address)
 {
-	printf("Jumping to 0x%08x\n", address);
+	sdp_info("Jumping to 0x%08x\n", address);
+	int64_t start = sdp_trace_now();
 	int res = write_command(handle, JUMP_ADDRESS, address, 0, 0, 0);
-	if (res)
-		return 1;
 	uint32_t hab_status, status;
-	res = read_hab_status(handle, &hab_status);
+	if (!res)
+		res = read_hab_status(handle, &hab_status);
+	sdp_trace_span("jump_address", start);
 	if (res)
 		return 1;
 	// Report 4 is only sent if the jump failed
 	res = read_response(handle, &status, true);
 	if (!res)
 	{
-		fprintf(stderr, "ERROR: Jumping to 0x%08x failed: 0x%08x\n", address, status);
+		sdp_metrics_set_status(status);
+		sdp_error("ERROR: Jumping to 0x%08x failed: 0x%08x\n", address, status);
 		return 1;
 	}
 	return 0;
@@ -1,11 +1,58 @@
 #ifndef SDP_H_
 #define SDP_H_
 
+#include <stdbool.h>
 #include <stdint.h>
-#include <hidapi/hidapi.h>
+#include "image.h"
+#include "loader.h"
+#include "payload.h"
+#include "script.h"
+#include "transport.h"
 
-int sdp_write_file(hid_device *handle, const char *file_path, uint32_t address);
-int sdp_error_status(hid_device *handle, uint32_t *hab_status, uint32_t *status);
-int sdp_jump_address(hid_device *handle, uint32_t address);
+#define SDP_DEFAULT_BACKOFF_MS 10
+#define SDP_DEFAULT_MAX_BACKOFF_MS 1000
+
+/*
+ * Resume a WRITE_FILE whose data reports fail up to retries times, waiting
+ * backoff_ms before the first attempt and twice as long before each further
+ * one, up to max_backoff_ms. No retries are made by default.
+ */
+void sdp_set_retry_policy(unsigned retries, unsigned backoff_ms, unsigned max_backoff_ms);
+
+int sdp_write_payload(sdp_transport *handle, const sdp_payload *payload, uint32_t address);
+/*
+ * Send a boot container to an i.MX8 or later boot ROM in SDPS mode, which
+ * boots it right away
+ */
+int sdp_stream_payload(sdp_transport *handle, const sdp_payload *payload);
+/* Dump size bytes of memory at address to the file at file_path */
+int sdp_read_memory(sdp_transport *handle, uint32_t address, uint32_t size, const char *file_path);
+/*
+ * Read the memory image was written to back and compare it. Compressed
+ * images are compared to their decompressed contents. If samples is not 0,
+ * only that many 4 KiB blocks spread over the image are compared.
+ */
+int sdp_verify_payload(sdp_transport *handle, const sdp_payload *payload, uint32_t address, uint32_t samples);
+/*
+ * Write each loadable segment of an ELF, Intel HEX or S-record image to its
+ * address and, if jump is set, jump to the entry point of the image.
+ */
+int sdp_load(sdp_transport *handle, const sdp_loader *loader, bool jump);
+/*
+ * Program the device configuration data (e.g. DRAM setup) with DCD_WRITE. The
+ * DCD table is taken from the IVT of a boot image or from a bare DCD file.
+ */
+int sdp_dcd_write_image(sdp_transport *handle, const sdp_image *image, uint32_t address);
+/*
+ * Run the writes, read-modify-writes and polls of a register script with
+ * WRITE_REGISTER and READ_REGISTER. Writes are pipelined as deep as the
+ * input buffer of the transport allows, so they don't wait for each other's
+ * replies.
+ */
+int sdp_run_script(sdp_transport *handle, const sdp_script *script);
+/* Make the ROM ignore the DCD pointer of the image started by the next jump */
+int sdp_skip_dcd_header(sdp_transport *handle);
+int sdp_error_status(sdp_transport *handle, uint32_t *hab_status, uint32_t *status);
+int sdp_jump_address(sdp_transport *handle, uint32_t address);
 
 #endif
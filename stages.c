@@ -1,29 +1,89 @@
 #include "stages.h"
 #include "config.h"
+#include "deadline.h"
+#include "log.h"
+#include "metrics.h"
+#include "progress.h"
 #include "sdp.h"
 #include "steps.h"
+#include "trace.h"
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef WITH_EMULATOR
+#include "emulator.h"
+#endif
+#ifdef WITH_LIBUSB
+#include "transport_libusb.h"
+#endif
+#ifdef WITH_URING
+#include "transport_uring.h"
+#endif
 #ifdef WITH_UDEV
 #include "udev.h"
 #else
 #include <unistd.h>
+typedef struct sdp_udev_ sdp_udev;
 #endif
 
 struct stage
 {
     uint16_t usb_vid;
     uint16_t usb_pid;
+    /* SDPS instead of SDP */
+    bool stream;
     sdp_step *steps;
 };
 
+/* Boot ROMs that only speak SDPS, as enumerated in serial download mode */
+static const struct
+{
+    uint16_t vid;
+    uint16_t pid;
+} sdps_devices[] = {
+    {0x1fc9, 0x0129}, /* i.MX8QM */
+    {0x1fc9, 0x012f}, /* i.MX8QXP */
+    {0x1fc9, 0x013e}, /* i.MX8MN */
+    {0x1fc9, 0x0146}, /* i.MX8MP */
+    {0x1fc9, 0x0147}, /* i.MX8DXL */
+    {0x1fc9, 0x014a}, /* i.MX8ULP */
+    {0x1fc9, 0x014e}, /* i.MX93 */
+};
+
+static bool is_sdps_device(uint16_t vid, uint16_t pid)
+{
+    for (size_t i = 0; i < sizeof(sdps_devices) / sizeof(sdps_devices[0]); ++i)
+    {
+        if (sdps_devices[i].vid == vid && sdps_devices[i].pid == pid)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Preparing the data reports of the stages after the first runs on a thread
+ * of its own, while the boards execute the earlier stages and re-enumerate.
+ */
+struct prefetch
+{
+    pthread_t thread;
+    bool running;
+    atomic_bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Number of leading stages prepared, and whether the thread is done */
+    int ready;
+    bool finished;
+};
+
 struct sdp_stages_
 {
     int count;
+    struct prefetch *prefetch;
     struct stage stages[0];
 };
 
@@ -33,32 +93,44 @@ static int parse_stage(char *const s, struct stage *stage)
     char *tok = strtok_r(s, ",", &saveptr);
     if (!tok)
     {
-        fprintf(stderr, "ERROR: Stage \"%s\" invalid\n", s);
+        sdp_error("ERROR: Stage \"%s\" invalid\n", s);
         return 1;
     }
 
     unsigned int vid, pid;
-    int conversions = sscanf(tok, "%04x:%04x", &vid, &pid);
+    int end = 0;
+    int conversions = sscanf(tok, "%04x:%04x%n", &vid, &pid, &end);
     if (conversions != 2)
     {
-        fprintf(stderr, "ERROR: Stage didn't contain USB VID/PID");
+        sdp_error("ERROR: Stage didn't contain USB VID/PID");
         if (errno != 0)
-            fprintf(stderr, ": %s\n", strerror(errno));
+            sdp_error(": %s\n", strerror(errno));
         else
-            fputc('\n', stderr);
+            sdp_error("\n");
         return 1;
     }
 
     stage->usb_vid = vid;
     stage->usb_pid = pid;
+    if (!tok[end])
+        stage->stream = is_sdps_device(vid, pid);
+    else if (!strcmp(tok + end, ":sdps"))
+        stage->stream = true;
+    else if (!strcmp(tok + end, ":sdp"))
+        stage->stream = false;
+    else
+    {
+        sdp_error("ERROR: Unknown protocol \"%s\" (expected sdp or sdps)\n", tok + end + 1);
+        return 1;
+    }
 
-    sdp_step *last_step;
+    sdp_step *last_step = NULL;
     while ((tok = strtok_r(NULL, ",", &saveptr)))
     {
-        sdp_step *step = sdp_parse_step(tok);
+        sdp_step *step = sdp_parse_step(tok, stage->stream);
         if (!step)
         {
-            fprintf(stderr, "ERROR: Failed to parse step\n");
+            sdp_error("ERROR: Failed to parse step\n");
             return 1;
         }
 
@@ -69,6 +141,13 @@ static int parse_stage(char *const s, struct stage *stage)
         last_step = step;
     }
 
+    /* The ROM boots the container as soon as it has received it */
+    if (stage->stream && (!stage->steps || sdp_next_step(stage->steps)))
+    {
+        sdp_error("ERROR: SDPS stages take exactly one stream_file step\n");
+        return 1;
+    }
+
     return 0;
 }
 
@@ -77,7 +156,7 @@ sdp_stages *sdp_parse_stages(int count, char *s[])
     sdp_stages *stages = calloc(1, sizeof(sdp_stages) + count * sizeof(struct stage));
     if (!stages)
     {
-        fprintf(stderr, "ERROR: Failed to allocate stages (count=%d): %s\n", count, strerror(errno));
+        sdp_error("ERROR: Failed to allocate stages (count=%d): %s\n", count, strerror(errno));
         return NULL;
     }
     stages->count = count;
@@ -86,7 +165,7 @@ sdp_stages *sdp_parse_stages(int count, char *s[])
     {
         if (parse_stage(s[i], stages->stages + i))
         {
-            fprintf(stderr, "ERROR: Failed to parse stage %d\n", i + 1);
+            sdp_error("ERROR: Failed to parse stage %d\n", i + 1);
             goto free_stages;
         }
     }
@@ -101,62 +180,44 @@ free_stages:
 #ifdef WITH_UDEV
 static hid_device *_open_device(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *usb_path, bool quiet)
 {
-    hid_device *result = NULL;
-
-    struct hid_device_info * const enumerator = hid_enumerate(vid, pid);
-    if (!enumerator)
+    int64_t start = sdp_trace_now();
+    sdp_udev_update(udev);
+    char *devnode = sdp_udev_find(udev, vid, pid, usb_path);
+    sdp_trace_span("find_device", start);
+    if (!devnode)
     {
         if (!quiet)
-            fprintf(stderr, "ERROR: Failed to enumerate HID devices: %ls\n", hid_error(NULL));
+            sdp_error("ERROR: No matching device found\n");
         return NULL;
     }
 
-    const char *device_path = NULL;
-    for (struct hid_device_info *i = enumerator; !device_path && i; i = i->next)
-    {
-        if (!usb_path || sdp_udev_matching_usb_path(udev, i->path, usb_path))
-            device_path = i->path;
-    }
-
-    if (device_path)
-    {
-        result = hid_open_path(device_path);
-        if (!result && !quiet)
-            fprintf(stderr, "ERROR: Failed to open device: %ls\n", hid_error(result));
-    }
-    else if (!quiet)
-        fprintf(stderr, "ERROR: No matching device found\n");
-
-    hid_free_enumeration(enumerator);
-
+    start = sdp_trace_now();
+    hid_device *result = hid_open_path(devnode);
+    sdp_trace_span("hid_open_path", start);
+    if (!result && !quiet)
+        sdp_error("ERROR: Failed to open device: %ls\n", hid_error(result));
+    free(devnode);
     return result;
 }
 #else
 static hid_device *_open_device(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *path, bool quiet)
 {
-    struct hid_device *result = hid_open(vid, pid, NULL);
+    hid_device *result = hid_open(vid, pid, NULL);
     if (!result && !quiet)
-        fprintf(stderr, "ERROR: Failed to open device: %ls\n", hid_error(result));
+        sdp_error("ERROR: Failed to open device: %ls\n", hid_error(result));
     return result;
 }
 #endif
 
-static hid_device *open_device(uint16_t vid, uint16_t pid, const char *usb_path, bool wait)
+static hid_device *open_hid_device(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *usb_path, bool wait,
+                                   int64_t deadline)
 {
     hid_device *result = NULL;
 
-#ifdef WITH_UDEV
-    sdp_udev *udev = sdp_udev_init();
-    if (!udev)
-    {
-        fprintf(stderr, "ERROR: Failed to initialize udev\n");
-        goto out;
-    }
-
-#else
+#ifndef WITH_UDEV
     if (usb_path)
     {
-        fprintf(stderr, "ERROR: Filtering by path is only supported with udev support\n");
+        sdp_error("ERROR: Filtering by path is only supported with udev support\n");
         goto out;
     }
 #endif
@@ -165,90 +226,395 @@ static hid_device *open_device(uint16_t vid, uint16_t pid, const char *usb_path,
     if (!result)
     {
         if (!wait)
-            goto free_udev;
+            goto out;
 
-        printf("Waiting for device...\n");
+        sdp_info("Waiting for device...\n");
 
 #ifdef WITH_UDEV
-        const char *devpath = sdp_udev_wait(udev, vid, pid, usb_path, 20000);
+        int64_t start = sdp_trace_now();
+        char *devpath = sdp_udev_wait(udev, vid, pid, usb_path, deadline);
+        sdp_trace_span("wait_device", start);
         if (!devpath)
         {
-            fprintf(stderr, "ERROR: Timeout!\n");
-            goto free_udev;
+            sdp_error("ERROR: Timeout!\n");
+            goto out;
         }
+        start = sdp_trace_now();
         result = hid_open_path(devpath);
+        sdp_trace_span("hid_open_path", start);
         if (!result)
-            fprintf(stderr, "ERROR: Failed to open device: %ls\n", hid_error(result));
+            sdp_error("ERROR: Failed to open device: %ls\n", hid_error(result));
+        free(devpath);
 #else
+        int64_t start = sdp_trace_now();
         do
         {
             usleep(500000ul); // 500ms
             result = hid_open(vid, pid, NULL);
-        } while (!result);
+        } while (!result && !sdp_deadline_expired(deadline));
+        sdp_trace_span("wait_device", start);
+        if (!result)
+            sdp_error("ERROR: Timeout!\n");
 #endif
     }
 
-free_udev:
-#ifdef WITH_UDEV
-    sdp_udev_free(udev);
 out:
-#endif
 
     return result;
 }
 
-int sdp_execute_stages(sdp_stages *stages, bool initial_wait, const char *usb_path)
+#ifdef WITH_URING
+static sdp_transport *open_uring_device(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *usb_path, bool wait,
+                                        int64_t deadline)
 {
-    int res = hid_init();
-    if (res)
-        fprintf(stderr, "ERROR: hidapi init failed\n");
+    sdp_transport *result = NULL;
+    int64_t start = sdp_trace_now();
+    sdp_udev_update(udev);
+    char *devnode = sdp_udev_find(udev, vid, pid, usb_path);
+    sdp_trace_span("find_device", start);
+    if (!devnode && wait)
+    {
+        sdp_info("Waiting for device...\n");
+        start = sdp_trace_now();
+        devnode = sdp_udev_wait(udev, vid, pid, usb_path, deadline);
+        sdp_trace_span("wait_device", start);
+        if (!devnode)
+            sdp_error("ERROR: Timeout!\n");
+    }
+    else if (!devnode)
+        sdp_error("ERROR: No matching device found\n");
+
+    if (devnode)
+        result = sdp_uring_open(devnode);
+
+    free(devnode);
+    return result;
+}
+#endif
+
+/* Wait for the device until deadline at most */
+static sdp_transport *open_device(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *usb_path, bool wait,
+                                  int64_t deadline)
+{
+#ifdef WITH_EMULATOR
+    if (sdp_emu_enabled())
+        return sdp_emu_open(vid, pid, usb_path, wait, deadline);
+#endif
+
+#ifdef WITH_URING
+    if (sdp_uring_enabled())
+        return open_uring_device(udev, vid, pid, usb_path, wait, deadline);
+#endif
+
+#ifdef WITH_LIBUSB
+    sdp_transport *transport = NULL;
+    int found = -1;
+    if (sdp_libusb_enabled())
+    {
+        found = sdp_libusb_open(vid, pid, usb_path, &transport);
+        if (!found)
+            return transport;
+    }
+#endif
+
+    hid_device *result = open_hid_device(udev, vid, pid, usb_path, wait, deadline);
+
+#ifdef WITH_LIBUSB
+    /* The device only showed up while waiting, now libusb can have it */
+    if (result && found < 0)
+    {
+        hid_close(result);
+        if (!sdp_libusb_open(vid, pid, usb_path, &transport))
+            return transport;
+        result = open_hid_device(udev, vid, pid, usb_path, true, deadline);
+    }
+#endif
+
+    return result ? sdp_hidapi_transport(result) : NULL;
+}
+
+int sdp_exit_code(int stage, enum sdp_failure failure)
+{
+    return (stage < SDP_MAX_EXIT_STAGE ? stage : SDP_MAX_EXIT_STAGE) * 16 + failure;
+}
+
+int sdp_execute_stages(const sdp_stages *stages, bool initial_wait, const char *usb_path,
+                       const atomic_bool *cancel)
+{
+    if (sdp_hidapi_init())
+        return 1;
+#ifdef WITH_LIBUSB
+    /* Share the libusb context between the stages, it's optional */
+    bool libusb = sdp_libusb_enabled() && !sdp_libusb_init();
+#endif
+    int res = 0;
+    int64_t run_start = sdp_trace_now();
+    sdp_trace_set_track(usb_path ? usb_path : "device");
+    sdp_metrics_set_board(usb_path ? usb_path : "");
 
+    sdp_udev *udev = NULL;
+#ifdef WITH_UDEV
+    /*
+     * A single monitor and device index for the whole run, so that the next
+     * stage's device is found even if it shows up before that stage starts
+     * looking for it.
+     */
+    if (!(udev = sdp_udev_init()))
+    {
+        sdp_error("ERROR: Failed to initialize udev\n");
+        res = 1;
+    }
+#endif
+
+    const struct sdp_timeouts *timeouts = sdp_timeouts();
+    int64_t run_deadline = sdp_deadline_after(timeouts->run_ms);
     for (int i = 0; !res && i < stages->count; ++i)
     {
-        struct stage *stage = stages->stages + i;
-        printf("[Stage %d/%d] VID=0x%04x PID=0x%04x\n", i + 1, stages->count, stage->usb_vid, stage->usb_pid);
+        const struct stage *stage = stages->stages + i;
+        sdp_metrics_set_stage(i + 1, stage->usb_vid, stage->usb_pid);
+        if (cancel && atomic_load(cancel))
+        {
+            sdp_metrics_failure();
+            sdp_error("ERROR: Cancelled before stage %d\n", i + 1);
+            res = sdp_exit_code(i + 1, SDP_FAILED_STAGE);
+            break;
+        }
+        sdp_progress_stage(i + 1, stages->count);
+        sdp_info("[Stage %d/%d] VID=0x%04x PID=0x%04x%s\n", i + 1, stages->count, stage->usb_vid,
+                 stage->usb_pid, stage->stream ? " (SDPS)" : "");
 
+        /* The stage's budget includes waiting for its device */
+        int64_t deadline = sdp_deadline_min(run_deadline, sdp_deadline_after(timeouts->stage_ms));
         bool wait = initial_wait || (i > 0);
-        hid_device *handle = open_device(stage->usb_vid, stage->usb_pid, usb_path, wait);
+        int64_t start = sdp_trace_now();
+        sdp_transport *handle = open_device(udev, stage->usb_vid, stage->usb_pid, usb_path, wait,
+                                            sdp_deadline_min(deadline, sdp_deadline_after(timeouts->device_ms)));
+        sdp_trace_span("open_device", start);
         if (!handle)
         {
-            res = 1;
+            sdp_metrics_failure();
+            res = sdp_exit_code(i + 1, sdp_deadline_expired(deadline) ? SDP_FAILED_DEADLINE : SDP_FAILED_DEVICE);
             break;
         }
 
-        uint32_t hab_status, status;
-        res = sdp_error_status(handle, &hab_status, &status);
+        sdp_transport_set_deadline(handle, deadline);
+        if (sdp_run_stage(stages, i, handle, cancel))
+            res = sdp_exit_code(i + 1, sdp_deadline_expired(deadline) ? SDP_FAILED_DEADLINE : SDP_FAILED_STAGE);
+
+        sdp_transport_close(handle);
+    }
+
+#ifdef WITH_UDEV
+    if (udev)
+        sdp_udev_free(udev);
+#endif
+#ifdef WITH_LIBUSB
+    if (libusb)
+        sdp_libusb_exit();
+#endif
+    sdp_hidapi_exit();
+
+    if (!res)
+        sdp_info("All stages done\n");
+    sdp_metrics_boot(!res, (sdp_trace_now() - run_start) / 1e6);
+
+    return res;
+}
+
+static int prepare_stage(sdp_stages *stages, int index)
+{
+    int n = 1;
+    for (sdp_step *step = stages->stages[index].steps; step; step = sdp_next_step(step), ++n)
+    {
+        if (sdp_prepare_step(step))
+        {
+            sdp_error("ERROR: Failed to prepare step %d of stage %d\n", n, index + 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void prefetch_stages(sdp_stages *stages)
+{
+    struct prefetch *prefetch = stages->prefetch;
+    for (int i = prefetch->ready; i < stages->count && !atomic_load(&prefetch->stop); ++i)
+    {
+        int64_t start = sdp_trace_now();
+        int res = prepare_stage(stages, i);
+        sdp_trace_span("prefetch", start);
         if (res)
             break;
+        pthread_mutex_lock(&prefetch->lock);
+        prefetch->ready = i + 1;
+        pthread_cond_broadcast(&prefetch->cond);
+        pthread_mutex_unlock(&prefetch->lock);
+    }
+
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->finished = true;
+    pthread_cond_broadcast(&prefetch->cond);
+    pthread_mutex_unlock(&prefetch->lock);
+}
 
-        if (sdp_execute_steps(handle, stage->steps))
+static void *prefetch_thread(void *arg)
+{
+    sdp_trace_set_track("prefetch");
+    prefetch_stages(arg);
+    return NULL;
+}
+
+int sdp_compile_stages(sdp_stages *stages, bool background)
+{
+    for (int i = 0; i < stages->count; ++i)
+    {
+        int n = 1;
+        for (sdp_step *step = stages->stages[i].steps; step; step = sdp_next_step(step), ++n)
         {
-            fprintf(stderr, "ERROR: Failed to execute stage %d\n", i + 1);
-            res = 1;
+            if (sdp_compile_step(step))
+            {
+                sdp_error("ERROR: Failed to prepare step %d of stage %d\n", n, i + 1);
+                return 1;
+            }
         }
+    }
+
+    struct prefetch *prefetch = calloc(1, sizeof(struct prefetch));
+    if (!prefetch)
+    {
+        sdp_error("ERROR: Allocation failed\n");
+        return 1;
+    }
+    atomic_init(&prefetch->stop, false);
+    pthread_mutex_init(&prefetch->lock, NULL);
+    pthread_cond_init(&prefetch->cond, NULL);
+    stages->prefetch = prefetch;
+
+    /* The first stage is needed as soon as its device is there */
+    if (prepare_stage(stages, 0))
+    {
+        prefetch->finished = true;
+        return 1;
+    }
+    prefetch->ready = 1;
+    if (stages->count == 1)
+    {
+        prefetch->finished = true;
+        return 0;
+    }
+    if (!background)
+    {
+        prefetch_stages(stages);
+        return prefetch->ready < stages->count;
+    }
+
+    int res = pthread_create(&prefetch->thread, NULL, prefetch_thread, stages);
+    if (res)
+    {
+        /* Do it right away then */
+        sdp_error("ERROR: Failed to start prefetching: %s\n", strerror(res));
+        prefetch_stages(stages);
+    }
+    else
+        prefetch->running = true;
+    return 0;
+}
 
-        hid_close(handle);
+/* Wait until stage index is prepared, returns non-zero if it can't be */
+static int wait_prepared(const sdp_stages *stages, int index)
+{
+    struct prefetch *prefetch = stages->prefetch;
+    if (!prefetch)
+        return 0;
+
+    int64_t start = sdp_trace_now();
+    pthread_mutex_lock(&prefetch->lock);
+    bool waited = false;
+    while (prefetch->ready <= index && !prefetch->finished)
+    {
+        pthread_cond_wait(&prefetch->cond, &prefetch->lock);
+        waited = true;
     }
+    int res = prefetch->ready <= index;
+    pthread_mutex_unlock(&prefetch->lock);
+    if (waited)
+        sdp_trace_span("wait_prefetch", start);
+    return res;
+}
 
-    if (hid_exit())
-        fprintf(stderr, "ERROR: hidapi exit failed\n");
+int sdp_prepare_stages(const sdp_stages *stages)
+{
+    return wait_prepared(stages, stages->count - 1);
+}
 
-    if (!res)
-        printf("All stages done\n");
+int sdp_stages_foreach_image(const sdp_stages *stages, sdp_image_callback callback, void *arg)
+{
+    for (int i = 0; i < stages->count; ++i)
+    {
+        for (sdp_step *step = stages->stages[i].steps; step; step = sdp_next_step(step))
+        {
+            const sdp_image *image = sdp_step_image(step);
+            if (image && callback(image, arg))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+int sdp_stages_count(const sdp_stages *stages)
+{
+    return stages->count;
+}
+
+void sdp_stage_usb_id(const sdp_stages *stages, int index, uint16_t *vid, uint16_t *pid)
+{
+    *vid = stages->stages[index].usb_vid;
+    *pid = stages->stages[index].usb_pid;
+}
 
+int sdp_run_stage(const sdp_stages *stages, int index, sdp_transport *handle, const atomic_bool *cancel)
+{
+    int64_t start = sdp_trace_now();
+    const struct stage *stage = stages->stages + index;
+    uint32_t hab_status, status;
+    int res = wait_prepared(stages, index);
+    if (res)
+        sdp_error("ERROR: Stage %d couldn't be prepared\n", index + 1);
+    /* SDPS has no ERROR_STATUS */
+    else if (!stage->stream)
+        res = sdp_error_status(handle, &hab_status, &status);
+    if (!res && sdp_execute_steps(handle, stage->steps, cancel))
+    {
+        sdp_error("ERROR: Failed to execute stage %d\n", index + 1);
+        res = 1;
+    }
+    sdp_trace_span("stage", start);
+    sdp_metrics_stage(start);
+    if (res)
+        sdp_metrics_failure();
     return res;
 }
 
 void sdp_free_stages(sdp_stages *stages)
 {
+    struct prefetch *prefetch = stages->prefetch;
+    if (prefetch)
+    {
+        atomic_store(&prefetch->stop, true);
+        if (prefetch->running)
+            pthread_join(prefetch->thread, NULL);
+        pthread_cond_destroy(&prefetch->cond);
+        pthread_mutex_destroy(&prefetch->lock);
+        free(prefetch);
+    }
     for (int i = 0; i < stages->count; ++i)
     {
         sdp_step *s = stages->stages[i].steps;
         while (s)
         {
-            void *const to_be_freed = s;
+            sdp_step *const to_be_freed = s;
             s = sdp_next_step(s);
-            free(to_be_freed);
+            sdp_free_step(to_be_freed);
         }
     }
     free(stages);
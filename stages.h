@@ -1,13 +1,60 @@
 #ifndef STAGES_H_
 #define STAGES_H_
 
+#include "image.h"
+#include "transport.h"
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 struct sdp_stages_;
 typedef struct sdp_stages_ sdp_stages;
 
 sdp_stages *sdp_parse_stages(int count, char *s[]);
-int sdp_execute_stages(sdp_stages *stages, bool initial_wait, const char *usb_path);
+/*
+ * Compile every step, see sdp_compile_step(). The steps of the first stage
+ * are prepared right away, those of the later stages on a background thread
+ * while the boards boot through the earlier ones if background is set.
+ * sdp_run_stage() waits for its stage, sdp_prepare_stages() for all of them,
+ * both return non-zero if preparing failed. The background thread logs
+ * without the handler of the caller, see log.h.
+ */
+int sdp_compile_stages(sdp_stages *stages, bool background);
+int sdp_prepare_stages(const sdp_stages *stages);
+/*
+ * Why a stage failed. The exit code of a boot tells the stage and the reason
+ * apart: 16 * stage (counting from 1, at most SDP_MAX_EXIT_STAGE) + reason.
+ */
+enum sdp_failure
+{
+    /* The stage's device didn't show up or couldn't be opened */
+    SDP_FAILED_DEVICE = 1,
+    /* A step failed or the boot was cancelled */
+    SDP_FAILED_STAGE = 2,
+    /* The stage's time budget or that of the whole boot ran out */
+    SDP_FAILED_DEADLINE = 3,
+};
+
+#define SDP_MAX_EXIT_STAGE 15
+
+int sdp_exit_code(int stage, enum sdp_failure failure);
+
+/*
+ * Boot one board, cancel is checked before every stage and step if given.
+ * Returns 0 on success, 1 if the boot couldn't be started at all or the exit
+ * code of the stage that failed.
+ */
+int sdp_execute_stages(const sdp_stages *stages, bool initial_wait, const char *usb_path,
+                       const atomic_bool *cancel);
 void sdp_free_stages(sdp_stages *stages);
 
+/* Return non-zero from the callback to stop, which is then returned */
+typedef int (*sdp_image_callback)(const sdp_image *image, void *arg);
+/* Call callback for the image of every compiled step, in order */
+int sdp_stages_foreach_image(const sdp_stages *stages, sdp_image_callback callback, void *arg);
+
+int sdp_stages_count(const sdp_stages *stages);
+void sdp_stage_usb_id(const sdp_stages *stages, int index, uint16_t *vid, uint16_t *pid);
+int sdp_run_stage(const sdp_stages *stages, int index, sdp_transport *handle, const atomic_bool *cancel);
+
 #endif
@@ -1,41 +1,208 @@
 #include "steps.h"
+#include "ivt.h"
+#include "log.h"
+#include "metrics.h"
+#include "progress.h"
 #include "sdp.h"
+#include <stdbool.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* Scratch area in OCRAM that imx_usb_loader also uses on the i.MX6 and i.MX7 */
+#define DEFAULT_DCD_ADDRESS 0x00910000
+
 union step_run_data
 {
 	struct
 	{
 		const char *file_path;
 		uint32_t address;
+		const sdp_payload *payload;
 	} write_file;
 	struct
 	{
 		uint32_t address;
 	} jump_address;
+	struct
+	{
+		const char *file_path;
+		uint32_t address;
+		const sdp_image *image;
+	} dcd_write;
+	struct
+	{
+		const char *file_path;
+		bool jump;
+		const sdp_loader *loader;
+	} load_file;
+	struct
+	{
+		const char *file_path;
+		uint32_t address;
+		uint32_t samples;
+		const sdp_payload *payload;
+	} verify_file;
+	struct
+	{
+		uint32_t address;
+		uint32_t size;
+		const char *file_path;
+	} read_memory;
+	struct
+	{
+		const char *file_path;
+		const sdp_payload *payload;
+	} stream_file;
+	struct
+	{
+		const char *file_path;
+		const sdp_script *script;
+	} register_script;
 };
 
 struct sdp_step_
 {
-	int (*exec)(hid_device *, const union step_run_data *);
+	int (*exec)(sdp_transport *, const union step_run_data *);
+	/* Load and check everything exec needs, NULL if there is nothing */
+	int (*compile)(struct sdp_step_ *);
+	/* Build the data reports of the compiled files, NULL if there are none */
+	int (*prepare)(struct sdp_step_ *);
 	union step_run_data data;
+	/* Owned by the step once compiled, the run data points to them */
+	sdp_image *image;
+	sdp_payload *payload;
+	sdp_loader *loader;
+	sdp_script *script;
 	struct sdp_step_ *next;
 };
 
-static int exec_write_file(hid_device *handle, const union step_run_data *data)
+static int exec_write_file(sdp_transport *handle, const union step_run_data *data)
 {
-	return sdp_write_file(handle, data->write_file.file_path,
-						  data->write_file.address);
+	return sdp_write_payload(handle, data->write_file.payload, data->write_file.address);
 }
 
-static int exec_jump_address(hid_device *handle, const union step_run_data *data)
+static int exec_jump_address(sdp_transport *handle, const union step_run_data *data)
 {
 	return sdp_jump_address(handle, data->jump_address.address);
 }
 
+static int exec_dcd_write(sdp_transport *handle, const union step_run_data *data)
+{
+	return sdp_dcd_write_image(handle, data->dcd_write.image, data->dcd_write.address);
+}
+
+static int exec_skip_dcd_header(sdp_transport *handle, const union step_run_data *data)
+{
+	(void)data;
+	return sdp_skip_dcd_header(handle);
+}
+
+static int exec_load_file(sdp_transport *handle, const union step_run_data *data)
+{
+	return sdp_load(handle, data->load_file.loader, data->load_file.jump);
+}
+
+static int exec_verify_file(sdp_transport *handle, const union step_run_data *data)
+{
+	return sdp_verify_payload(handle, data->verify_file.payload, data->verify_file.address,
+							  data->verify_file.samples);
+}
+
+static int exec_read_memory(sdp_transport *handle, const union step_run_data *data)
+{
+	return sdp_read_memory(handle, data->read_memory.address, data->read_memory.size,
+						   data->read_memory.file_path);
+}
+
+static int exec_stream_file(sdp_transport *handle, const union step_run_data *data)
+{
+	return sdp_stream_payload(handle, data->stream_file.payload);
+}
+
+static int exec_register_script(sdp_transport *handle, const union step_run_data *data)
+{
+	return sdp_run_script(handle, data->register_script.script);
+}
+
+static int compile_write_file(sdp_step *step)
+{
+	return !(step->image = sdp_image_open(step->data.write_file.file_path));
+}
+
+static int prepare_write_file(sdp_step *step)
+{
+	if (!(step->payload = sdp_payload_new(step->image)))
+		return 1;
+	step->data.write_file.payload = step->payload;
+	return 0;
+}
+
+static int compile_dcd_write(sdp_step *step)
+{
+	if (!(step->image = sdp_image_open(step->data.dcd_write.file_path)))
+		return 1;
+	size_t offset, size;
+	if (sdp_find_dcd(sdp_image_data(step->image), sdp_image_size(step->image), &offset, &size) ||
+		size > SDP_MAX_DCD_SIZE)
+	{
+		sdp_error("ERROR: No valid DCD table found in \"%s\"\n", step->data.dcd_write.file_path);
+		return 1;
+	}
+	step->data.dcd_write.image = step->image;
+	return 0;
+}
+
+static int compile_load_file(sdp_step *step)
+{
+	if (!(step->image = sdp_image_open(step->data.load_file.file_path)) ||
+		!(step->loader = sdp_loader_open(step->image)))
+		return 1;
+	uint32_t entry;
+	if (step->data.load_file.jump && sdp_loader_entry(step->loader, &entry))
+	{
+		sdp_error("ERROR: \"%s\" has no entry point to jump to\n", step->data.load_file.file_path);
+		return 1;
+	}
+	step->data.load_file.loader = step->loader;
+	return 0;
+}
+
+static int compile_verify_file(sdp_step *step)
+{
+	return !(step->image = sdp_image_open(step->data.verify_file.file_path));
+}
+
+static int prepare_verify_file(sdp_step *step)
+{
+	if (!(step->payload = sdp_payload_new(step->image)))
+		return 1;
+	step->data.verify_file.payload = step->payload;
+	return 0;
+}
+
+static int compile_stream_file(sdp_step *step)
+{
+	return !(step->image = sdp_image_open(step->data.stream_file.file_path));
+}
+
+static int prepare_stream_file(sdp_step *step)
+{
+	if (!(step->payload = sdp_payload_new(step->image)))
+		return 1;
+	step->data.stream_file.payload = step->payload;
+	return 0;
+}
+
+static int compile_register_script(sdp_step *step)
+{
+	if (!(step->image = sdp_image_open(step->data.register_script.file_path)) ||
+		!(step->script = sdp_script_parse(step->image)))
+		return 1;
+	step->data.register_script.script = step->script;
+	return 0;
+}
+
 static int parse_uint32(const char *s, uint32_t *value)
 {
 	char *end;
@@ -46,23 +213,28 @@ static int parse_uint32(const char *s, uint32_t *value)
 	return 0;
 }
 
-sdp_step *sdp_parse_step(char *s)
+sdp_step *sdp_parse_step(char *s, bool stream)
 {
 	char *saveptr = NULL;
 	const char *tok = strtok_r(s, ":", &saveptr);
 	if (!tok)
 	{
-		fprintf(stderr, "ERROR: Missing step command\n");
+		sdp_error("ERROR: Missing step command\n");
+		return NULL;
+	}
+	/* An SDPS ROM only takes the boot container, an SDP ROM needs addresses */
+	if (stream != !strcmp(tok, "stream_file"))
+	{
+		sdp_error("ERROR: Step \"%s\" isn't available in %s stages\n", tok, stream ? "SDPS" : "SDP");
 		return NULL;
 	}
 
-	sdp_step *result = malloc(sizeof(sdp_step));
+	sdp_step *result = calloc(1, sizeof(sdp_step));
 	if (!result)
 	{
-		fprintf(stderr, "ERROR: Allocation failed\n");
+		sdp_error("ERROR: Allocation failed\n");
 		return NULL;
 	}
-	result->next = NULL;
 
 	if (!strcmp(tok, "write_file"))
 	{
@@ -70,14 +242,16 @@ sdp_step *sdp_parse_step(char *s)
 		const char *address = strtok_r(NULL, ":", &saveptr);
 		if (!file_path || !address)
 		{
-			fprintf(stderr, "ERROR: Invalid write_file step\n");
+			sdp_error("ERROR: Invalid write_file step\n");
 			goto free_result;
 		}
 		result->exec = exec_write_file;
+		result->compile = compile_write_file;
+		result->prepare = prepare_write_file;
 		result->data.write_file.file_path = file_path;
 		if (parse_uint32(address, &result->data.write_file.address))
 		{
-			fprintf(stderr, "ERROR: Invalid write_file address\n");
+			sdp_error("ERROR: Invalid write_file address\n");
 			goto free_result;
 		}
 	}
@@ -86,19 +260,132 @@ sdp_step *sdp_parse_step(char *s)
 		const char *address = strtok_r(NULL, ":", &saveptr);
 		if (!address)
 		{
-			fprintf(stderr, "ERROR: Invalid jump_address step\n");
+			sdp_error("ERROR: Invalid jump_address step\n");
 			goto free_result;
 		}
 		result->exec = exec_jump_address;
 		if (parse_uint32(address, &result->data.jump_address.address))
 		{
-			fprintf(stderr, "ERROR: Invalid jump_address address\n");
+			sdp_error("ERROR: Invalid jump_address address\n");
+			goto free_result;
+		}
+	}
+	else if (!strcmp(tok, "dcd_write"))
+	{
+		const char *file_path = strtok_r(NULL, ":", &saveptr);
+		const char *address = strtok_r(NULL, ":", &saveptr);
+		if (!file_path)
+		{
+			sdp_error("ERROR: Invalid dcd_write step\n");
+			goto free_result;
+		}
+		result->exec = exec_dcd_write;
+		result->compile = compile_dcd_write;
+		result->data.dcd_write.file_path = file_path;
+		result->data.dcd_write.address = DEFAULT_DCD_ADDRESS;
+		if (address && parse_uint32(address, &result->data.dcd_write.address))
+		{
+			sdp_error("ERROR: Invalid dcd_write address\n");
+			goto free_result;
+		}
+	}
+	else if (!strcmp(tok, "load_file"))
+	{
+		const char *file_path = strtok_r(NULL, ":", &saveptr);
+		const char *flag = strtok_r(NULL, ":", &saveptr);
+		if (!file_path || (flag && strcmp(flag, "jump")))
+		{
+			sdp_error("ERROR: Invalid load_file step\n");
 			goto free_result;
 		}
+		result->exec = exec_load_file;
+		result->compile = compile_load_file;
+		result->data.load_file.file_path = file_path;
+		result->data.load_file.jump = flag != NULL;
+	}
+	else if (!strcmp(tok, "verify_file"))
+	{
+		const char *file_path = strtok_r(NULL, ":", &saveptr);
+		const char *address = strtok_r(NULL, ":", &saveptr);
+		const char *samples = strtok_r(NULL, ":", &saveptr);
+		if (!file_path || !address)
+		{
+			sdp_error("ERROR: Invalid verify_file step\n");
+			goto free_result;
+		}
+		result->exec = exec_verify_file;
+		result->compile = compile_verify_file;
+		result->prepare = prepare_verify_file;
+		result->data.verify_file.file_path = file_path;
+		if (parse_uint32(address, &result->data.verify_file.address))
+		{
+			sdp_error("ERROR: Invalid verify_file address\n");
+			goto free_result;
+		}
+		result->data.verify_file.samples = 0;
+		if (samples)
+		{
+			char *end;
+			unsigned long ul = strtoul(samples, &end, 10);
+			if (samples == end || *end || !ul || ul > UINT32_MAX)
+			{
+				sdp_error("ERROR: Invalid verify_file sample count\n");
+				goto free_result;
+			}
+			result->data.verify_file.samples = ul;
+		}
+	}
+	else if (!strcmp(tok, "read_memory"))
+	{
+		const char *address = strtok_r(NULL, ":", &saveptr);
+		const char *size = strtok_r(NULL, ":", &saveptr);
+		const char *file_path = strtok_r(NULL, ":", &saveptr);
+		if (!address || !size || !file_path)
+		{
+			sdp_error("ERROR: Invalid read_memory step\n");
+			goto free_result;
+		}
+		result->exec = exec_read_memory;
+		result->data.read_memory.file_path = file_path;
+		if (parse_uint32(address, &result->data.read_memory.address) ||
+			parse_uint32(size, &result->data.read_memory.size) || !result->data.read_memory.size)
+		{
+			sdp_error("ERROR: Invalid read_memory address or length\n");
+			goto free_result;
+		}
+	}
+	else if (!strcmp(tok, "stream_file"))
+	{
+		const char *file_path = strtok_r(NULL, ":", &saveptr);
+		if (!file_path)
+		{
+			sdp_error("ERROR: Invalid stream_file step\n");
+			goto free_result;
+		}
+		result->exec = exec_stream_file;
+		result->compile = compile_stream_file;
+		result->prepare = prepare_stream_file;
+		result->data.stream_file.file_path = file_path;
+	}
+	else if (!strcmp(tok, "register_script"))
+	{
+		const char *file_path = strtok_r(NULL, ":", &saveptr);
+		if (!file_path)
+		{
+			sdp_error("ERROR: Invalid register_script step\n");
+			goto free_result;
+		}
+		result->exec = exec_register_script;
+		result->compile = compile_register_script;
+		result->data.register_script.file_path = file_path;
+	}
+	else if (!strcmp(tok, "skip_dcd_header"))
+	{
+		result->exec = exec_skip_dcd_header;
 	}
 	else
 	{
-		fprintf(stderr, "ERROR: Unknown step command \"%s\"\n", tok);
+		sdp_error("ERROR: Unknown step command \"%s\"\n", tok);
 		goto free_result;
 	}
 
@@ -109,14 +396,21 @@ free_result:
 	return NULL;
 }
 
-int sdp_execute_steps(hid_device *handle, sdp_step *step)
+int sdp_execute_steps(sdp_transport *handle, sdp_step *step, const atomic_bool *cancel)
 {
 	for (int i = 1; step; ++i)
 	{
-		printf("[Step %d] ", i);
+		if (cancel && atomic_load(cancel))
+		{
+			sdp_error("ERROR: Cancelled before step %d\n", i);
+			return 1;
+		}
+		sdp_progress_step(i);
+		sdp_metrics_set_step(i);
+		sdp_info("[Step %d] ", i);
 		if (step->exec(handle, &step->data))
 		{
-			fprintf(stderr, "ERROR: Failed to execute step %d\n", i);
+			sdp_error("ERROR: Failed to execute step %d\n", i);
 			return 1;
 		}
 		step = step->next;
@@ -124,6 +418,34 @@ int sdp_execute_steps(hid_device *handle, sdp_step *step)
 	return 0;
 }
 
+int sdp_compile_step(sdp_step *step)
+{
+	return step->compile ? step->compile(step) : 0;
+}
+
+int sdp_prepare_step(sdp_step *step)
+{
+	return step->prepare ? step->prepare(step) : 0;
+}
+
+const sdp_image *sdp_step_image(const sdp_step *step)
+{
+	return step->image;
+}
+
+void sdp_free_step(sdp_step *step)
+{
+	if (step->payload)
+		sdp_payload_free(step->payload);
+	if (step->loader)
+		sdp_loader_close(step->loader);
+	if (step->script)
+		sdp_script_free(step->script);
+	if (step->image)
+		sdp_image_close(step->image);
+	free(step);
+}
+
 sdp_step *sdp_next_step(sdp_step *step)
 {
 	return step->next;
@@ -1,13 +1,29 @@
 #ifndef STEPS_H_
 #define STEPS_H_
 
-#include <hidapi/hidapi.h>
+#include "image.h"
+#include "transport.h"
+#include <stdatomic.h>
+#include <stdbool.h>
 
 struct sdp_step_;
 typedef struct sdp_step_ sdp_step;
 
-sdp_step *sdp_parse_step(char *s);
-int sdp_execute_steps(hid_device *handle, sdp_step *steo);
+/* stream is set for the steps of SDPS stages, which only have stream_file */
+sdp_step *sdp_parse_step(char *s, bool stream);
+/*
+ * Open and check the files of step, so that problems show up before anything
+ * is sent, and later build its data reports from them, so that the work is
+ * done only once for any number of boards. Preparing may run on another
+ * thread than the one executing the step, but has to be finished before the
+ * step is executed. Steps with files can only be executed once prepared.
+ */
+int sdp_compile_step(sdp_step *step);
+int sdp_prepare_step(sdp_step *step);
+/* The image of a compiled step, or NULL */
+const sdp_image *sdp_step_image(const sdp_step *step);
+void sdp_free_step(sdp_step *step);
+int sdp_execute_steps(sdp_transport *handle, sdp_step *step, const atomic_bool *cancel);
 sdp_step *sdp_next_step(sdp_step *step);
 void sdp_set_next_step(sdp_step *step, sdp_step *next);
 
@@ -0,0 +1,164 @@
+#include "trace.h"
+#include "log.h"
+#include "metrics.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAIN_TRACK "imx-sdp"
+
+static FILE *trace_file;
+static int64_t trace_start;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static char **tracks;
+static int track_count;
+
+/* Track of the calling thread, -1 for the main track */
+static __thread int thread_track = -1;
+
+int64_t sdp_trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void write_string(const char *s)
+{
+    fputc('"', trace_file);
+    for (; *s; ++s)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf(trace_file, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(trace_file, "\\u%04x", *s);
+        else
+            fputc(*s, trace_file);
+    }
+    fputc('"', trace_file);
+}
+
+static void write_track_name(int tid, const char *name)
+{
+    fprintf(trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+            (int)getpid(), tid);
+    write_string(name);
+    fputs("}},\n", trace_file);
+}
+
+int sdp_trace_init(const char *path)
+{
+    sdp_trace_cleanup();
+    trace_file = fopen(path, "w");
+    if (!trace_file)
+    {
+        sdp_error("ERROR: Failed to open trace file \"%s\": %s\n", path, strerror(errno));
+        return 1;
+    }
+    trace_start = sdp_trace_now();
+
+    /* Track IDs start at 1, the main track is 0 */
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", trace_file);
+    write_track_name(0, MAIN_TRACK);
+    return 0;
+}
+
+/* Must be called with trace_lock held */
+static int find_track(const char *name)
+{
+    for (int i = 0; i < track_count; ++i)
+    {
+        if (!strcmp(tracks[i], name))
+            return i;
+    }
+    char **p = realloc(tracks, (track_count + 1) * sizeof(*tracks));
+    if (!p)
+        return -1;
+    tracks = p;
+    if (!(tracks[track_count] = strdup(name)))
+        return -1;
+    write_track_name(track_count + 1, name);
+    return track_count++;
+}
+
+void sdp_trace_set_track(const char *name)
+{
+    if (!trace_file)
+        return;
+    pthread_mutex_lock(&trace_lock);
+    thread_track = find_track(name);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * Events are written as they are recorded so a long running daemon doesn't
+ * accumulate them. Must be called with trace_lock held.
+ */
+static void add_event(int track, const char *name, int64_t start, int64_t end, bool has_bytes, uint64_t bytes)
+{
+    int64_t duration = end - start;
+    fprintf(trace_file,
+            "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%" PRId64 ",\"dur\":%" PRId64,
+            name, (int)getpid(), track + 1, start - trace_start, duration);
+    if (has_bytes)
+        fprintf(trace_file, ",\"args\":{\"bytes\":%" PRIu64 ",\"bytes_per_s\":%.0f}", bytes,
+                duration > 0 ? bytes * 1e6 / duration : 0.0);
+    fputs("},\n", trace_file);
+}
+
+void sdp_trace_span(const char *name, int64_t start)
+{
+    int64_t end = sdp_trace_now();
+    sdp_metrics_phase(name, start, end);
+    if (!trace_file)
+        return;
+    pthread_mutex_lock(&trace_lock);
+    add_event(thread_track, name, start, end, false, 0);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void sdp_trace_transfer(const char *name, int64_t start, uint64_t bytes)
+{
+    int64_t end = sdp_trace_now();
+    sdp_metrics_phase(name, start, end);
+    if (!trace_file)
+        return;
+    pthread_mutex_lock(&trace_lock);
+    add_event(thread_track, name, start, end, true, bytes);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void sdp_trace_track_span(const char *track, const char *name, int64_t start, int64_t end)
+{
+    if (!trace_file)
+        return;
+    pthread_mutex_lock(&trace_lock);
+    add_event(find_track(track), name, start, end, false, 0);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void sdp_trace_cleanup(void)
+{
+    if (!trace_file)
+        return;
+
+    /* A closing event without a trailing comma, which also marks the end of the run */
+    fprintf(trace_file, "{\"name\":\"exit\",\"ph\":\"i\",\"s\":\"p\",\"pid\":%d,\"tid\":0,\"ts\":%" PRId64 "}\n]}\n",
+            (int)getpid(), sdp_trace_now() - trace_start);
+
+    if (fclose(trace_file))
+        sdp_error("ERROR: Failed to write trace file: %s\n", strerror(errno));
+    trace_file = NULL;
+
+    for (int i = 0; i < track_count; ++i)
+        free(tracks[i]);
+    free(tracks);
+    tracks = NULL;
+    track_count = 0;
+}
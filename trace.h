@@ -0,0 +1,33 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Record the duration of boot phases and write them to path in the Chrome
+ * trace event format as they end, for chrome://tracing or Perfetto.
+ * sdp_trace_cleanup() terminates the file. Every device gets a track of
+ * its own. Spans also feed the phase histograms of metrics.h. Without
+ * either, recording a span only costs a clock read.
+ */
+int sdp_trace_init(const char *path);
+void sdp_trace_cleanup(void);
+
+/* Microseconds on the monotonic clock, the start of a span */
+int64_t sdp_trace_now(void);
+
+/* Put the spans of the calling thread on the track called name */
+void sdp_trace_set_track(const char *name);
+
+/*
+ * Record a span from start until now on the track of the calling thread.
+ * The name has to be a string constant. sdp_trace_transfer() also records
+ * the number of bytes transferred and the resulting rate.
+ */
+void sdp_trace_span(const char *name, int64_t start);
+void sdp_trace_transfer(const char *name, int64_t start, uint64_t bytes);
+
+/* Record a span from start until end on the named track */
+void sdp_trace_track_span(const char *track, const char *name, int64_t start, int64_t end);
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <hidapi/hidapi.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+/*
+ * A transport moves raw HID reports (report ID in the first byte) between
+ * the SDP protocol code and a device. The return values follow hidapi: the
+ * number of bytes transferred, 0 on read timeout or -1 on error.
+ */
+
+struct sdp_transport_;
+typedef struct sdp_transport_ sdp_transport;
+
+struct sdp_route;
+
+/* Input reports hidraw keeps for each open file until they are read */
+#define SDP_HIDRAW_BUFFER_SIZE 64
+
+struct sdp_transport_ops
+{
+    int (*write)(sdp_transport *transport, const unsigned char *data, size_t length);
+    int (*read)(sdp_transport *transport, unsigned char *data, size_t length, int timeout);
+    const wchar_t *(*error)(sdp_transport *transport);
+    void (*close)(sdp_transport *transport);
+    /*
+     * Wait until every report written so far has reached the device, -1 if
+     * one of them didn't. NULL if write() only returns once it has.
+     */
+    int (*flush)(sdp_transport *transport);
+};
+
+struct sdp_transport_
+{
+    const struct sdp_transport_ops *ops;
+    /* Every exchange with the device fails once this has passed, see deadline.h */
+    int64_t deadline;
+    /* Bandwidth the transfers share with other boards, NULL if unscheduled */
+    const struct sdp_route *route;
+    /*
+     * Input reports taken off the device and kept until they are read, 0 if
+     * the device has to hold each one until then. Bounds the replies that
+     * pipelined commands may leave waiting.
+     */
+    unsigned input_buffer;
+};
+
+static inline int sdp_transport_write(sdp_transport *transport, const unsigned char *data, size_t length)
+{
+    return transport->ops->write(transport, data, length);
+}
+
+static inline int sdp_transport_read(sdp_transport *transport, unsigned char *data, size_t length, int timeout)
+{
+    return transport->ops->read(transport, data, length, timeout);
+}
+
+static inline int sdp_transport_flush(sdp_transport *transport)
+{
+    return transport->ops->flush ? transport->ops->flush(transport) : 0;
+}
+
+static inline const wchar_t *sdp_transport_error(sdp_transport *transport)
+{
+    return transport->ops->error(transport);
+}
+
+static inline void sdp_transport_close(sdp_transport *transport)
+{
+    transport->ops->close(transport);
+}
+
+static inline void sdp_transport_set_deadline(sdp_transport *transport, int64_t deadline)
+{
+    transport->deadline = deadline;
+}
+
+static inline void sdp_transport_set_route(sdp_transport *transport, const struct sdp_route *route)
+{
+    transport->route = route;
+}
+
+/*
+ * hid_init() and hid_exit() for code that may run next to other users of
+ * hidapi in the same process, hidapi is only shut down by the last caller
+ */
+int sdp_hidapi_init(void);
+void sdp_hidapi_exit(void);
+
+/* Takes ownership of handle, which is closed if wrapping fails */
+sdp_transport *sdp_hidapi_transport(hid_device *handle);
+
+#endif
@@ -0,0 +1,84 @@
+#include "transport.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+struct hidapi_transport
+{
+    sdp_transport base;
+    hid_device *handle;
+};
+
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static int init_count;
+
+int sdp_hidapi_init(void)
+{
+    int res = 0;
+    pthread_mutex_lock(&init_lock);
+    if (!init_count)
+        res = hid_init();
+    if (!res)
+        ++init_count;
+    pthread_mutex_unlock(&init_lock);
+    if (res)
+        sdp_error("ERROR: hidapi init failed\n");
+    return res;
+}
+
+void sdp_hidapi_exit(void)
+{
+    pthread_mutex_lock(&init_lock);
+    if (!--init_count && hid_exit())
+        sdp_error("ERROR: hidapi exit failed\n");
+    pthread_mutex_unlock(&init_lock);
+}
+
+static int hidapi_write(sdp_transport *transport, const unsigned char *data, size_t length)
+{
+    struct hidapi_transport *t = (struct hidapi_transport *)transport;
+    return hid_write(t->handle, data, length);
+}
+
+static int hidapi_read(sdp_transport *transport, unsigned char *data, size_t length, int timeout)
+{
+    struct hidapi_transport *t = (struct hidapi_transport *)transport;
+    return hid_read_timeout(t->handle, data, length, timeout);
+}
+
+static const wchar_t *hidapi_error(sdp_transport *transport)
+{
+    struct hidapi_transport *t = (struct hidapi_transport *)transport;
+    return hid_error(t->handle);
+}
+
+static void hidapi_close(sdp_transport *transport)
+{
+    struct hidapi_transport *t = (struct hidapi_transport *)transport;
+    hid_close(t->handle);
+    free(t);
+}
+
+static const struct sdp_transport_ops hidapi_ops = {
+    .write = hidapi_write,
+    .read = hidapi_read,
+    .error = hidapi_error,
+    .close = hidapi_close,
+};
+
+sdp_transport *sdp_hidapi_transport(hid_device *handle)
+{
+    struct hidapi_transport *t = malloc(sizeof(struct hidapi_transport));
+    if (!t)
+    {
+        sdp_error("ERROR: Failed to allocate transport\n");
+        hid_close(handle);
+        return NULL;
+    }
+    t->base.ops = &hidapi_ops;
+    t->base.deadline = 0;
+    t->base.route = NULL;
+    t->base.input_buffer = SDP_HIDRAW_BUFFER_SIZE;
+    t->handle = handle;
+    return &t->base;
+}
@@ -0,0 +1,456 @@
+#include "transport_libusb.h"
+#include "log.h"
+#include <libusb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRANSFER_TIMEOUT_MS 5000
+#define MAX_REPORT_SIZE 1025
+#define HID_SET_REPORT 0x09
+#define HID_REPORT_TYPE_OUTPUT 0x02
+
+struct slot
+{
+    struct usb_transport *owner;
+    struct libusb_transfer *transfer;
+    bool busy;
+    unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + MAX_REPORT_SIZE];
+};
+
+struct usb_transport
+{
+    sdp_transport base;
+    libusb_device_handle *handle;
+    int interface;
+    bool detached;
+    unsigned char ep_in;
+    /* Without an interrupt OUT endpoint, reports go out as SET_REPORT requests */
+    unsigned char ep_out;
+
+    /* An asynchronous transfer failed, reported by the next write, read or flush */
+    bool failed;
+    wchar_t error[128];
+
+    /*
+     * Completions run on whichever thread handles the events of the shared
+     * context, the count is updated last so the owner sees the rest.
+     */
+    atomic_int in_flight;
+    int depth;
+    struct slot slots[];
+};
+
+static int queue_depth;
+
+static pthread_mutex_t context_lock = PTHREAD_MUTEX_INITIALIZER;
+static libusb_context *context;
+static int context_users;
+
+void sdp_libusb_configure(int depth)
+{
+    queue_depth = depth > SDP_LIBUSB_MAX_DEPTH ? SDP_LIBUSB_MAX_DEPTH : depth;
+}
+
+bool sdp_libusb_enabled(void)
+{
+    return queue_depth > 0;
+}
+
+int sdp_libusb_init(void)
+{
+    int res = 0;
+    pthread_mutex_lock(&context_lock);
+    if (!context_users)
+        res = libusb_init(&context);
+    if (!res)
+        ++context_users;
+    pthread_mutex_unlock(&context_lock);
+    if (res)
+        sdp_info("Can't initialize libusb (%s), falling back to hidapi\n", libusb_error_name(res));
+    return res;
+}
+
+void sdp_libusb_exit(void)
+{
+    pthread_mutex_lock(&context_lock);
+    if (!--context_users)
+    {
+        libusb_exit(context);
+        context = NULL;
+    }
+    pthread_mutex_unlock(&context_lock);
+}
+
+static void set_error(struct usb_transport *t, const char *what, const char *why)
+{
+    swprintf(t->error, sizeof(t->error) / sizeof(t->error[0]), L"%s: %s", what, why);
+}
+
+static const char *status_name(enum libusb_transfer_status status)
+{
+    switch (status)
+    {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return "short transfer";
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return "timed out";
+    case LIBUSB_TRANSFER_CANCELLED:
+        return "cancelled";
+    case LIBUSB_TRANSFER_STALL:
+        return "stalled";
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return "device disconnected";
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return "overflow";
+    default:
+        return "transfer error";
+    }
+}
+
+static void transfer_done(struct libusb_transfer *transfer)
+{
+    struct slot *slot = transfer->user_data;
+    struct usb_transport *t = slot->owner;
+
+    int expected = transfer->length;
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+        expected -= LIBUSB_CONTROL_SETUP_SIZE;
+    if (!t->failed && (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != expected))
+    {
+        set_error(t, "Data transfer failed", status_name(transfer->status));
+        t->failed = true;
+    }
+    slot->busy = false;
+    atomic_fetch_sub(&t->in_flight, 1);
+}
+
+static int handle_events(struct usb_transport *t, int limit)
+{
+    while (t->in_flight > limit)
+    {
+        struct timeval tv = {.tv_sec = 1};
+        int res = libusb_handle_events_timeout_completed(context, &tv, NULL);
+        if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED)
+        {
+            set_error(t, "Failed to handle USB events", libusb_error_name(res));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Handle completions until at most limit transfers are in flight. A failed
+ * transfer is reported once, after the rest of the queue has finished, so
+ * that the caller can resume from a clean state.
+ */
+static int drain(struct usb_transport *t, int limit)
+{
+    if (handle_events(t, limit))
+        return -1;
+    if (!t->failed)
+        return 0;
+    if (handle_events(t, 0))
+        return -1;
+    t->failed = false;
+    return -1;
+}
+
+static int submit(struct usb_transport *t, const unsigned char *data, size_t length)
+{
+    struct slot *slot = NULL;
+    for (int i = 0; !slot && i < t->depth; ++i)
+    {
+        if (!t->slots[i].busy)
+            slot = t->slots + i;
+    }
+    if (!slot || length > MAX_REPORT_SIZE)
+    {
+        set_error(t, "Failed to submit transfer", slot ? "report too large" : "queue full");
+        return -1;
+    }
+
+    if (t->ep_out)
+    {
+        memcpy(slot->buffer, data, length);
+        libusb_fill_interrupt_transfer(slot->transfer, t->handle, t->ep_out, slot->buffer, length,
+                                       transfer_done, slot, TRANSFER_TIMEOUT_MS);
+    }
+    else
+    {
+        libusb_fill_control_setup(slot->buffer,
+                                  LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+                                  HID_SET_REPORT, HID_REPORT_TYPE_OUTPUT << 8 | data[0], t->interface, length);
+        memcpy(slot->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+        libusb_fill_control_transfer(slot->transfer, t->handle, slot->buffer, transfer_done, slot,
+                                     TRANSFER_TIMEOUT_MS);
+    }
+
+    int res = libusb_submit_transfer(slot->transfer);
+    if (res < 0)
+    {
+        set_error(t, "Failed to submit transfer", libusb_error_name(res));
+        return -1;
+    }
+    slot->busy = true;
+    atomic_fetch_add(&t->in_flight, 1);
+    return 0;
+}
+
+static int usb_write(sdp_transport *transport, const unsigned char *data, size_t length)
+{
+    struct usb_transport *t = (struct usb_transport *)transport;
+    if (!length)
+        return -1;
+
+    /* Data reports are queued, everything else waits until they are out */
+    if (data[0] == 2)
+    {
+        if (drain(t, t->depth - 1) || submit(t, data, length))
+            return -1;
+    }
+    else if (drain(t, 0) || submit(t, data, length) || drain(t, 0))
+        return -1;
+    return length;
+}
+
+static int usb_read(sdp_transport *transport, unsigned char *data, size_t length, int timeout)
+{
+    struct usb_transport *t = (struct usb_transport *)transport;
+    if (drain(t, 0))
+        return -1;
+
+    /* libusb waits forever on a timeout of 0 */
+    unsigned int ms = timeout < 0 ? 0 : timeout ? timeout : 1;
+    int actual = 0;
+    int res = libusb_interrupt_transfer(t->handle, t->ep_in, data, length, &actual, ms);
+    if (res == LIBUSB_ERROR_TIMEOUT)
+        return 0;
+    if (res < 0)
+    {
+        set_error(t, "Failed to read report", libusb_error_name(res));
+        return -1;
+    }
+    return actual;
+}
+
+static const wchar_t *usb_error(sdp_transport *transport)
+{
+    struct usb_transport *t = (struct usb_transport *)transport;
+    return t->error;
+}
+
+static void usb_close(sdp_transport *transport)
+{
+    struct usb_transport *t = (struct usb_transport *)transport;
+
+    for (int i = 0; i < t->depth; ++i)
+    {
+        if (t->slots[i].busy)
+            libusb_cancel_transfer(t->slots[i].transfer);
+    }
+    /*
+     * Cancelled transfers still complete through the callback, which must
+     * have run before the slots are freed. libusb guarantees it does.
+     */
+    while (t->in_flight)
+    {
+        struct timeval tv = {.tv_sec = 1};
+        libusb_handle_events_timeout_completed(context, &tv, NULL);
+    }
+
+    for (int i = 0; i < t->depth; ++i)
+        libusb_free_transfer(t->slots[i].transfer);
+    libusb_release_interface(t->handle, t->interface);
+    /* Hand the device back to usbhid unless it's gone after a jump */
+    if (t->detached)
+        libusb_attach_kernel_driver(t->handle, t->interface);
+    libusb_close(t->handle);
+    sdp_libusb_exit();
+    free(t);
+}
+
+static int usb_flush(sdp_transport *transport)
+{
+    return drain((struct usb_transport *)transport, 0);
+}
+
+static const struct sdp_transport_ops usb_ops = {
+    .write = usb_write,
+    .read = usb_read,
+    .error = usb_error,
+    .close = usb_close,
+    .flush = usb_flush,
+};
+
+static bool matches_usb_path(libusb_device *dev, const char *usb_path)
+{
+    uint8_t ports[7];
+    int count = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    if (count <= 0)
+        return false;
+
+    /* Same format as the sysfs name, e.g. 3-1.1 */
+    char path[32];
+    int len = snprintf(path, sizeof(path), "%u-%u", libusb_get_bus_number(dev), ports[0]);
+    for (int i = 1; i < count; ++i)
+        len += snprintf(path + len, sizeof(path) - len, ".%u", ports[i]);
+    return !strcmp(path, usb_path);
+}
+
+static int find_hid_interface(libusb_device *dev, int *interface, unsigned char *ep_in, unsigned char *ep_out)
+{
+    struct libusb_config_descriptor *config;
+    if (libusb_get_active_config_descriptor(dev, &config))
+        return 1;
+
+    int res = 1;
+    for (int i = 0; res && i < config->bNumInterfaces; ++i)
+    {
+        if (!config->interface[i].num_altsetting)
+            continue;
+        const struct libusb_interface_descriptor *desc = config->interface[i].altsetting;
+        if (desc->bInterfaceClass != LIBUSB_CLASS_HID)
+            continue;
+
+        *ep_in = *ep_out = 0;
+        for (int j = 0; j < desc->bNumEndpoints; ++j)
+        {
+            const struct libusb_endpoint_descriptor *ep = desc->endpoint + j;
+            if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+                continue;
+            if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+                *ep_in = ep->bEndpointAddress;
+            else
+                *ep_out = ep->bEndpointAddress;
+        }
+        if (*ep_in)
+        {
+            *interface = desc->bInterfaceNumber;
+            res = 0;
+        }
+    }
+
+    libusb_free_config_descriptor(config);
+    return res;
+}
+
+static int open_transport(libusb_device *dev, sdp_transport **transport)
+{
+    int interface;
+    unsigned char ep_in, ep_out;
+    if (find_hid_interface(dev, &interface, &ep_in, &ep_out))
+    {
+        sdp_info("No HID interface found through libusb, falling back to hidapi\n");
+        return 1;
+    }
+
+    libusb_device_handle *handle;
+    int res = libusb_open(dev, &handle);
+    if (res)
+    {
+        sdp_info("Can't open device through libusb (%s), falling back to hidapi\n",
+                 libusb_error_name(res));
+        return 1;
+    }
+
+    bool detached = false;
+    if (libusb_kernel_driver_active(handle, interface) == 1)
+    {
+        res = libusb_detach_kernel_driver(handle, interface);
+        if (res)
+        {
+            sdp_info("Can't detach kernel driver (%s), falling back to hidapi\n",
+                     libusb_error_name(res));
+            goto close_handle;
+        }
+        detached = true;
+    }
+
+    res = libusb_claim_interface(handle, interface);
+    if (res)
+    {
+        sdp_info("Can't claim interface (%s), falling back to hidapi\n", libusb_error_name(res));
+        goto attach_driver;
+    }
+
+    struct usb_transport *t = calloc(1, sizeof(*t) + queue_depth * sizeof(t->slots[0]));
+    if (!t)
+    {
+        sdp_error("ERROR: Failed to allocate transport\n");
+        goto release_interface;
+    }
+    t->base.ops = &usb_ops;
+    /* The interrupt endpoint is only read on demand */
+    t->base.input_buffer = 0;
+    atomic_init(&t->in_flight, 0);
+    t->handle = handle;
+    t->interface = interface;
+    t->detached = detached;
+    t->ep_in = ep_in;
+    t->ep_out = ep_out;
+    t->depth = queue_depth;
+    for (int i = 0; i < t->depth; ++i)
+    {
+        t->slots[i].owner = t;
+        t->slots[i].transfer = libusb_alloc_transfer(0);
+        if (!t->slots[i].transfer)
+        {
+            sdp_error("ERROR: Failed to allocate USB transfer\n");
+            while (i--)
+                libusb_free_transfer(t->slots[i].transfer);
+            free(t);
+            goto release_interface;
+        }
+    }
+
+    *transport = &t->base;
+    return 0;
+
+release_interface:
+    libusb_release_interface(handle, interface);
+attach_driver:
+    if (detached)
+        libusb_attach_kernel_driver(handle, interface);
+close_handle:
+    libusb_close(handle);
+    return 1;
+}
+
+int sdp_libusb_open(uint16_t vid, uint16_t pid, const char *usb_path, sdp_transport **transport)
+{
+    *transport = NULL;
+
+    /* Each transport holds a reference to the context */
+    if (sdp_libusb_init())
+        return 1;
+
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(context, &list);
+    if (count < 0)
+    {
+        sdp_info("Can't list USB devices (%s), falling back to hidapi\n", libusb_error_name(count));
+        sdp_libusb_exit();
+        return 1;
+    }
+
+    int res = -1;
+    for (ssize_t i = 0; res < 0 && i < count; ++i)
+    {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) || desc.idVendor != vid || desc.idProduct != pid)
+            continue;
+        if (usb_path && !matches_usb_path(list[i], usb_path))
+            continue;
+        res = open_transport(list[i], transport);
+    }
+
+    /* An opened device holds its own reference */
+    libusb_free_device_list(list, 1);
+    if (res)
+        sdp_libusb_exit();
+    return res;
+}
@@ -0,0 +1,35 @@
+#ifndef TRANSPORT_LIBUSB_H_
+#define TRANSPORT_LIBUSB_H_
+
+#include "transport.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SDP_LIBUSB_DEFAULT_DEPTH 8
+#define SDP_LIBUSB_MAX_DEPTH 64
+
+/*
+ * Talk to devices through libusb instead of hidapi where possible, keeping up
+ * to depth data reports in flight. A depth of 0 disables libusb.
+ */
+void sdp_libusb_configure(int depth);
+bool sdp_libusb_enabled(void);
+
+/*
+ * All transports share one libusb context, which lives from the first
+ * sdp_libusb_init() until the matching sdp_libusb_exit(). Holding it across
+ * the stages of a run saves setting up a context and scanning the bus for
+ * every open. Returns non-zero if libusb can't be initialized.
+ */
+int sdp_libusb_init(void);
+void sdp_libusb_exit(void);
+
+/*
+ * Open the device vid:pid (on usb_path, if given) through libusb, detaching
+ * the kernel driver from its HID interface. Returns 0 on success, -1 if there
+ * is no such device and 1 if it can't be used through libusb, in which case
+ * the caller should fall back to hidapi.
+ */
+int sdp_libusb_open(uint16_t vid, uint16_t pid, const char *usb_path, sdp_transport **transport);
+
+#endif
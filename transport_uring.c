@@ -0,0 +1,425 @@
+#include "transport_uring.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RING_ENTRIES 256
+#define MAX_BOARDS 32
+/* Data reports collected before they are submitted together */
+#define BATCH_SIZE 16
+#define REPORT_BUFFER_SIZE 1025
+/* A board's registered buffers: the batch plus one for reading */
+#define BOARD_BUFFERS (BATCH_SIZE + 1)
+#define READ_BUFFER BATCH_SIZE
+
+struct request
+{
+    int res;
+    bool done;
+};
+
+struct uring
+{
+    struct io_uring ring;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* One thread at a time waits for completions and hands them out */
+    bool reaping;
+    bool fixed_files;
+    bool fixed_buffers;
+    unsigned char *buffers;
+    bool slot_used[MAX_BOARDS];
+    struct sdp_uring_stats stats;
+};
+
+struct uring_transport
+{
+    sdp_transport base;
+    int fd;
+    int slot;
+    unsigned char *buffers;
+
+    /* Reports written but not submitted yet */
+    size_t lengths[BATCH_SIZE];
+    int queued;
+
+    /* Writes, the read and its timeout of the current submission */
+    struct request requests[BATCH_SIZE + 2];
+    struct __kernel_timespec timeout;
+
+    wchar_t error[128];
+};
+
+static struct uring *uring;
+
+static void set_error(struct uring_transport *t, const char *what, int err)
+{
+    swprintf(t->error, sizeof(t->error) / sizeof(t->error[0]), L"%s: %s", what, strerror(err));
+}
+
+int sdp_uring_init(void)
+{
+    if (uring)
+        return 0;
+
+    struct uring *u = calloc(1, sizeof(*u));
+    if (!u)
+    {
+        sdp_error("ERROR: Failed to allocate io_uring\n");
+        return 1;
+    }
+    int res = io_uring_queue_init(RING_ENTRIES, &u->ring, 0);
+    if (res < 0)
+    {
+        sdp_error("ERROR: Failed to set up io_uring: %s\n", strerror(-res));
+        free(u);
+        return 1;
+    }
+    pthread_mutex_init(&u->lock, NULL);
+    pthread_cond_init(&u->cond, NULL);
+
+    /*
+     * Registered files and buffers save the per-request file lookup and page
+     * pinning. Both are optional, older kernels or a low RLIMIT_MEMLOCK only
+     * cost some efficiency.
+     */
+    u->fixed_files = io_uring_register_files_sparse(&u->ring, MAX_BOARDS) == 0;
+
+    size_t count = MAX_BOARDS * BOARD_BUFFERS;
+    u->buffers = calloc(count, REPORT_BUFFER_SIZE);
+    struct iovec *iov = calloc(count, sizeof(*iov));
+    if (!u->buffers || !iov)
+    {
+        sdp_error("ERROR: Failed to allocate io_uring buffers\n");
+        free(iov);
+        free(u->buffers);
+        io_uring_queue_exit(&u->ring);
+        pthread_cond_destroy(&u->cond);
+        pthread_mutex_destroy(&u->lock);
+        free(u);
+        return 1;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        iov[i].iov_base = u->buffers + i * REPORT_BUFFER_SIZE;
+        iov[i].iov_len = REPORT_BUFFER_SIZE;
+    }
+    u->fixed_buffers = io_uring_register_buffers(&u->ring, iov, count) == 0;
+    free(iov);
+
+    uring = u;
+    return 0;
+}
+
+bool sdp_uring_enabled(void)
+{
+    return uring != NULL;
+}
+
+void sdp_uring_get_stats(struct sdp_uring_stats *stats)
+{
+    pthread_mutex_lock(&uring->lock);
+    *stats = uring->stats;
+    pthread_mutex_unlock(&uring->lock);
+}
+
+void sdp_uring_cleanup(void)
+{
+    if (!uring)
+        return;
+
+    if (uring->stats.reports)
+    {
+        unsigned long saved = uring->stats.reports > uring->stats.syscalls
+                                  ? uring->stats.reports - uring->stats.syscalls
+                                  : 0;
+        sdp_info("io_uring: %lu reports in %lu syscalls (%lu saved)\n",
+                 uring->stats.reports, uring->stats.syscalls, saved);
+    }
+
+    io_uring_queue_exit(&uring->ring);
+    pthread_cond_destroy(&uring->cond);
+    pthread_mutex_destroy(&uring->lock);
+    free(uring->buffers);
+    free(uring);
+    uring = NULL;
+}
+
+static unsigned char *buffer(struct uring_transport *t, int index)
+{
+    return t->buffers + index * REPORT_BUFFER_SIZE;
+}
+
+static void prep_rw(struct uring_transport *t, struct io_uring_sqe *sqe, bool write, int index, size_t length)
+{
+    int fd = uring->fixed_files ? t->slot : t->fd;
+    if (uring->fixed_buffers)
+    {
+        int buf_index = t->slot * BOARD_BUFFERS + index;
+        if (write)
+            io_uring_prep_write_fixed(sqe, fd, buffer(t, index), length, 0, buf_index);
+        else
+            io_uring_prep_read_fixed(sqe, fd, buffer(t, index), length, 0, buf_index);
+    }
+    else if (write)
+        io_uring_prep_write(sqe, fd, buffer(t, index), length, 0);
+    else
+        io_uring_prep_read(sqe, fd, buffer(t, index), length, 0);
+    if (uring->fixed_files)
+        sqe->flags |= IOSQE_FIXED_FILE;
+}
+
+/* Wait until all count requests of t have completed */
+static void wait_requests(struct uring_transport *t, int count)
+{
+    pthread_mutex_lock(&uring->lock);
+    for (;;)
+    {
+        bool done = true;
+        for (int i = 0; done && i < count; ++i)
+            done = t->requests[i].done;
+        if (done)
+            break;
+
+        if (uring->reaping)
+        {
+            pthread_cond_wait(&uring->cond, &uring->lock);
+            continue;
+        }
+
+        uring->reaping = true;
+        struct io_uring_cqe *cqe;
+        if (io_uring_peek_cqe(&uring->ring, &cqe))
+        {
+            pthread_mutex_unlock(&uring->lock);
+            int res = io_uring_wait_cqe(&uring->ring, &cqe);
+            pthread_mutex_lock(&uring->lock);
+            ++uring->stats.syscalls;
+            if (res < 0 && res != -EINTR)
+                sdp_error("ERROR: Failed to wait for io_uring completions: %s\n", strerror(-res));
+        }
+        while (!io_uring_peek_cqe(&uring->ring, &cqe))
+        {
+            struct request *request = io_uring_cqe_get_data(cqe);
+            request->res = cqe->res;
+            request->done = true;
+            io_uring_cqe_seen(&uring->ring, cqe);
+        }
+        uring->reaping = false;
+        pthread_cond_broadcast(&uring->cond);
+    }
+    pthread_mutex_unlock(&uring->lock);
+}
+
+/*
+ * Submit the queued writes, followed by a read of read_length bytes if it is
+ * non-zero, as one linked chain so they execute in order. Returns the result
+ * of the read, 0 if it timed out, or -1 if anything failed.
+ */
+static int submit(struct uring_transport *t, size_t read_length, int timeout)
+{
+    int writes = t->queued;
+    int count = writes + (read_length ? 1 : 0) + (read_length && timeout >= 0 ? 1 : 0);
+    t->queued = 0;
+    if (!count)
+        return 0;
+
+    for (int i = 0; i < count; ++i)
+        t->requests[i].done = false;
+
+    /*
+     * The whole chain goes into the submission queue under the lock, so no
+     * other board's requests end up linked into it.
+     */
+    pthread_mutex_lock(&uring->lock);
+    if (io_uring_sq_space_left(&uring->ring) < (unsigned)count)
+    {
+        pthread_mutex_unlock(&uring->lock);
+        set_error(t, "Failed to submit to io_uring", EBUSY);
+        return -1;
+    }
+    struct io_uring_sqe *sqe;
+    for (int i = 0; i < count; ++i)
+    {
+        sqe = io_uring_get_sqe(&uring->ring);
+        if (i < writes)
+            prep_rw(t, sqe, true, i, t->lengths[i]);
+        else if (i == writes)
+            prep_rw(t, sqe, false, READ_BUFFER, read_length);
+        else
+        {
+            t->timeout.tv_sec = timeout / 1000;
+            t->timeout.tv_nsec = (timeout % 1000) * 1000000ll;
+            io_uring_prep_link_timeout(sqe, &t->timeout, 0);
+        }
+        if (i < count - 1)
+            sqe->flags |= IOSQE_IO_LINK;
+        io_uring_sqe_set_data(sqe, &t->requests[i]);
+    }
+    int res = io_uring_submit(&uring->ring);
+    ++uring->stats.syscalls;
+    uring->stats.reports += writes + (read_length ? 1 : 0);
+    pthread_mutex_unlock(&uring->lock);
+
+    if (res < 0)
+    {
+        set_error(t, "Failed to submit to io_uring", -res);
+        return -1;
+    }
+    wait_requests(t, count);
+
+    for (int i = 0; i < writes; ++i)
+    {
+        struct request *r = &t->requests[i];
+        if (r->res < 0)
+        {
+            set_error(t, "Failed to write report", -r->res);
+            return -1;
+        }
+        if ((size_t)r->res != t->lengths[i])
+        {
+            set_error(t, "Short report write", EIO);
+            return -1;
+        }
+    }
+    if (!read_length)
+        return 0;
+
+    /* The read is cancelled once the linked timeout expires */
+    if (timeout >= 0 && t->requests[writes + 1].res == -ETIME)
+        return 0;
+    struct request *r = &t->requests[writes];
+    if (r->res < 0)
+    {
+        set_error(t, "Failed to read report", -r->res);
+        return -1;
+    }
+    return r->res;
+}
+
+static int uring_write(sdp_transport *transport, const unsigned char *data, size_t length)
+{
+    struct uring_transport *t = (struct uring_transport *)transport;
+    if (length > REPORT_BUFFER_SIZE)
+    {
+        set_error(t, "Failed to write report", EMSGSIZE);
+        return -1;
+    }
+
+    /*
+     * Reports are only collected here. They go out with the next read, when
+     * the batch is full or on close, so a command and its data and response
+     * share a single system call.
+     */
+    memcpy(buffer(t, t->queued), data, length);
+    t->lengths[t->queued++] = length;
+    if (t->queued == BATCH_SIZE && submit(t, 0, -1) < 0)
+        return -1;
+    return length;
+}
+
+static int uring_read(sdp_transport *transport, unsigned char *data, size_t length, int timeout)
+{
+    struct uring_transport *t = (struct uring_transport *)transport;
+    if (length > REPORT_BUFFER_SIZE)
+        length = REPORT_BUFFER_SIZE;
+    int res = submit(t, length, timeout);
+    if (res > 0)
+        memcpy(data, buffer(t, READ_BUFFER), res);
+    return res;
+}
+
+static const wchar_t *uring_error(sdp_transport *transport)
+{
+    struct uring_transport *t = (struct uring_transport *)transport;
+    return t->error;
+}
+
+static void uring_close(sdp_transport *transport)
+{
+    struct uring_transport *t = (struct uring_transport *)transport;
+    if (t->queued && submit(t, 0, -1) < 0)
+        sdp_error("ERROR: Failed to flush reports: %ls\n", t->error);
+
+    pthread_mutex_lock(&uring->lock);
+    if (uring->fixed_files)
+    {
+        int none = -1;
+        io_uring_register_files_update(&uring->ring, t->slot, &none, 1);
+    }
+    uring->slot_used[t->slot] = false;
+    pthread_mutex_unlock(&uring->lock);
+
+    close(t->fd);
+    free(t);
+}
+
+static int uring_flush(sdp_transport *transport)
+{
+    return submit((struct uring_transport *)transport, 0, -1) < 0 ? -1 : 0;
+}
+
+static const struct sdp_transport_ops uring_ops = {
+    .write = uring_write,
+    .read = uring_read,
+    .error = uring_error,
+    .close = uring_close,
+    .flush = uring_flush,
+};
+
+sdp_transport *sdp_uring_transport(int fd)
+{
+    struct uring_transport *t = calloc(1, sizeof(*t));
+    if (!t)
+    {
+        sdp_error("ERROR: Failed to allocate transport\n");
+        close(fd);
+        return NULL;
+    }
+    t->base.ops = &uring_ops;
+    t->base.input_buffer = SDP_HIDRAW_BUFFER_SIZE;
+    t->fd = fd;
+
+    pthread_mutex_lock(&uring->lock);
+    t->slot = -1;
+    for (int i = 0; t->slot < 0 && i < MAX_BOARDS; ++i)
+    {
+        if (!uring->slot_used[i])
+            t->slot = i;
+    }
+    int res = 0;
+    if (t->slot >= 0 && uring->fixed_files)
+        res = io_uring_register_files_update(&uring->ring, t->slot, &fd, 1);
+    if (t->slot >= 0 && res >= 0)
+        uring->slot_used[t->slot] = true;
+    pthread_mutex_unlock(&uring->lock);
+
+    if (t->slot < 0 || res < 0)
+    {
+        if (t->slot < 0)
+            sdp_error("ERROR: More than %d boards on io_uring\n", MAX_BOARDS);
+        else
+            sdp_error("ERROR: Failed to register file with io_uring: %s\n", strerror(-res));
+        close(fd);
+        free(t);
+        return NULL;
+    }
+    t->buffers = uring->buffers + t->slot * BOARD_BUFFERS * REPORT_BUFFER_SIZE;
+    return &t->base;
+}
+
+sdp_transport *sdp_uring_open(const char *devnode)
+{
+    int fd = open(devnode, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        sdp_error("ERROR: Failed to open device \"%s\": %s\n", devnode, strerror(errno));
+        return NULL;
+    }
+    return sdp_uring_transport(fd);
+}
@@ -0,0 +1,30 @@
+#ifndef TRANSPORT_URING_H_
+#define TRANSPORT_URING_H_
+
+#include "transport.h"
+#include <stdbool.h>
+
+struct sdp_uring_stats
+{
+    /* Reports written and read */
+    unsigned long reports;
+    /* io_uring_enter() calls it took, hidapi needs one syscall per report */
+    unsigned long syscalls;
+};
+
+/*
+ * Set up the io_uring shared by all hidraw transports opened afterwards.
+ * Returns non-zero if io_uring is not available.
+ */
+int sdp_uring_init(void);
+bool sdp_uring_enabled(void);
+void sdp_uring_get_stats(struct sdp_uring_stats *stats);
+/* Print the statistics and tear down the ring */
+void sdp_uring_cleanup(void);
+
+/* Open a hidraw device node and move its reports through the shared ring */
+sdp_transport *sdp_uring_open(const char *devnode);
+/* Same for an already open file descriptor, which is closed with the transport */
+sdp_transport *sdp_uring_transport(int fd);
+
+#endif
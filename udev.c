@@ -1,4 +1,6 @@
 #include "udev.h"
+#include "deadline.h"
+#include "log.h"
 #include <errno.h>
 #include <libudev.h>
 #include <poll.h>
@@ -6,12 +8,28 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define RECEIVE_BUFFER_SIZE (1024 * 1024)
+#define INDEX_BUCKETS 64
+
+/* Entry of the index of present hidraw devices */
+struct device
+{
+    struct sdp_udev_event event;
+    /* Found by the last rescan without having been indexed before */
+    bool added;
+    struct device *next;
+};
+
 struct sdp_udev_
 {
     struct udev *udev;
     struct udev_monitor *mon;
+    /* Hashed by USB path, VID and PID */
+    struct device *index[INDEX_BUCKETS];
 };
 
+static int scan_devices(sdp_udev *udev);
+
 sdp_udev *sdp_udev_init()
 {
     sdp_udev *result = calloc(1, sizeof(sdp_udev));
@@ -26,6 +44,9 @@ sdp_udev *sdp_udev_init()
     if (!result->mon)
         goto cleanup;
 
+    /* Events are kept queued until the next stage waits for its device */
+    udev_monitor_set_receive_buffer_size(result->mon, RECEIVE_BUFFER_SIZE);
+
     int ret = udev_monitor_filter_add_match_subsystem_devtype(result->mon, "hidraw", NULL);
     if (ret)
         goto cleanup;
@@ -34,6 +55,13 @@ sdp_udev *sdp_udev_init()
     if (ret)
         goto cleanup;
 
+    /*
+     * Scan only after the monitor is receiving, so a device added in between
+     * shows up in the scan or as an event, or both.
+     */
+    if (scan_devices(result))
+        goto cleanup;
+
     return result;
 
 cleanup:
@@ -42,8 +70,22 @@ out:
     return NULL;
 }
 
+static void clear_index(struct device **index)
+{
+    for (int i = 0; i < INDEX_BUCKETS; ++i)
+    {
+        while (index[i])
+        {
+            struct device *next = index[i]->next;
+            free(index[i]);
+            index[i] = next;
+        }
+    }
+}
+
 void sdp_udev_free(sdp_udev *udev)
 {
+    clear_index(udev->index);
     if (udev->mon)
         udev_monitor_unref(udev->mon);
     if (udev->udev)
@@ -51,84 +93,369 @@ void sdp_udev_free(sdp_udev *udev)
     free(udev);
 }
 
-char *sdp_udev_wait(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *usb_path, int timeout)
+struct match
+{
+    uint16_t vid;
+    uint16_t pid;
+    const char *usb_path;
+    struct sdp_udev_event event;
+    char *devnode;
+};
+
+static bool find_match(const struct sdp_udev_event *event, void *arg)
 {
-    char vid_str[5], pid_str[5];
-    sprintf(vid_str, "%04x", vid);
-    sprintf(pid_str, "%04x", pid);
+    struct match *match = arg;
+    if (event->vid != match->vid || event->pid != match->pid ||
+        (match->usb_path && strcmp(event->usb_path, match->usb_path)))
+        return false;
+    match->devnode = strdup(event->devnode);
+    return true;
+}
 
-    char *result = NULL;
-    int ret;
+char *sdp_udev_wait(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *usb_path, int64_t deadline)
+{
     struct pollfd pollfd = {
         .fd = udev_monitor_get_fd(udev->mon),
         .events = POLLIN,
     };
-    while (!result && (ret = poll(&pollfd, 1, timeout)))
+    /* Unrelated hidraw events must not extend the wait */
+    for (;;)
     {
+        int ret = poll(&pollfd, 1, sdp_deadline_timeout(deadline, -1));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return NULL;
         if ((pollfd.revents & POLLIN) == 0)
         {
-            printf("poll failed: revents=0x%x\n", pollfd.revents);
-            break;
+            sdp_info("poll failed: revents=0x%x\n", pollfd.revents);
+            return NULL;
         }
-        struct udev_device *dev = udev_monitor_receive_device(udev->mon);
-        if (!dev)
+
+        struct match match = {
+            .vid = vid,
+            .pid = pid,
+            .usb_path = usb_path,
+        };
+        int res = sdp_udev_receive(udev, &match.event);
+        /* The add event may have been lost, but then the rescan found the device */
+        if (res < 0)
+            sdp_udev_enumerate_added(udev, find_match, &match);
+        else if (!res && match.event.add)
+            find_match(&match.event, &match);
+        if (match.devnode)
+            return match.devnode;
+    }
+}
+
+void sdp_udev_update(sdp_udev *udev)
+{
+    struct pollfd pollfd = {
+        .fd = udev_monitor_get_fd(udev->mon),
+        .events = POLLIN,
+    };
+    while (poll(&pollfd, 1, 0) > 0 && (pollfd.revents & POLLIN))
+    {
+        struct sdp_udev_event event;
+        sdp_udev_receive(udev, &event);
+    }
+}
+
+int sdp_udev_get_fd(sdp_udev *udev)
+{
+    return udev_monitor_get_fd(udev->mon);
+}
+
+static int parse_hex_id(const char *s, uint16_t *value)
+{
+    char *end;
+    if (!s)
+        return 1;
+    unsigned long ul = strtoul(s, &end, 16);
+    if (s == end || ul > UINT16_MAX)
+        return 1;
+    *value = (uint16_t)ul;
+    return 0;
+}
+
+static int speed_mbps(struct udev_device *dev)
+{
+    const char *speed = udev_device_get_sysattr_value(dev, "speed");
+    return speed ? atoi(speed) : 0;
+}
+
+/*
+ * Work out the domains of scheduler.h from the parents of the USB device. Root
+ * hubs only stand for their bus. A full or low speed device is served by the
+ * transaction translator of the first high speed hub above it, which has one
+ * TT per port if its bDeviceProtocol is 2.
+ */
+static void fill_route(struct udev_device *usb, struct sdp_route *route)
+{
+    memset(route, 0, sizeof(*route));
+    const char *busnum = udev_device_get_sysattr_value(usb, "busnum");
+    if (busnum)
+        snprintf(route->domains[0], SDP_DOMAIN_SIZE, "bus:%s", busnum);
+
+    struct udev_device *hub = udev_device_get_parent_with_subsystem_devtype(usb, "usb", "usb_device");
+    if (!hub || !udev_device_get_parent_with_subsystem_devtype(hub, "usb", "usb_device"))
+        return;
+    snprintf(route->domains[1], SDP_DOMAIN_SIZE, "hub:%s", udev_device_get_sysname(hub));
+
+    int speed = speed_mbps(usb);
+    if (!speed || speed >= 480)
+        return;
+    struct udev_device *child = usb;
+    for (struct udev_device *parent; (parent = udev_device_get_parent_with_subsystem_devtype(hub, "usb", "usb_device"));
+         child = hub, hub = parent)
+    {
+        if (speed_mbps(hub) != 480)
             continue;
-        struct udev_device *parent = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device");
-        if (!parent)
-            goto unref_dev;
-        // Use VID/PID from the environment properties instead of sysattr
-        // because the latter is not available yet.
-        const char *vid_prop = udev_device_get_property_value(parent, "ID_VENDOR_ID");
-        if (!vid_prop || strcmp(vid_str, vid_prop))
-            goto unref_dev;
-        const char *pid_prop = udev_device_get_property_value(parent, "ID_MODEL_ID");
-        if (!pid_prop || strcasecmp(pid_str, pid_prop))
-            goto unref_dev;
-        if (usb_path && strcmp(udev_device_get_sysname(parent), usb_path))
-            goto unref_dev;
-        const char *devnode = udev_device_get_devnode(dev);
-        if (!devnode)
-            goto unref_dev;
 
-        // got the device path to our device, return a copy
-        result = malloc(strlen(devnode) + 1);
-        strcpy(result, devnode);
+        const char *protocol = udev_device_get_sysattr_value(hub, "bDeviceProtocol");
+        const char *port = strrchr(udev_device_get_sysname(child), '.');
+        if (protocol && atoi(protocol) == 2 && port)
+            snprintf(route->domains[2], SDP_DOMAIN_SIZE, "tt:%s:%s", udev_device_get_sysname(hub), port + 1);
+        else
+            snprintf(route->domains[2], SDP_DOMAIN_SIZE, "tt:%s", udev_device_get_sysname(hub));
+        return;
+    }
+}
+
+static int fill_event(struct udev_device *dev, struct sdp_udev_event *event)
+{
+    struct udev_device *parent = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device");
+    if (!parent)
+        return 1;
 
-    unref_dev:
-        udev_device_unref(dev);
+    // Prefer the environment properties over sysattr because the latter is
+    // not available yet for freshly added devices.
+    const char *vid = udev_device_get_property_value(parent, "ID_VENDOR_ID");
+    if (!vid)
+        vid = udev_device_get_sysattr_value(parent, "idVendor");
+    const char *pid = udev_device_get_property_value(parent, "ID_MODEL_ID");
+    if (!pid)
+        pid = udev_device_get_sysattr_value(parent, "idProduct");
+    if (parse_hex_id(vid, &event->vid) || parse_hex_id(pid, &event->pid))
+        return 1;
+
+    const char *devnode = udev_device_get_devnode(dev);
+    const char *sysname = udev_device_get_sysname(parent);
+    if (!devnode || !sysname)
+        return 1;
+    if (strlen(devnode) >= sizeof(event->devnode) || strlen(sysname) >= sizeof(event->usb_path))
+        return 1;
+    strcpy(event->devnode, devnode);
+    strcpy(event->usb_path, sysname);
+    fill_route(parent, &event->route);
+
+    return 0;
+}
+
+static struct device **bucket(struct device **index, uint16_t vid, uint16_t pid, const char *usb_path)
+{
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ vid) * 16777619u;
+    hash = (hash ^ pid) * 16777619u;
+    for (const char *p = usb_path; *p; ++p)
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    return index + hash % INDEX_BUCKETS;
+}
+
+/*
+ * Removal only knows the device node, as the USB parent is gone by then, so
+ * it has to look at every entry. That is rare compared to lookups.
+ */
+static void remove_device(sdp_udev *udev, const char *devnode)
+{
+    for (int i = 0; i < INDEX_BUCKETS; ++i)
+    {
+        for (struct device **p = udev->index + i; *p; p = &(*p)->next)
+        {
+            if (!strcmp((*p)->event.devnode, devnode))
+            {
+                struct device *device = *p;
+                *p = device->next;
+                free(device);
+                return;
+            }
+        }
     }
-    return result;
 }
 
-bool sdp_udev_matching_usb_path(sdp_udev *udev, const char *device_path, const char *usb_path)
+static void add_device(sdp_udev *udev, const struct sdp_udev_event *event)
 {
-    bool result = false;
+    /* The node may have been reused without us seeing the removal */
+    remove_device(udev, event->devnode);
 
-    const char *sysname = strstr(device_path, "hidraw");
-    if (!sysname)
+    struct device *device = malloc(sizeof(*device));
+    if (!device)
+        return;
+    device->event = *event;
+    device->added = false;
+    struct device **head = bucket(udev->index, event->vid, event->pid, event->usb_path);
+    device->next = *head;
+    *head = device;
+}
+
+static bool is_indexed(struct device **index, const struct sdp_udev_event *event)
+{
+    for (struct device *device = *bucket(index, event->vid, event->pid, event->usb_path); device;
+         device = device->next)
     {
-        fprintf(stderr, "ERROR: Device has unexpected path (no hidraw device?): %s\n", device_path);
-        goto out;
+        if (!strcmp(device->event.usb_path, event->usb_path) && !strcmp(device->event.devnode, event->devnode))
+            return true;
     }
+    return false;
+}
 
-    struct udev_device *dev = udev_device_new_from_subsystem_sysname(udev->udev, "hidraw", sysname);
+/*
+ * The kernel drops events when the receive buffer overflows, which leaves the
+ * index stale until it is built from scratch. Devices which weren't indexed
+ * before are marked, their add events were among the lost ones.
+ */
+static int rescan_devices(sdp_udev *udev)
+{
+    sdp_info("Missed udev events, rescanning hidraw devices\n");
+    struct device *old[INDEX_BUCKETS];
+    memcpy(old, udev->index, sizeof(old));
+    memset(udev->index, 0, sizeof(udev->index));
+    scan_devices(udev);
+
+    for (int i = 0; i < INDEX_BUCKETS; ++i)
+    {
+        for (struct device *device = udev->index[i]; device; device = device->next)
+            device->added = !is_indexed(old, &device->event);
+    }
+    clear_index(old);
+    return -1;
+}
+
+int sdp_udev_receive(sdp_udev *udev, struct sdp_udev_event *event)
+{
+    errno = 0;
+    struct udev_device *dev = udev_monitor_receive_device(udev->mon);
     if (!dev)
+        return errno == ENOBUFS ? rescan_devices(udev) : 1;
+
+    const char *action = udev_device_get_action(dev);
+    event->add = action && !strcmp(action, "add");
+
+    int res;
+    if (action && !strcmp(action, "remove"))
     {
-        fprintf(stderr, "ERROR: Cannot open udev device for %s: %s\n", device_path, strerror(errno));
-        goto out;
+        const char *devnode = udev_device_get_devnode(dev);
+        if (devnode)
+            remove_device(udev, devnode);
+        res = 1;
+    }
+    else
+    {
+        res = fill_event(dev, event);
+        if (!res && event->add)
+            add_device(udev, event);
     }
+    udev_device_unref(dev);
+    return res;
+}
 
-    struct udev_device *parent = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device");
-    if (!parent)
+static int scan_devices(sdp_udev *udev)
+{
+    int res = 1;
+
+    struct udev_enumerate *enumerate = udev_enumerate_new(udev->udev);
+    if (!enumerate)
+    {
+        sdp_error("ERROR: Failed to enumerate hidraw devices\n");
+        return 1;
+    }
+    if (udev_enumerate_add_match_subsystem(enumerate, "hidraw") ||
+        udev_enumerate_scan_devices(enumerate))
     {
-        fprintf(stderr, "ERROR: Failed to find USB device parent for %s: %s\n", device_path, strerror(errno));
-        goto unref_device;
+        sdp_error("ERROR: Failed to enumerate hidraw devices\n");
+        goto unref_enumerate;
     }
 
-    result = !strcmp(usb_path, udev_device_get_sysname(parent));
+    struct udev_list_entry *entry;
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate))
+    {
+        struct udev_device *dev = udev_device_new_from_syspath(udev->udev, udev_list_entry_get_name(entry));
+        if (!dev)
+            continue;
 
-unref_device:
-    udev_device_unref(dev);
-out:
-    return result;
+        struct sdp_udev_event event = {
+            .add = true,
+        };
+        if (!fill_event(dev, &event))
+            add_device(udev, &event);
+
+        udev_device_unref(dev);
+    }
+    res = 0;
+
+unref_enumerate:
+    udev_enumerate_unref(enumerate);
+    return res;
+}
+
+static int enumerate(sdp_udev *udev, bool added, sdp_udev_callback callback, void *arg)
+{
+    for (int i = 0; i < INDEX_BUCKETS; ++i)
+    {
+        for (struct device *device = udev->index[i]; device; device = device->next)
+        {
+            if ((!added || device->added) && callback(&device->event, arg))
+                return 0;
+        }
+    }
+    return 0;
+}
+
+int sdp_udev_enumerate(sdp_udev *udev, sdp_udev_callback callback, void *arg)
+{
+    return enumerate(udev, false, callback, arg);
+}
+
+int sdp_udev_enumerate_added(sdp_udev *udev, sdp_udev_callback callback, void *arg)
+{
+    return enumerate(udev, true, callback, arg);
+}
+
+char *sdp_udev_find(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *usb_path)
+{
+    if (!usb_path)
+    {
+        for (int i = 0; i < INDEX_BUCKETS; ++i)
+        {
+            for (struct device *device = udev->index[i]; device; device = device->next)
+            {
+                if (device->event.vid == vid && device->event.pid == pid)
+                    return strdup(device->event.devnode);
+            }
+        }
+        return NULL;
+    }
+
+    for (struct device *device = *bucket(udev->index, vid, pid, usb_path); device; device = device->next)
+    {
+        if (device->event.vid == vid && device->event.pid == pid && !strcmp(device->event.usb_path, usb_path))
+            return strdup(device->event.devnode);
+    }
+    return NULL;
+}
+
+int sdp_udev_route(sdp_udev *udev, const char *devnode, struct sdp_route *route)
+{
+    for (int i = 0; i < INDEX_BUCKETS; ++i)
+    {
+        for (struct device *device = udev->index[i]; device; device = device->next)
+        {
+            if (!strcmp(device->event.devnode, devnode))
+            {
+                *route = device->event.route;
+                return 0;
+            }
+        }
+    }
+    return 1;
 }
@@ -1,15 +1,61 @@
 #ifndef UDEV_H_
 #define UDEV_H_
 
+#include "scheduler.h"
 #include <stdint.h>
 #include <stdbool.h>
 
 struct sdp_udev_;
 typedef struct sdp_udev_ sdp_udev;
 
+/*
+ * Create a monitor for hidraw devices and an index of the present ones by
+ * USB path and VID/PID. The index is updated from every event received
+ * through sdp_udev_receive(), sdp_udev_wait() or sdp_udev_update(). Events
+ * are queued from here on, so a device added before anyone looks for it
+ * isn't missed.
+ */
 sdp_udev *sdp_udev_init();
 void sdp_udev_free(sdp_udev *udev);
-char *sdp_udev_wait(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *usb_path, int timeout);
-bool sdp_udev_matching_usb_path(sdp_udev *udev, const char *device_path, const char *usb_path);
+/*
+ * Return the device node of the first matching device added from now on, or
+ * NULL if none shows up before deadline (see deadline.h).
+ */
+char *sdp_udev_wait(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *usb_path, int64_t deadline);
+/* Apply the queued events to the index without waiting */
+void sdp_udev_update(sdp_udev *udev);
+
+struct sdp_udev_event
+{
+    bool add;
+    uint16_t vid;
+    uint16_t pid;
+    char devnode[64];
+    char usb_path[64];
+    /* Where the device sits in the USB topology, see scheduler.h */
+    struct sdp_route route;
+};
+
+/* Return true from the callback to stop the enumeration */
+typedef bool (*sdp_udev_callback)(const struct sdp_udev_event *event, void *arg);
+
+int sdp_udev_get_fd(sdp_udev *udev);
+/*
+ * Receive the next event into event and apply it to the index. Returns 0 on
+ * success, 1 if there was no usable event and -1 if events were lost, in
+ * which case the index has been rebuilt from the present devices.
+ */
+int sdp_udev_receive(sdp_udev *udev, struct sdp_udev_event *event);
+/* Call callback for every device in the index */
+int sdp_udev_enumerate(sdp_udev *udev, sdp_udev_callback callback, void *arg);
+/*
+ * Call callback for every device the last rescan found that wasn't indexed
+ * before, i.e. those whose add events were lost
+ */
+int sdp_udev_enumerate_added(sdp_udev *udev, sdp_udev_callback callback, void *arg);
+/* Look up a device in the index, any USB path matches if usb_path is NULL */
+char *sdp_udev_find(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *usb_path);
+/* Copy the route of the device with node devnode from the index */
+int sdp_udev_route(sdp_udev *udev, const char *devnode, struct sdp_route *route);
 
 #endif